@@ -0,0 +1,623 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#include "asm/types.h"
+#include "archive.h"
+#include "crtools.h"
+#include "cr_options.h"
+#include "image.h"
+#include "list.h"
+#include "lock.h"
+#include "log.h"
+#include "magic.h"
+#include "servicefd.h"
+#include "syscall.h"
+#include "util.h"
+#include "xmalloc.h"
+
+#undef	LOG_PREFIX
+#define LOG_PREFIX "archive: "
+
+/* That many images can be put into one archive */
+#define ARCHIVE_MAX_IMAGES	(1 << 18)
+
+#define AI_DUMP			0x1	/* written into the archive */
+#define AI_TAIL			0x2	/* written right at the archive end */
+
+/*
+ * Image which data is not at the start of the fd it's read
+ * or written with (see img_raw_off) or that is buffered till
+ * it's closed.
+ */
+struct archive_img {
+	char			name[ARCHIVE_NAME_LEN];
+	unsigned int		flags;
+	off_t			off;		/* of the data in the fd */
+	off_t			size;		/* for the read and pending ones */
+	struct list_head	l;
+};
+
+/*
+ * Dump side. Images are written by criu and by what it forks
+ * (e.g. the namespaces dumpers), so the archive end and index
+ * live in shared memory.
+ *
+ * Most of the images are small, these are written into a memfd
+ * and are copied to the archive end on close. The pages image is
+ * written right at the end, so while it's open the end is locked
+ * and images closed by the same criu meanwhile are put after it.
+ * Other processes wait for it, so don't fork while one is open.
+ */
+struct archive_state {
+	mutex_t			lock;
+	pid_t			tail_owner;
+	u64			end;
+	unsigned int		nr;
+	struct archive_entry	entries[ARCHIVE_MAX_IMAGES];
+};
+
+static struct archive_state *arch;
+static int arch_fd = -1;
+static bool arch_failed;
+static LIST_HEAD(pending_imgs);
+static int pending_fd = -1;
+static off_t pending_size;
+
+int archive_create(void)
+{
+	struct archive_head h = { .magic = ARCHIVE_MAGIC, };
+
+	BUG_ON(arch);
+
+	arch = mmap(NULL, sizeof(*arch), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANON | MAP_NORESERVE, 0, 0);
+	if (arch == MAP_FAILED) {
+		pr_perror("Can't map archive index");
+		arch = NULL;
+		return -1;
+	}
+
+	arch_fd = openat(get_service_fd(IMG_FD_OFF), ARCHIVE_NAME,
+			O_RDWR | O_CREAT | O_TRUNC, CR_FD_PERM);
+	if (arch_fd < 0) {
+		pr_perror("Can't create " ARCHIVE_NAME);
+		goto err;
+	}
+
+	if (write(arch_fd, &h, sizeof(h)) != sizeof(h)) {
+		pr_perror("Can't write archive head");
+		goto err;
+	}
+
+	mutex_init(&arch->lock);
+	arch->end = sizeof(h);
+	arch_failed = false;
+
+	pr_info("Writing images into " ARCHIVE_NAME "\n");
+	return 0;
+
+err:
+	close_safe(&arch_fd);
+	munmap(arch, sizeof(*arch));
+	arch = NULL;
+	return -1;
+}
+
+static int archive_add_entry(struct archive_img *ai, u64 off, u64 size)
+{
+	struct archive_entry *e;
+
+	if (arch->nr >= ARCHIVE_MAX_IMAGES) {
+		pr_err("Too many images, %s doesn't fit\n", ai->name);
+		return -1;
+	}
+
+	e = &arch->entries[arch->nr++];
+	strncpy(e->name, ai->name, sizeof(e->name));
+	e->off = off;
+	e->size = size;
+	return 0;
+}
+
+/* Copies @size bytes from the start of @fd to where @to is at */
+static int copy_image(int to, int fd, off_t size, const char *name)
+{
+	off_t off = 0;
+
+	while (off < size) {
+		ssize_t ret;
+
+		ret = sendfile(to, fd, &off, size - off);
+		if (ret <= 0) {
+			pr_perror("Can't copy %s", name);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Puts the buffered image at the archive end, with lock held */
+static int archive_append(struct archive_img *ai, int fd)
+{
+	off_t size;
+
+	size = lseek(fd, 0, SEEK_END);
+	if (size < 0 || lseek(arch_fd, arch->end, SEEK_SET) < 0) {
+		pr_perror("Can't seek to put %s", ai->name);
+		return -1;
+	}
+
+	if (copy_image(arch_fd, fd, size, ai->name))
+		return -1;
+
+	if (archive_add_entry(ai, arch->end, size))
+		return -1;
+
+	arch->end += size;
+	return 0;
+}
+
+/*
+ * Images closed while the pages one is written are collected in
+ * one buffer not to keep an fd per each.
+ */
+static int archive_queue(struct archive_img *ai, int fd)
+{
+	off_t size;
+
+	if (pending_fd < 0) {
+		pending_fd = sys_memfd_create("pending", 0);
+		if (pending_fd < 0) {
+			errno = -pending_fd;
+			pr_perror("Can't create pending images buffer");
+			return -1;
+		}
+	}
+
+	size = lseek(fd, 0, SEEK_END);
+	if (size < 0) {
+		pr_perror("Can't seek %s", ai->name);
+		return -1;
+	}
+
+	if (copy_image(pending_fd, fd, size, ai->name))
+		return -1;
+
+	ai->off = pending_size;
+	ai->size = size;
+	pending_size += size;
+	list_add_tail(&ai->l, &pending_imgs);
+	return 0;
+}
+
+static int archive_flush_pending(void)
+{
+	struct archive_img *ai, *n;
+	int ret = 0;
+
+	if (pending_fd < 0)
+		return 0;
+
+	if (lseek(arch_fd, arch->end, SEEK_SET) < 0 ||
+	    copy_image(arch_fd, pending_fd, pending_size, "pending images"))
+		ret = -1;
+
+	list_for_each_entry_safe(ai, n, &pending_imgs, l) {
+		if (!ret && archive_add_entry(ai, arch->end + ai->off, ai->size))
+			ret = -1;
+		list_del(&ai->l);
+		xfree(ai);
+	}
+
+	arch->end += pending_size;
+	pending_size = 0;
+	close_safe(&pending_fd);
+	return ret;
+}
+
+static int archive_create_image(struct cr_img *img, int type, char *path)
+{
+	struct archive_img *ai;
+	int fd;
+
+	ai = xzalloc(sizeof(*ai));
+	if (!ai)
+		return -1;
+
+	strncpy(ai->name, path, sizeof(ai->name));
+	ai->flags = AI_DUMP;
+
+	if (type == CR_FD_PAGES && arch->tail_owner != getpid()) {
+		mutex_lock(&arch->lock);
+
+		fd = openat(get_service_fd(IMG_FD_OFF), ARCHIVE_NAME, O_RDWR);
+		if (fd < 0) {
+			pr_perror("Can't open " ARCHIVE_NAME " for %s", path);
+			mutex_unlock(&arch->lock);
+			goto err;
+		}
+
+		/* Pages are mapped on restore, see map_pages_image */
+		ai->off = round_up(arch->end, PAGE_SIZE);
+		if (lseek(fd, ai->off, SEEK_SET) < 0) {
+			pr_perror("Can't seek to %s", path);
+			close(fd);
+			mutex_unlock(&arch->lock);
+			goto err;
+		}
+
+		ai->flags |= AI_TAIL;
+		arch->tail_owner = getpid();
+	} else {
+		/* The second pages image while the first one is open too */
+		fd = sys_memfd_create(path, 0);
+		if (fd < 0) {
+			errno = -fd;
+			pr_perror("Can't create buffer for %s", path);
+			goto err;
+		}
+	}
+
+	img->_x.fd = fd;
+	img->ar = ai;
+	return 1;
+
+err:
+	xfree(ai);
+	return -1;
+}
+
+static void archive_close_tail(struct cr_img *img, struct archive_img *ai)
+{
+	struct stat st;
+	off_t size = 0;
+
+	if (fstat(img->_x.fd, &st)) {
+		pr_perror("Can't stat %s", ai->name);
+		arch_failed = true;
+	} else if (st.st_size > ai->off)
+		size = st.st_size - ai->off;
+
+	if (archive_add_entry(ai, ai->off, size))
+		arch_failed = true;
+	else if (size)
+		arch->end = ai->off + size;
+
+	arch->tail_owner = 0;
+
+	if (archive_flush_pending())
+		arch_failed = true;
+
+	mutex_unlock(&arch->lock);
+}
+
+void archive_close_image(struct cr_img *img)
+{
+	struct archive_img *ai = img->ar;
+
+	img->ar = NULL;
+
+	if (!(ai->flags & AI_DUMP))
+		goto out;
+
+	if (bfd_buffered(&img->_x) && bflush(&img->_x)) {
+		pr_perror("Can't flush %s", ai->name);
+		arch_failed = true;
+	}
+
+	if (ai->flags & AI_TAIL)
+		archive_close_tail(img, ai);
+	else if (arch->tail_owner == getpid()) {
+		if (archive_queue(ai, img->_x.fd))
+			arch_failed = true;
+		else
+			ai = NULL;
+	} else {
+		mutex_lock(&arch->lock);
+		if (archive_append(ai, img->_x.fd))
+			arch_failed = true;
+		mutex_unlock(&arch->lock);
+	}
+out:
+	bclose(&img->_x);
+	xfree(ai);
+}
+
+static int archive_write_index(void)
+{
+	struct archive_tail t = { .magic = ARCHIVE_MAGIC, };
+	ssize_t len;
+
+	if (arch->tail_owner) {
+		pr_err("Pages image is still being written\n");
+		return -1;
+	}
+
+	t.nr = arch->nr;
+	t.index_off = round_up(arch->end, sizeof(u64));
+	len = t.nr * sizeof(struct archive_entry);
+
+	if (pwrite(arch_fd, arch->entries, len, t.index_off) != len ||
+	    pwrite(arch_fd, &t, sizeof(t), t.index_off + len) != sizeof(t)) {
+		pr_perror("Can't write archive index");
+		return -1;
+	}
+
+	pr_info("Put %u images into archive, %"PRIu64" bytes\n",
+			t.nr, t.index_off + len + sizeof(t));
+	return 0;
+}
+
+/*
+ * Without the index the archive is useless, so if the dump has
+ * failed it's removed just like the inventory is.
+ */
+int archive_finish(bool commit)
+{
+	int ret = 0;
+
+	if (!arch)
+		return 0;
+
+	if (commit) {
+		if (arch_failed)
+			ret = -1;
+		else
+			ret = archive_write_index();
+	}
+
+	if (!commit || ret)
+		unlinkat(get_service_fd(IMG_FD_OFF), ARCHIVE_NAME, 0);
+
+	close_safe(&arch_fd);
+	munmap(arch, sizeof(*arch));
+	arch = NULL;
+
+	return ret;
+}
+
+/*
+ * Restore side. Archives are looked for in any dir images are
+ * read from, as the parent snapshots can be archived or not.
+ */
+struct archive_index {
+	dev_t			dev;
+	ino_t			ino;
+	unsigned int		nr;
+	struct archive_entry	*entries;	/* sorted, NULL if no archive */
+	struct list_head	l;
+};
+
+static LIST_HEAD(archive_indices);
+
+static int entry_cmp(const void *a, const void *b)
+{
+	const struct archive_entry *ea = a, *eb = b;
+
+	return strncmp(ea->name, eb->name, ARCHIVE_NAME_LEN);
+}
+
+static int archive_load_index(int dfd, struct archive_index *idx)
+{
+	struct archive_entry *entries = NULL;
+	struct archive_head h;
+	struct archive_tail t;
+	struct stat st;
+	ssize_t len;
+	int fd, ret = -1;
+
+	fd = openat(dfd, ARCHIVE_NAME, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return 0;
+
+		pr_perror("Can't open " ARCHIVE_NAME);
+		return -1;
+	}
+
+	if (fstat(fd, &st)) {
+		pr_perror("Can't stat " ARCHIVE_NAME);
+		goto out;
+	}
+
+	if (st.st_size < sizeof(h) + sizeof(t) ||
+	    pread(fd, &h, sizeof(h), 0) != sizeof(h) ||
+	    pread(fd, &t, sizeof(t), st.st_size - sizeof(t)) != sizeof(t)) {
+		pr_err("Can't read archive head and tail\n");
+		goto out;
+	}
+
+	if (h.magic != ARCHIVE_MAGIC || t.magic != ARCHIVE_MAGIC) {
+		pr_err("Archive is corrupted or incomplete\n");
+		goto out;
+	}
+
+	len = t.nr * sizeof(*entries);
+	if (t.index_off + len + sizeof(t) != st.st_size) {
+		pr_err("Archive index is corrupted\n");
+		goto out;
+	}
+
+	entries = xmalloc(len ? : 1);
+	if (!entries)
+		goto out;
+
+	if (pread(fd, entries, len, t.index_off) != len) {
+		pr_perror("Can't read archive index");
+		xfree(entries);
+		goto out;
+	}
+
+	qsort(entries, t.nr, sizeof(*entries), entry_cmp);
+
+	idx->entries = entries;
+	idx->nr = t.nr;
+	pr_info("Found archive with %u images\n", t.nr);
+	ret = 0;
+out:
+	close(fd);
+	return ret;
+}
+
+static struct archive_index *archive_get_index(int dfd)
+{
+	struct archive_index *idx;
+	struct stat st;
+
+	if (fstat(dfd, &st)) {
+		pr_perror("Can't stat images dir");
+		return NULL;
+	}
+
+	list_for_each_entry(idx, &archive_indices, l)
+		if (idx->dev == st.st_dev && idx->ino == st.st_ino)
+			return idx;
+
+	idx = xzalloc(sizeof(*idx));
+	if (!idx)
+		return NULL;
+
+	if (archive_load_index(dfd, idx)) {
+		xfree(idx);
+		return NULL;
+	}
+
+	idx->dev = st.st_dev;
+	idx->ino = st.st_ino;
+	list_add(&idx->l, &archive_indices);
+	return idx;
+}
+
+static int archive_read_image(struct cr_img *img, int dfd, int type,
+			      int flags, char *path)
+{
+	struct archive_entry key = { }, *e;
+	struct archive_index *idx;
+	struct archive_img *ai;
+	off_t off, end;
+	int fd, mfd;
+
+	idx = archive_get_index(dfd);
+	if (!idx)
+		return -1;
+	if (!idx->entries)
+		return 0;
+
+	strncpy(key.name, path, sizeof(key.name));
+	e = bsearch(&key, idx->entries, idx->nr, sizeof(*e), entry_cmp);
+	if (!e)
+		/* Pages received by page server are not archived */
+		return 0;
+
+	fd = openat(dfd, ARCHIVE_NAME, flags);
+	if (fd < 0) {
+		pr_perror("Can't open " ARCHIVE_NAME " for %s", path);
+		return -1;
+	}
+
+	if (type == CR_FD_PAGES) {
+		ai = xzalloc(sizeof(*ai));
+		if (!ai) {
+			close(fd);
+			return -1;
+		}
+
+		strncpy(ai->name, path, sizeof(ai->name));
+		ai->off = e->off;
+		ai->size = e->size;
+	
+		img->_x.fd = fd;
+		img->ar = ai;
+		return 1;
+	}
+
+	/* The rest is read with bfd that reads till EOF */
+	mfd = sys_memfd_create(path, 0);
+	if (mfd < 0) {
+		errno = -mfd;
+		pr_perror("Can't create buffer for %s", path);
+		close(fd);
+		return -1;
+	}
+
+	off = e->off;
+	end = e->off + e->size;
+	while (off < end) {
+		ssize_t ret;
+
+		ret = sendfile(mfd, fd, &off, end - off);
+		if (ret <= 0) {
+			pr_perror("Can't read %s from archive", path);
+			close(mfd);
+			close(fd);
+			return -1;
+		}
+	}
+
+	close(fd);
+
+	if (lseek(mfd, 0, SEEK_SET)) {
+		pr_perror("Can't rewind %s", path);
+		close(mfd);
+		return -1;
+	}
+
+	img->_x.fd = mfd;
+	return 1;
+}
+
+/*
+ * Returns 1 if the image is in the archive and is open, 0 if it's
+ * not there and should be opened as a file.
+ */
+int archive_open_image(struct cr_img *img, int dfd, int type,
+		       int flags, char *path)
+{
+	bool images_dir = (dfd == get_service_fd(IMG_FD_OFF));
+
+	if (dfd == AT_FDCWD || strlen(path) >= ARCHIVE_NAME_LEN)
+		return 0;
+
+	if (arch && images_dir) {
+		if (!(flags & O_CREAT))
+			/* Not read back on dump */
+			return 0;
+
+		return archive_create_image(img, type, path);
+	}
+
+	if (flags & O_CREAT)
+		return 0;
+
+	return archive_read_image(img, dfd, type, flags, path);
+}
+
+off_t img_raw_off(struct cr_img *img)
+{
+	return img->ar ? img->ar->off : 0;
+}
+
+int img_raw_size(struct cr_img *img, off_t *size)
+{
+	struct stat st;
+
+	if (img->ar && !(img->ar->flags & AI_DUMP)) {
+		*size = img->ar->size;
+		return 0;
+	}
+
+	if (fstat(img_raw_fd(img), &st)) {
+		pr_perror("Can't stat image");
+		return -1;
+	}
+
+	*size = st.st_size > img_raw_off(img) ? st.st_size - img_raw_off(img) : 0;
+	return 0;
+}
@@ -3,6 +3,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/uio.h>
 #include <errno.h>
@@ -108,7 +109,6 @@ int bfdopenw(struct bfd *f)
 	return bfdopen(f, true);
 }
 
-static int bflush(struct bfd *bfd);
 static bool flush_failed = false;
 
 int bfd_flush_images(void)
@@ -228,7 +228,7 @@ again:
 	goto again;
 }
 
-static int bflush(struct bfd *bfd)
+int bflush(struct bfd *bfd)
 {
 	struct xbuf *b = &bfd->b;
 	int ret;
@@ -325,3 +325,61 @@ int bread(struct bfd *bfd, void *buf, int size)
 
 	return more < 0 ? more : filled;
 }
+
+/*
+ * Reads everything left in the file into one buffer, for those
+ * parsing the whole file at once. The file size is only a hint,
+ * so the buffer grows if the file turns out to be longer.
+ */
+ssize_t bread_all(struct bfd *bfd, void **pbuf)
+{
+	struct xbuf *b = &bfd->b;
+	size_t size = 16 * BUFSIZE, len = 0;
+	struct stat st;
+	off_t pos;
+	char *buf;
+
+	pos = lseek(bfd->fd, 0, SEEK_CUR);
+	if (pos >= 0 && !fstat(bfd->fd, &st) && st.st_size > pos)
+		size = st.st_size - pos + 1;
+
+	if (bfd_buffered(bfd))
+		size += b->sz;
+
+	buf = xmalloc(size);
+	if (!buf)
+		return -1;
+
+	if (bfd_buffered(bfd)) {
+		memcpy(buf, b->data, b->sz);
+		len = b->sz;
+		b->sz = 0;
+	}
+
+	while (1) {
+		ssize_t ret;
+
+		if (len == size) {
+			size *= 2;
+			if (xrealloc_safe(&buf, size)) {
+				xfree(buf);
+				return -1;
+			}
+		}
+
+		ret = read(bfd->fd, buf + len, size - len);
+		if (ret < 0) {
+			pr_perror("Error reading file");
+			xfree(buf);
+			return -1;
+		}
+
+		if (ret == 0)
+			break;
+
+		len += ret;
+	}
+
+	*pbuf = buf;
+	return len;
+}
@@ -118,6 +118,13 @@ int punch_hole(struct page_read *pr, unsigned long off, unsigned long len,
 	int ret;
 	struct iovec * bunch = &pr->bunch;
 
+	/*
+	 * Pages are packed into blocks, nothing to punch page-wise,
+	 * and pages in a store may be used by other pagemaps
+	 */
+	if (pr->cr || pr->pi_shared)
+		return 0;
+
 	if (!cleanup && can_extend_batch(bunch, off, len)) {
 		pr_debug("pr%d:Extend bunch len from %zu to %lu\n", pr->id,
 			 bunch->iov_len, bunch->iov_len + len);
@@ -126,7 +133,8 @@ int punch_hole(struct page_read *pr, unsigned long off, unsigned long len,
 		if (bunch->iov_len > 0) {
 			pr_debug("Punch!/%p/%zu/\n", bunch->iov_base, bunch->iov_len);
 			ret = fallocate(img_raw_fd(pr->pi), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
-					(unsigned long)bunch->iov_base, bunch->iov_len);
+					(unsigned long)bunch->iov_base + img_raw_off(pr->pi),
+					bunch->iov_len);
 			if (ret != 0) {
 				pr_perror("Error punching hole");
 				return -1;
@@ -169,8 +177,8 @@ int dedup_one_iovec(struct page_read *pr, struct iovec *iov)
 			return -1;
 		pagemap2iovec(pr->pe, &piov);
 		piov_end = (unsigned long)piov.iov_base + piov.iov_len;
-		off_real = lseek(img_raw_fd(pr->pi), 0, SEEK_CUR);
-		if (!pr->pe->in_parent) {
+		off_real = pr->pi_off;
+		if (!pr->pe->in_parent && !pr->pe->zero) {
 			ret = punch_hole(pr, off_real, min(piov_end, iov_end) - off, false);
 			if (ret == -1)
 				return ret;
@@ -78,9 +78,13 @@
 #include "action-scripts.h"
 #include "aio.h"
 #include "security.h"
+#include "dump-jobs.h"
+#include "page-store.h"
+#include "archive.h"
 #include "lsm.h"
 #include "seccomp.h"
 #include "seize.h"
+#include "hotmap.h"
 #include "fault-injection.h"
 
 #include "asm/dump.h"
@@ -109,6 +113,8 @@ void free_mappings(struct vm_area_list *vma_area_list)
 		close_vma_file(vma_area);
 		if (!vma_area->file_borrowed)
 			free(vma_area->vmst);
+		xfree(vma_area->e->mpol_nodes);
+		xfree(vma_area->e->numa_pages);
 		free(vma_area);
 	}
 
@@ -128,6 +134,12 @@ int collect_mappings(pid_t pid, struct vm_area_list *vma_area_list)
 	if (ret < 0)
 		goto err;
 
+	ret = parse_numa_maps(pid, vma_area_list);
+	if (ret < 0) {
+		free_mappings(vma_area_list);
+		goto err;
+	}
+
 	pr_info("Collected, longest area occupies %lu pages\n", vma_area_list->longest);
 	pr_info_vma_list(&vma_area_list->h);
 
@@ -668,6 +680,74 @@ static int dump_task_ids(struct pstree_item *item, const struct cr_imgset *cr_im
 	return pb_write_one(img_from_set(cr_imgset, CR_FD_IDS), item->ids, PB_IDS);
 }
 
+/* Freed in core_entry_free() */
+static int dump_thread_mempolicy(ThreadCoreEntry *tc, const struct parasite_dump_thread *ti)
+{
+	size_t n = ARRAY_SIZE(ti->mempolicy_nodes);
+
+	while (n && !ti->mempolicy_nodes[n - 1])
+		n--;
+
+	tc->has_mempolicy = true;
+	tc->mempolicy = ti->mempolicy;
+
+	if (!n)
+		return 0;
+
+	tc->mempolicy_nodes = xmalloc(n * sizeof(u64));
+	if (!tc->mempolicy_nodes)
+		return -1;
+
+	memcpy(tc->mempolicy_nodes, ti->mempolicy_nodes, n * sizeof(u64));
+	tc->n_mempolicy_nodes = n;
+	return 0;
+}
+
+static bool vma_has_mempolicy(const VmaEntry *e, const struct parasite_dump_thread *ti)
+{
+	size_t i;
+
+	if (e->mpol_mode != ti->mempolicy)
+		return false;
+
+	for (i = 0; i < ARRAY_SIZE(ti->mempolicy_nodes); i++) {
+		u64 n = i < e->n_mpol_nodes ? e->mpol_nodes[i] : 0;
+
+		if (n != ti->mempolicy_nodes[i])
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * For areas without a policy of their own numa_maps shows the policy
+ * of the task. Drop these, so that restore doesn't bind them. An area
+ * with its own policy equal to the task's one loses it too, which
+ * only matters if the task changes its policy later.
+ */
+static void drop_task_mempolicy(struct vm_area_list *vmas,
+				const struct parasite_dump_thread *ti)
+{
+	struct vma_area *vma;
+
+	if (!ti->mempolicy)
+		return;
+
+	list_for_each_entry(vma, &vmas->h, list) {
+		VmaEntry *e = vma->e;
+
+		if (!e->has_mpol_mode || !vma_has_mempolicy(e, ti))
+			continue;
+
+		e->has_mpol_mode = false;
+		e->mpol_mode = 0;
+		xfree(e->mpol_nodes);
+		e->mpol_nodes = NULL;
+		e->n_mpol_nodes = 0;
+	}
+}
+
 int dump_thread_core(int pid, CoreEntry *core, const struct parasite_dump_thread *ti)
 {
 	int ret;
@@ -685,6 +765,8 @@ int dump_thread_core(int pid, CoreEntry *core, const struct parasite_dump_thread
 			tc->has_pdeath_sig = true;
 			tc->pdeath_sig = ti->pdeath_sig;
 		}
+		if (ti->mempolicy)
+			ret = dump_thread_mempolicy(tc, ti);
 	}
 
 	return ret;
@@ -1092,12 +1174,139 @@ err:
 	return ret;
 }
 
-static int pre_dump_one_task(struct pstree_item *item, struct list_head *ctls)
+/*
+ * Writes the pages a pre-dumped task has in pipes and
+ * frees what's left of its parasite.
+ */
+static int pre_dump_ctl_pages(struct parasite_ctl *ctl)
+{
+	struct page_xfer xfer;
+	int ret;
+
+	pr_info("\tPre-dumping %d\n", ctl->pid.virt);
+	timing_start(TIME_MEMWRITE);
+	ret = open_page_xfer(&xfer, CR_FD_PAGEMAP, ctl->pid.virt);
+	if (ret < 0)
+		return -1;
+
+	ret = page_xfer_dump_pages(&xfer, ctl->mem_pp, 0);
+
+	xfer.close(&xfer);
+
+	if (ret)
+		return ret;
+
+	timing_stop(TIME_MEMWRITE);
+
+	destroy_page_pipe(ctl->mem_pp);
+	list_del(&ctl->pre_list);
+	parasite_cure_local(ctl);
+	return 0;
+}
+
+/*
+ * With --pre-dump-mem-limit the tasks pre-dumped earlier are written
+ * out, oldest first, until @nr_pages more fit the limit. Returns 1 if
+ * they don't fit at all, so the task is to be written out in chunks.
+ */
+static int pre_dump_make_room(struct list_head *ctls, unsigned long nr_pages)
+{
+	unsigned long limit = opts.pre_dump_mem_limit >> PAGE_SHIFT;
+	unsigned long pinned = 0;
+	struct parasite_ctl *ctl, *n;
+
+	if (!limit)
+		return 0;
+
+	if (nr_pages > limit)
+		nr_pages = 0;
+
+	list_for_each_entry(ctl, ctls, pre_list)
+		pinned += page_pipe_nr_pages(ctl->mem_pp);
+
+	list_for_each_entry_safe(ctl, n, ctls, pre_list) {
+		unsigned long nr;
+
+		if (pinned + nr_pages <= limit)
+			break;
+
+		nr = page_pipe_nr_pages(ctl->mem_pp);
+		if (pre_dump_ctl_pages(ctl))
+			return -1;
+		pinned -= nr;
+	}
+
+	return nr_pages ? 0 : 1;
+}
+
+/*
+ * With --hot-pages pre-dump marks the private pages of the task idle
+ * and dump records which of them were touched since then. Pre-dump
+ * does it after the pages are drained, as draining touches them too.
+ */
+static int dump_task_hotmap(pid_t pid, pid_t vpid, struct vm_area_list *vmas, bool record)
+{
+	struct vma_area *vma;
+	struct hotmap *hm;
+
+	if (hotmap_open(&hm, pid, vpid, record))
+		return -1;
+	if (!hm)
+		return 0;
+
+	list_for_each_entry(vma, &vmas->h, list) {
+		if (!vma_area_is_private(vma, kdat.task_size))
+			continue;
+
+		if (hotmap_area(hm, vma->e->start, vma->e->end)) {
+			hotmap_close(hm);
+			return -1;
+		}
+	}
+
+	return hotmap_close(hm);
+}
+
+/*
+ * Pre-dump with --pre-dump-mode read. The vpid comes from NSpid,
+ * the vDSO areas are not fixed up, which only means these get
+ * into the pre-dump images as plain anonymous memory. Returns 1
+ * if the task should be pre-dumped with parasite instead.
+ */
+static int pre_dump_one_task_read(struct pstree_item *item,
+				  struct vm_area_list *vmas, struct list_head *readers)
+{
+	pid_t pid = item->pid.real, vpid = pid;
+	int ret;
+
+	if (root_ns_mask & CLONE_NEWPID) {
+		ret = parse_pid_nspid(pid, &vpid);
+		if (ret < 0)
+			return -1;
+		if (ret) {
+			pr_warn("No NSpid for %d, pre-dumping it with parasite\n", pid);
+			return 1;
+		}
+	}
+
+	ret = predump_task_files(pid);
+	if (ret) {
+		pr_err("Pre-dumping files failed (pid: %d)\n", pid);
+		return -1;
+	}
+
+	item->pid.virt = vpid;
+
+	return predump_pages_collect(pid, vpid, vmas, readers);
+}
+
+static int pre_dump_one_task(struct pstree_item *item, struct list_head *ctls,
+			     struct list_head *readers)
 {
 	pid_t pid = item->pid.real;
 	struct vm_area_list vmas;
 	struct parasite_ctl *parasite_ctl;
-	int ret = -1;
+	int ret = -1, spill;
 	struct parasite_dump_misc misc;
 
 	INIT_LIST_HEAD(&vmas.h);
@@ -1121,6 +1330,17 @@ static int pre_dump_one_task(struct pstree_item *item, struct list_head *ctls)
 		goto err;
 	}
 
+	if (opts.pre_dump_mode == PRE_DUMP_READ) {
+		ret = pre_dump_one_task_read(item, &vmas, readers);
+		if (ret <= 0)
+			goto err_free;
+	}
+
+	/* Private memory is what can get into pipes at most */
+	spill = pre_dump_make_room(ctls, vmas.priv_size);
+	if (spill < 0)
+		goto err_free;
+
 	ret = -1;
 	parasite_ctl = parasite_infect_seized(pid, item, &vmas);
 	if (!parasite_ctl) {
@@ -1148,10 +1368,28 @@ static int pre_dump_one_task(struct pstree_item *item, struct list_head *ctls)
 
 	parasite_ctl->pid.virt = item->pid.virt = misc.pid;
 
+	if (spill) {
+		pr_info("Writing pages of %d in chunks\n", pid);
+		ret = parasite_dump_pages_seized(parasite_ctl, &vmas, NULL);
+		if (ret)
+			goto err_cure;
+		if (opts.hot_pages)
+			ret = dump_task_hotmap(pid, misc.pid, &vmas, false);
+		if (parasite_cure_seized(parasite_ctl))
+			pr_err("Can't cure (pid: %d) from parasite\n", pid);
+		goto err_free;
+	}
+
 	ret = parasite_dump_pages_seized(parasite_ctl, &vmas, &parasite_ctl->mem_pp);
 	if (ret)
 		goto err_cure;
 
+	if (opts.hot_pages) {
+		ret = dump_task_hotmap(pid, misc.pid, &vmas, false);
+		if (ret)
+			goto err_cure;
+	}
+
 	if (parasite_cure_remote(parasite_ctl))
 		pr_err("Can't cure (pid: %d) from parasite\n", pid);
 	list_add_tail(&parasite_ctl->pre_list, ctls);
@@ -1166,6 +1404,108 @@ err_cure:
 	goto err_free;
 }
 
+static int dump_one_task_fini(struct dump_job *job, int status)
+{
+	struct parasite_ctl *parasite_ctl = job->ctl;
+	pid_t pid = job->item->pid.real;
+	int ret = -1;
+
+	pr_info("Finishing task (pid: %d)\n", pid);
+
+	if (status) {
+		pr_err("Can't dump pages (pid: %d)\n", pid);
+		parasite_cure_seized(parasite_ctl);
+		goto err;
+	}
+
+	if (parasite_stop_daemon(parasite_ctl)) {
+		pr_err("Can't cure (pid: %d) from parasite\n", pid);
+		goto err;
+	}
+
+	if (dump_task_threads(parasite_ctl, job->item)) {
+		pr_err("Can't dump threads\n");
+		goto err;
+	}
+
+	if (parasite_cure_seized(parasite_ctl)) {
+		pr_err("Can't cure (pid: %d) from parasite\n", pid);
+		goto err;
+	}
+
+	ret = 0;
+err:
+	close_pid_proc();
+	free_mappings(&job->vmas);
+	xfree(job);
+	return ret;
+}
+
+static int dump_jobs_reap_one(void)
+{
+	struct dump_job *job;
+	int status;
+
+	job = dump_job_wait(&status);
+	return dump_one_task_fini(job, status);
+}
+
+static int dump_jobs_finish(void)
+{
+	int ret = 0;
+
+	while (dump_jobs_running())
+		if (dump_jobs_reap_one())
+			ret = -1;
+
+	return ret;
+}
+
+/*
+ * The task's pages are dumped by a worker (see dump-jobs.c), that
+ * needs the parasite daemon to stay alive. Write all the rest now,
+ * threads and parasite curing are done in dump_one_task_fini().
+ */
+static int dump_one_task_async(struct pstree_item *item, struct parasite_ctl *ctl,
+		struct parasite_dump_misc *misc, struct vm_area_list *vmas,
+		struct cr_imgset **cr_imgset)
+{
+	pid_t pid = item->pid.real;
+	struct dump_job *job;
+	int ret;
+
+	ret = dump_task_mm(pid, &pps_buf, misc, vmas, *cr_imgset);
+	if (ret) {
+		pr_err("Dump mappings (pid: %d) failed with %d\n", pid, ret);
+		return -1;
+	}
+
+	ret = dump_task_fs(pid, misc, *cr_imgset);
+	if (ret) {
+		pr_err("Dump fs (pid: %d) failed with %d\n", pid, ret);
+		return -1;
+	}
+
+	/* Don't let the worker inherit buffered images */
+	close_cr_imgset(cr_imgset);
+
+	while (dump_jobs_running() >= opts.dump_jobs)
+		if (dump_jobs_reap_one())
+			return -1;
+
+	job = alloc_dump_job(item, ctl, vmas);
+	if (!job)
+		return -1;
+
+	if (dump_job_start(job)) {
+		list_splice(&job->vmas.h, &vmas->h);
+		xfree(job);
+		return -1;
+	}
+
+	return 0;
+}
+
 static int dump_one_task(struct pstree_item *item)
 {
 	pid_t pid = item->pid.real;
@@ -1273,6 +1613,8 @@ static int dump_one_task(struct pstree_item *item)
 		goto err_cure_imgset;
 	}
 
+	drop_task_mempolicy(&vmas, &misc.ti);
+
 	parasite_ctl->pid.virt = item->pid.virt = misc.pid;
 	item->sid = misc.sid;
 	item->pgid = misc.pgid;
@@ -1304,9 +1646,19 @@ static int dump_one_task(struct pstree_item *item)
 		}
 	}
 
-	ret = parasite_dump_pages_seized(parasite_ctl, &vmas, NULL);
-	if (ret)
-		goto err_cure;
+	if (opts.hot_pages && opts.img_parent) {
+		ret = dump_task_hotmap(pid, item->pid.virt, &vmas, true);
+		if (ret) {
+			pr_err("Can't record hot pages (pid: %d)\n", pid);
+			goto err_cure;
+		}
+	}
+
+	if (opts.dump_jobs <= 1) {
+		ret = parasite_dump_pages_seized(parasite_ctl, &vmas, NULL);
+		if (ret)
+			goto err_cure;
+	}
 
 	ret = parasite_dump_sigacts_seized(parasite_ctl, cr_imgset);
 	if (ret) {
@@ -1338,6 +1690,15 @@ static int dump_one_task(struct pstree_item *item)
 		goto err;
 	}
 
+	if (opts.dump_jobs > 1) {
+		ret = dump_one_task_async(item, parasite_ctl, &misc, &vmas, &cr_imgset);
+		if (ret)
+			goto err_cure;
+
+		exit_code = 0;
+		goto err;
+	}
+
 	ret = parasite_stop_daemon(parasite_ctl);
 	if (ret) {
 		pr_err("Can't cure (pid: %d) from parasite\n", pid);
@@ -1388,6 +1749,7 @@ int cr_pre_dump_tasks(pid_t pid)
 	struct pstree_item *item;
 	int ret = -1;
 	LIST_HEAD(ctls);
+	LIST_HEAD(readers);
 	struct parasite_ctl *ctl, *n;
 
 	if (!opts.track_mem) {
@@ -1403,6 +1765,9 @@ int cr_pre_dump_tasks(pid_t pid)
 	if (init_stats(DUMP_STATS))
 		goto err;
 
+	if (opts.archive && archive_create())
+		goto err;
+
 	if (kerndat_init())
 		goto err;
 
@@ -1415,7 +1780,7 @@ int cr_pre_dump_tasks(pid_t pid)
 	if (vdso_init())
 		goto err;
 
-	if (connect_to_page_server())
+	if (connect_to_page_server(1))
 		goto err;
 
 	if (collect_pstree(pid))
@@ -1428,7 +1793,7 @@ int cr_pre_dump_tasks(pid_t pid)
 		goto err;
 
 	for_each_pstree_item(item)
-		if (pre_dump_one_task(item, &ctls))
+		if (pre_dump_one_task(item, &ctls, &readers))
 			goto err;
 
 	if (irmap_predump_prep())
@@ -1444,37 +1809,29 @@ err:
 
 	pr_info("Pre-dumping tasks' memory\n");
 	list_for_each_entry_safe(ctl, n, &ctls, pre_list) {
-		struct page_xfer xfer;
-
-		pr_info("\tPre-dumping %d\n", ctl->pid.virt);
-		timing_start(TIME_MEMWRITE);
-		ret = open_page_xfer(&xfer, CR_FD_PAGEMAP, ctl->pid.virt);
-		if (ret < 0)
-			break;
-
-		ret = page_xfer_dump_pages(&xfer, ctl->mem_pp, 0);
-
-		xfer.close(&xfer);
-
+		ret = pre_dump_ctl_pages(ctl);
 		if (ret)
 			break;
-
-		timing_stop(TIME_MEMWRITE);
-
-		destroy_page_pipe(ctl->mem_pp);
-		list_del(&ctl->pre_list);
-		parasite_cure_local(ctl);
 	}
 
+	if (predump_pages_read(&readers, ret == 0))
+		ret = -1;
+
 	if (irmap_predump_run())
 		ret = -1;
 
+	if (page_store_fini())
+		ret = -1;
+
 	if (disconnect_from_page_server())
 		ret = -1;
 
 	if (bfd_flush_images())
 		ret = -1;
 
+	if (archive_finish(ret == 0))
+		ret = -1;
+
 	if (ret)
 		pr_err("Pre-dumping FAILED.\n");
 	else {
@@ -1504,6 +1861,9 @@ int cr_dump_tasks(pid_t pid)
 	if (init_stats(DUMP_STATS))
 		goto err;
 
+	if (opts.archive && archive_create())
+		goto err;
+
 	if (cr_plugin_init(CR_PLUGIN_STAGE__DUMP))
 		goto err;
 
@@ -1530,7 +1890,29 @@ int cr_dump_tasks(pid_t pid)
 			goto err;
 	}
 
-	if (connect_to_page_server())
+	if (connect_to_page_server(opts.dump_jobs))
+		goto err;
+
+	/* Pages images are written at the archive end one by one */
+	if (opts.archive && !opts.use_page_server && opts.dump_jobs > 1) {
+		pr_warn("Images are archived, dumping pages in one process\n");
+		opts.dump_jobs = 1;
+	}
+
+	/* All pages should go through one page store */
+	if (opts.page_dedup && !opts.use_page_server && opts.dump_jobs > 1) {
+		pr_warn("Pages are deduplicated, dumping them in one process\n");
+		opts.dump_jobs = 1;
+	}
+
+	/* Each dump worker sends pages over its own stream */
+	if (opts.use_page_server && opts.dump_jobs > page_server_streams()) {
+		pr_warn("Page server accepted only %u streams\n",
+				page_server_streams());
+		opts.dump_jobs = page_server_streams();
+	}
+
+	if (dump_jobs_init())
 		goto err;
 
 	/*
@@ -1566,6 +1948,9 @@ int cr_dump_tasks(pid_t pid)
 			goto err;
 	}
 
+	if (dump_jobs_finish())
+		goto err;
+
 	/* MNT namespaces are dumped after files to save remapped links */
 	if (dump_mnt_namespaces() < 0)
 		goto err;
@@ -1603,6 +1988,14 @@ int cr_dump_tasks(pid_t pid)
 		goto err;
 
 err:
+	if (dump_jobs_running()) {
+		dump_jobs_kill();
+		dump_jobs_finish();
+	}
+	dump_jobs_fini();
+	if (page_store_fini())
+		ret = -1;
+
 	if (disconnect_from_page_server())
 		ret = -1;
 
@@ -1611,6 +2004,9 @@ err:
 	if (bfd_flush_images())
 		ret = -1;
 
+	if (archive_finish(ret == 0))
+		ret = -1;
+
 	cr_plugin_fini(CR_PLUGIN_STAGE__DUMP, ret);
 
 	if (!ret) {
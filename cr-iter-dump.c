@@ -0,0 +1,260 @@
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "crtools.h"
+#include "cr_options.h"
+#include "image.h"
+#include "stats.h"
+#include "util.h"
+#include "log.h"
+
+#undef	LOG_PREFIX
+#define LOG_PREFIX "iter-dump: "
+
+/*
+ * Iterative dump (dump --downtime). Memory is pre-dumped into
+ * pre-N subdirectories of the images dir while the tasks keep
+ * running, each pre-dump on top of the previous one. After each
+ * iteration the dirty rate is measured and the freeze time of a
+ * final dump is predicted. Once it fits the budget, or memory is
+ * not getting any less dirty, the final dump is done into the
+ * images dir with the last pre-dump as its parent.
+ */
+
+#define ITER_DIR_FMT		"pre-%u"
+
+/*
+ * If an iteration dirtied more than that percentage of pages
+ * of the previous one, iterating further makes no sense.
+ */
+#define ITER_CONVERGE_RATIO	90
+
+struct iter_stats {
+	struct dump_stats_part	st;
+	u64			start;		/* usec, when started */
+	u64			dur;		/* usec, how long it took */
+	unsigned long		dirty;		/* pages dumped */
+};
+
+static u64 tv_usec(const struct timeval *tv)
+{
+	return (u64)tv->tv_sec * USEC_PER_SEC + tv->tv_usec;
+}
+
+static u64 now_usec(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv_usec(&tv);
+}
+
+static int pre_dump_iter_child(pid_t pid, unsigned int iter,
+			       struct dump_stats_part *st)
+{
+	char dir[32], parent[PATH_MAX], path[PATH_MAX];
+	int dfd = get_service_fd(IMG_FD_OFF);
+
+	snprintf(dir, sizeof(dir), ITER_DIR_FMT, iter);
+	if (mkdirat(dfd, dir, 0700)) {
+		pr_perror("Can't create pre-dump dir %s", dir);
+		return -1;
+	}
+
+	/* Parent paths are relative to the pre-N dir */
+	if (iter > 1) {
+		snprintf(parent, sizeof(parent), "../" ITER_DIR_FMT, iter - 1);
+		opts.img_parent = parent;
+	} else if (opts.img_parent && opts.img_parent[0] != '/') {
+		snprintf(parent, sizeof(parent), "../%s", opts.img_parent);
+		opts.img_parent = parent;
+	}
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%d/%s", dfd, dir);
+	if (open_image_dir(path))
+		return -1;
+
+	if (cr_pre_dump_tasks(pid))
+		return -1;
+
+	dump_stats_part_get(st);
+	return 0;
+}
+
+/*
+ * Each pre-dump runs in a forked criu, as it leaves lots of global
+ * state behind, and hands its stats back via a pipe.
+ */
+static int pre_dump_iter(pid_t pid, unsigned int iter, struct iter_stats *is)
+{
+	int p[2], ret, status;
+	pid_t wpid;
+
+	if (pipe(p)) {
+		pr_perror("Can't make pre-dump pipe");
+		return -1;
+	}
+
+	is->start = now_usec();
+
+	wpid = fork();
+	if (wpid < 0) {
+		pr_perror("Can't fork pre-dump");
+		close(p[0]);
+		close(p[1]);
+		return -1;
+	}
+
+	if (wpid == 0) {
+		struct dump_stats_part st;
+
+		close(p[0]);
+		ret = pre_dump_iter_child(pid, iter, &st);
+		if (!ret && write(p[1], &st, sizeof(st)) != sizeof(st)) {
+			pr_perror("Can't report pre-dump stats");
+			ret = -1;
+		}
+		exit(ret ? 1 : 0);
+	}
+
+	close(p[1]);
+	ret = read(p[0], &is->st, sizeof(is->st));
+	close(p[0]);
+
+	if (waitpid(wpid, &status, 0) != wpid) {
+		pr_perror("Can't wait pre-dump %d", wpid);
+		return -1;
+	}
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) || ret != sizeof(is->st)) {
+		pr_err("Pre-dump %u failed (%#x)\n", iter, status);
+		return -1;
+	}
+
+	is->dur = now_usec() - is->start;
+	is->dirty = is->st.counts[CNT_PAGES_WRITTEN] + is->st.counts[CNT_PAGES_ZERO];
+
+	pr_info("Pre-dump %u: %lu pages dirty, %lu clean, frozen %"PRIu64" us, "
+			"took %"PRIu64" us\n", iter, is->dirty,
+			is->st.counts[CNT_PAGES_SKIPPED_PARENT],
+			tv_usec(&is->st.frozen), is->dur);
+	return 0;
+}
+
+/*
+ * The @cur iteration dumped the pages dirtied since the @prev one
+ * froze the tasks, which gives the dirty rate. The final dump will
+ * have to dump what gets dirtied while @cur was running, at the
+ * speed @cur dumped pages, plus what it takes to freeze the tasks
+ * and dump everything else, which is what @cur was frozen for
+ * apart from draining memory.
+ */
+static u64 predict_downtime(const struct iter_stats *prev,
+			    const struct iter_stats *cur)
+{
+	u64 interval = cur->start - prev->start;
+	u64 memdump = tv_usec(&cur->st.memdump);
+	u64 mem = memdump + tv_usec(&cur->st.memwrite);
+	u64 frozen = tv_usec(&cur->st.frozen);
+	u64 dirty, ret;
+
+	if (!interval)
+		interval = 1;
+
+	dirty = (u64)cur->dirty * cur->dur / interval;
+	ret = frozen > memdump ? frozen - memdump : 0;
+	if (cur->dirty)
+		ret += dirty * mem / cur->dirty;
+
+	pr_info("Dirty rate %"PRIu64" pages/s, expect %"PRIu64" pages "
+			"to dump frozen in %"PRIu64" us\n",
+			(u64)cur->dirty * USEC_PER_SEC / interval, dirty, ret);
+	return ret;
+}
+
+static bool iter_converged(unsigned int iter, const struct iter_stats *prev,
+			   const struct iter_stats *cur)
+{
+	u64 budget = (u64)opts.downtime * 1000;
+
+	/* First one dumps everything, no rate to estimate */
+	if (iter == 1)
+		return false;
+
+	if (predict_downtime(prev, cur) <= budget) {
+		pr_info("Expected freeze time fits %u ms\n", opts.downtime);
+		return true;
+	}
+
+	if ((u64)cur->dirty * 100 >= (u64)prev->dirty * ITER_CONVERGE_RATIO) {
+		pr_warn("Memory doesn't converge (%lu -> %lu pages), "
+				"dumping beyond %u ms budget\n",
+				prev->dirty, cur->dirty, opts.downtime);
+		return true;
+	}
+
+	return false;
+}
+
+static int link_last_pre_dump(unsigned int iter)
+{
+	static char parent[32];
+	int dfd = get_service_fd(IMG_FD_OFF);
+
+	snprintf(parent, sizeof(parent), ITER_DIR_FMT, iter);
+
+	if (unlinkat(dfd, CR_PARENT_LINK, 0) && errno != ENOENT) {
+		pr_perror("Can't unlink parent snapshot");
+		return -1;
+	}
+
+	if (symlinkat(parent, dfd, CR_PARENT_LINK)) {
+		pr_perror("Can't link parent snapshot");
+		return -1;
+	}
+
+	opts.img_parent = parent;
+	opts.track_mem = true;
+	return 0;
+}
+
+int cr_iter_dump_tasks(pid_t pid)
+{
+	struct iter_stats prev = { }, cur;
+	unsigned int iter;
+
+	/* The page server would put all pre-dumps into one dir */
+	if (opts.use_page_server) {
+		pr_err("Iterative dump can't be done to page server\n");
+		return -1;
+	}
+
+	pr_info("Iterative dump with %u ms downtime, up to %u pre-dumps\n",
+			opts.downtime, opts.max_pre_dumps);
+
+	for (iter = 1; ; iter++) {
+		if (pre_dump_iter(pid, iter, &cur))
+			return -1;
+
+		if (iter >= opts.max_pre_dumps) {
+			pr_info("Pre-dumps limit reached\n");
+			break;
+		}
+
+		if (iter_converged(iter, &prev, &cur))
+			break;
+
+		prev = cur;
+	}
+
+	if (link_last_pre_dump(iter))
+		return -1;
+
+	pr_info("Final dump after %u pre-dumps\n", iter);
+	return cr_dump_tasks(pid);
+}
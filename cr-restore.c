@@ -24,6 +24,8 @@
 
 #include <sys/sendfile.h>
 
+#include <linux/mempolicy.h>
+
 #include "ptrace.h"
 #include "compiler.h"
 #include "asm/types.h"
@@ -65,6 +67,7 @@
 #include "stats.h"
 #include "tun.h"
 #include "vma.h"
+#include "hotmap.h"
 #include "kerndat.h"
 #include "rst-malloc.h"
 #include "plugin.h"
@@ -79,6 +82,7 @@
 #include "bitmap.h"
 #include "fault-injection.h"
 #include "parasite-syscall.h"
+#include "uffd.h"
 
 #include "protobuf.h"
 #include "protobuf/sa.pb-c.h"
@@ -188,6 +192,7 @@ static int root_prepare_shared(void)
 	struct pstree_item *pi;
 
 	pr_info("Preparing info about shared resources\n");
+	timing_start(TIME_PREPARE);
 
 	if (prepare_shared_tty())
 		return -1;
@@ -251,12 +256,81 @@ static int root_prepare_shared(void)
 	if (ret)
 		goto err;
 
+	timing_stop(TIME_PREPARE);
+
 	show_saved_shmems();
 	show_saved_files();
 err:
 	return ret;
 }
 
+/*
+ * The node most of the area's pages were on, if the policy
+ * didn't tell where they should be.
+ */
+static int vma_numa_home(VmaEntry *e)
+{
+	int node, home = -1;
+	u64 max = 0;
+
+	if (e->has_mpol_mode || (e->flags & MAP_GROWSDOWN))
+		return -1;
+
+	for (node = 0; node < e->n_numa_pages; node++) {
+		if (e->numa_pages[node] > max) {
+			max = e->numa_pages[node];
+			home = node;
+		}
+	}
+
+	return home;
+}
+
+/*
+ * Memory policy goes with the area when it's moved into place. Areas
+ * without one prefer the node their pages were on, till the contents
+ * is read in, see reset_numa_home.
+ */
+static void premap_numa_policy(struct vma_area *vma, void *addr, unsigned long size)
+{
+	u64 nodes[NUMA_MAX_NODES / 64] = {};
+	int node;
+
+	if (vma->e->has_mpol_mode) {
+		if (sys_mbind((unsigned long)addr, size, vma->e->mpol_mode,
+			      (unsigned long *)vma->e->mpol_nodes,
+			      vma->e->n_mpol_nodes * 64 + 1, 0))
+			pr_warn("Can't restore memory policy of %"PRIx64"\n",
+					vma->e->start);
+		return;
+	}
+
+	node = vma_numa_home(vma->e);
+	if (node < 0 || node >= NUMA_MAX_NODES)
+		return;
+
+	nodes[node / 64] = 1ULL << (node % 64);
+	if (sys_mbind((unsigned long)addr, size, MPOL_PREFERRED,
+		      (unsigned long *)nodes, NUMA_MAX_NODES + 1, 0))
+		pr_warn("Can't place %"PRIx64" on node %d\n", vma->e->start, node);
+}
+
+static void reset_numa_home(struct vm_area_list *vmas)
+{
+	struct vma_area *vma;
+
+	list_for_each_entry(vma, &vmas->h, list) {
+		if (!vma_area_is_private(vma, kdat.task_size) ||
+		    vma->ppage_bitmap || vma_numa_home(vma->e) < 0)
+			continue;
+
+		if (sys_mbind(vma->premmaped_addr, vma_area_len(vma),
+			      MPOL_DEFAULT, NULL, 0, 0))
+			pr_warn("Can't reset memory policy of %"PRIx64"\n",
+					vma->e->start);
+	}
+}
+
 /* Map a private vma, if it is not mapped by a parent yet */
 static int map_private_vma(struct vma_area *vma, void **tgt_addr,
 			struct vma_area **pvma, struct list_head *pvma_list)
@@ -316,6 +390,15 @@ static int map_private_vma(struct vma_area *vma, void **tgt_addr,
 			paddr -= PAGE_SIZE;
 	}
 
+	/*
+	 * Huge pages are moved by mremap only between addresses with
+	 * the same offset in a huge page, so the premapped area should
+	 * start at that offset, whether it's a new one or a parent's.
+	 */
+	if (vma_entry_is_thp(vma->e) && kdat.thp_size)
+		*tgt_addr += (vma->e->start - (unsigned long)*tgt_addr) &
+				(kdat.thp_size - 1);
+
 	size = vma_entry_len(vma->e);
 	if (paddr == NULL) {
 		/*
@@ -335,6 +418,13 @@ static int map_private_vma(struct vma_area *vma, void **tgt_addr,
 			return -1;
 		}
 
+		/* Get huge pages as the contents is read in */
+		if (vma_entry_is_thp(vma->e) && kdat.thp_size &&
+		    madvise(addr, size, MADV_HUGEPAGE))
+			pr_perror("Can't ask for huge pages at %p", addr);
+
+		premap_numa_policy(vma, addr, size);
+
 		*pvma = p;
 	} else {
 		/*
@@ -417,15 +507,23 @@ static int restore_priv_vma_content(void)
 	unsigned int nr_shared = 0;
 	unsigned int nr_droped = 0;
 	unsigned int nr_compared = 0;
+	unsigned int nr_lazy = 0;
 	unsigned long va;
 	struct page_read pr;
+	struct hot_ranges hr = { };
 
 	vma = list_first_entry(vmas, struct vma_area, list);
 
-	ret = open_page_read(current->pid.virt, &pr, PR_TASK);
-	if (ret <= 0)
+	/* Pages the tasks used right before dump are not left lazy */
+	if (opts.lazy_pages && hot_ranges_load(current->pid.virt, &hr))
 		return -1;
 
+	ret = open_page_read(current->pid.virt, &pr, PR_TASK | PR_MMAP);
+	if (ret <= 0) {
+		hot_ranges_free(&hr);
+		return -1;
+	}
+
 	/*
 	 * Read page contents.
 	 */
@@ -442,6 +540,7 @@ static int restore_priv_vma_content(void)
 
 		for (i = 0; i < nr_pages; i++) {
 			unsigned char buf[PAGE_SIZE];
+			unsigned long end;
 			void *p;
 
 			/*
@@ -471,11 +570,32 @@ static int restore_priv_vma_content(void)
 			p = decode_pointer((off) * PAGE_SIZE +
 					vma->premmaped_addr);
 
+			end = vma->e->end;
+			if (opts.lazy_pages && vma_entry_can_be_lazy(vma->e)) {
+				unsigned long hot_end;
+				bool hot;
+				int nr;
+
+				hot = hot_ranges_find(&hr, va, &hot_end);
+				end = min_t(unsigned long, end, hot_end);
+				if (!hot) {
+					/* Will be copied in by the lazy-pages daemon */
+					nr = min_t(int, nr_pages - i, (end - va) / PAGE_SIZE);
+					pr.skip_pages(&pr, nr * PAGE_SIZE);
+
+					bitmap_set(vma->page_bitmap, off, nr);
+					va += nr * PAGE_SIZE;
+					nr_lazy += nr;
+					i += nr - 1;
+					continue;
+				}
+			}
+
 			set_bit(off, vma->page_bitmap);
 			if (vma->ppage_bitmap) { /* inherited vma */
 				clear_bit(off, vma->ppage_bitmap);
 
-				ret = pr.read_pages(&pr, va, 1, buf);
+				ret = pr.read_pages(&pr, va, 1, buf, 0);
 				if (ret < 0)
 					goto err_read;
 
@@ -501,9 +621,11 @@ static int restore_priv_vma_content(void)
 				 * we have at most (vma->end - current_addr) bytes.
 				 */
 
-				nr = min_t(int, nr_pages - i, (vma->e->end - va) / PAGE_SIZE);
+				nr = min_t(int, nr_pages - i, (end - va) / PAGE_SIZE);
 
-				ret = pr.read_pages(&pr, va, nr, p);
+				/* Fresh anonymous memory needs no zero pages */
+				ret = pr.read_pages(&pr, va, nr, p, PR_ASYNC |
+						(vma_entry_is(vma->e, VMA_ANON_PRIVATE) ? PR_ZEROED : 0));
 				if (ret < 0)
 					goto err_read;
 
@@ -521,7 +643,10 @@ static int restore_priv_vma_content(void)
 	}
 
 err_read:
+	if (ret == 0)
+		ret = pr.sync(&pr);
 	pr.close(&pr);
+	hot_ranges_free(&hr);
 	if (ret < 0)
 		return ret;
 
@@ -559,12 +684,14 @@ err_read:
 	pr_info("nr_restored_pages: %d\n", nr_restored);
 	pr_info("nr_shared_pages:   %d\n", nr_shared);
 	pr_info("nr_droped_pages:   %d\n", nr_droped);
+	pr_info("nr_lazy_pages:     %d\n", nr_lazy);
 
 	return 0;
 
 err_addr:
 	pr_err("Page entry address %lx outside of VMA %lx-%lx\n",
 	       va, (long)vma->e->start, (long)vma->e->end);
+	hot_ranges_free(&hr);
 	return -1;
 }
 
@@ -602,6 +729,8 @@ static int prepare_mappings(void)
 	if (ret < 0)
 		goto out;
 
+	reset_numa_home(vmas);
+
 	if (old_premmapped_addr) {
 		ret = munmap(old_premmapped_addr, old_premmapped_len);
 		if (ret < 0)
@@ -639,6 +768,48 @@ static int unmap_guard_pages()
 	return 0;
 }
 
+/*
+ * The premapped area has room to align huge pages VMAs, see
+ * map_private_vma. The holes left are unmapped together with the
+ * guard pages, after the children are forked. Before that their
+ * own premapped areas could get into them and be unmapped along
+ * with the parent's one.
+ */
+static int unmap_premap_holes(void)
+{
+	struct rst_info *ri = rsti(current);
+	unsigned long at = (unsigned long)ri->premmapped_addr;
+	unsigned long end = at + ri->premmapped_len;
+	struct vma_area *vma;
+
+	if (!at)
+		return 0;
+
+	list_for_each_entry(vma, &ri->vmas.h, list) {
+		unsigned long start;
+
+		if (!vma_area_is_private(vma, kdat.task_size))
+			continue;
+
+		start = vma->premmaped_addr;
+		if (vma->e->flags & MAP_GROWSDOWN)
+			start -= PAGE_SIZE;
+
+		if (start > at && munmap((void *)at, start - at))
+			goto err;
+
+		at = vma->premmaped_addr + vma_area_len(vma);
+	}
+
+	if (end > at && munmap((void *)at, end - at))
+		goto err;
+
+	return 0;
+err:
+	pr_perror("Can't unmap premapped hole at %lx", at);
+	return -1;
+}
+
 static int open_vmas(int pid)
 {
 	struct vma_area *vma;
@@ -1141,6 +1312,33 @@ static void maybe_clone_parent(struct pstree_item *item,
 	}
 }
 
+/*
+ * With clone3() the pid is requested directly, so tasks don't
+ * serialize on the LAST_PID_PATH lock when forking children and
+ * subtrees get created in parallel. Without a stack given it
+ * works like fork(), the child goes on with a copy of ours.
+ */
+static int clone3_with_pid(struct cr_clone_arg *ca, pid_t pid)
+{
+	struct clone3_args args = {
+		.flags		= ca->clone_flags & ~CLONE_NEWNET,
+		.exit_signal	= SIGCHLD,
+		.set_tid	= (unsigned long)&pid,
+		.set_tid_size	= 1,
+	};
+	long ret;
+
+	ret = sys_clone3(&args, sizeof(args));
+	if (ret == 0)
+		_exit(restore_task_with_children(ca));
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+
+	return ret;
+}
+
 static inline int fork_with_pid(struct pstree_item *item)
 {
 	struct cr_clone_arg ca;
@@ -1195,7 +1393,10 @@ static inline int fork_with_pid(struct pstree_item *item)
 
 	pr_info("Forking task with %d pid (flags 0x%lx)\n", pid, ca.clone_flags);
 
-	if (!(ca.clone_flags & CLONE_NEWPID)) {
+	ca.fd = -1;
+	if (ca.clone_flags & CLONE_NEWPID)
+		BUG_ON(pid != INIT_PID);
+	else if (!kdat.has_clone3_set_tid) {
 		char buf[32];
 		int len;
 
@@ -1216,9 +1417,6 @@ static inline int fork_with_pid(struct pstree_item *item)
 			pr_perror("%d: Write %s to %s", pid, buf, LAST_PID_PATH);
 			goto err_unlock;
 		}
-	} else {
-		ca.fd = -1;
-		BUG_ON(pid != INIT_PID);
 	}
 
 	/*
@@ -1229,8 +1427,11 @@ static inline int fork_with_pid(struct pstree_item *item)
 	 *
 	 * Here is an idea -- unhare net namespace in callee instead.
 	 */
-	ret = clone(restore_task_with_children, ca.stack_ptr,
-		    (ca.clone_flags & ~CLONE_NEWNET) | SIGCHLD, &ca);
+	if (kdat.has_clone3_set_tid && !(ca.clone_flags & CLONE_NEWPID))
+		ret = clone3_with_pid(&ca, pid);
+	else
+		ret = clone(restore_task_with_children, ca.stack_ptr,
+			    (ca.clone_flags & ~CLONE_NEWNET) | SIGCHLD, &ca);
 
 	if (ret < 0) {
 		pr_perror("Can't fork for %d", pid);
@@ -1524,6 +1725,7 @@ static int restore_task_with_children(void *_arg)
 	int ret;
 
 	current = ca->item;
+	gettimeofday(&rsti(current)->forked_at, NULL);
 
 	if (current != root_item) {
 		char buf[12];
@@ -1629,10 +1831,15 @@ static int restore_task_with_children(void *_arg)
 	if (create_children_and_session())
 		goto err;
 
+	gettimeofday(&rsti(current)->children_at, NULL);
+
 
 	if (unmap_guard_pages())
 		goto err;
 
+	if (unmap_premap_holes())
+		goto err;
+
 	restore_pgid();
 
 	if (restore_finish_stage(CR_STATE_FORKING) < 0)
@@ -1678,6 +1885,34 @@ static inline int stage_participants(int next_stage)
 	return -1;
 }
 
+/*
+ * Tasks fork children only after their own memory is set up, so
+ * the tree creation takes as long as the chain of ancestors of the
+ * task which was the last to fork its children. Show this chain.
+ */
+static void show_forking_path(void)
+{
+	struct pstree_item *pi, *last = NULL;
+	struct timeval *start = &rsti(root_item)->forked_at;
+
+	for_each_pstree_item(pi)
+		if (!last || timercmp(&rsti(pi)->children_at,
+				      &rsti(last)->children_at, >))
+			last = pi;
+
+	pr_info("Forking critical path (from the last one to root):\n");
+	for (pi = last; pi; pi = pi->parent) {
+		struct timeval at, took;
+
+		timersub(&rsti(pi)->forked_at, start, &at);
+		timersub(&rsti(pi)->children_at, &rsti(pi)->forked_at, &took);
+		pr_info("\t%6d: forked at %ld.%06lds, prepared and forked "
+				"children in %ld.%06lds\n", pi->pid.virt,
+				(long)at.tv_sec, (long)at.tv_usec,
+				(long)took.tv_sec, (long)took.tv_usec);
+	}
+}
+
 static int restore_wait_inprogress_tasks()
 {
 	int ret;
@@ -1981,6 +2216,7 @@ static int restore_root_task(struct pstree_item *init)
 		goto out_kill;
 
 	timing_stop(TIME_FORK);
+	show_forking_path();
 
 	ret = restore_switch_stage(CR_STATE_RESTORE);
 	if (ret < 0)
@@ -2167,7 +2403,11 @@ int cr_restore_tasks(void)
 	if (criu_signals_setup() < 0)
 		goto err;
 
+	if (prepare_lazy_pages_socket() < 0)
+		goto err;
+
 	ret = restore_root_task(root_item);
+	close_service_fd(LAZY_PAGES_SK_OFF);
 err:
 	cr_plugin_fini(CR_PLUGIN_STAGE__RESTORE, ret);
 	return ret;
@@ -3113,6 +3353,8 @@ static int sigreturn_restore(pid_t pid, CoreEntry *core)
 
 	BUG_ON(core->mtype != CORE_ENTRY__MARCH);
 
+	/* The restorer writes there directly */
+	log_flush();
 	task_args->logfd	= log_get_fd();
 	task_args->loglevel	= log_get_loglevel();
 	task_args->sigchld_act	= sigchld_act;
@@ -3170,6 +3412,16 @@ static int sigreturn_restore(pid_t pid, CoreEntry *core)
 			ret = prep_sched_info(&thread_args[i].sp, tcore->thread_core);
 			if (ret)
 				goto err;
+
+			if (tcore->thread_core->n_mempolicy_nodes >
+					ARRAY_SIZE(thread_args[i].mempolicy_nodes)) {
+				pr_err("Memory policy nodes don't fit\n");
+				goto err;
+			}
+			thread_args[i].mempolicy	= tcore->thread_core->mempolicy;
+			memcpy(thread_args[i].mempolicy_nodes,
+			       tcore->thread_core->mempolicy_nodes,
+			       tcore->thread_core->n_mempolicy_nodes * sizeof(u64));
 		}
 
 		sigframe = (struct rt_sigframe *)thread_args[i].mem_zone.rt_sigframe;
@@ -3228,10 +3480,14 @@ static int sigreturn_restore(pid_t pid, CoreEntry *core)
 	if (restore_fs(current))
 		goto err;
 
+	if (setup_uffd(pid, task_args))
+		goto err;
+
 	close_image_dir();
 	close_proc();
 	close_service_fd(ROOT_FD_OFF);
 	close_service_fd(USERNSD_SK);
+	close_service_fd(LAZY_PAGES_SK_OFF);
 
 	__gcov_flush();
 
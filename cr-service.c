@@ -457,6 +457,12 @@ static int setup_opts_from_req(int sk, CriuOpts *req)
 	if (req->has_ghost_limit)
 		opts.ghost_limit = req->ghost_limit;
 
+	if (req->has_downtime)
+		opts.downtime = req->downtime;
+
+	if (req->has_max_pre_dumps && req->max_pre_dumps)
+		opts.max_pre_dumps = req->max_pre_dumps;
+
 	if (req->n_irmap_scan_paths) {
 		for (i = 0; i < req->n_irmap_scan_paths; i++) {
 			if (irmap_scan_path_add(req->irmap_scan_paths[i]))
@@ -487,7 +493,10 @@ static int dump_using_req(int sk, CriuOpts *req)
 	 * don't have ability to push scripts via RPC, so psitive
 	 * ret values are impossible here.
 	 */
-	if (cr_dump_tasks(req->pid))
+	if (opts.downtime) {
+		if (cr_iter_dump_tasks(req->pid))
+			goto exit;
+	} else if (cr_dump_tasks(req->pid))
 		goto exit;
 
 	success = true;
@@ -26,6 +26,7 @@
 #include "pstree.h"
 #include "cr-show.h"
 #include "crtools.h"
+#include "page-read.h"
 
 #include "protobuf.h"
 #include "protobuf/pstree.pb-c.h"
@@ -139,9 +140,34 @@ void print_image_data(struct cr_img *img, unsigned int length, int show)
 	xfree(data);
 }
 
+static void show_pagemap_recs(struct cr_img *img, unsigned int rec_size)
+{
+	struct pagemap_rec *r;
+
+	if (rec_size < sizeof(*r))
+		return;
+
+	r = xmalloc(rec_size);
+	if (!r)
+		return;
+
+	while (read_img_buf_eof(img, r, rec_size) > 0)
+		pr_msg("vaddr: %#"PRIx64" nr_pages: %u off: %#"PRIx64"%s%s\n",
+				r->vaddr, r->nr_pages, r->off,
+				r->flags & PE_IN_PARENT ? " in_parent" : "",
+				r->flags & PE_ZERO ? " zero" : "");
+
+	xfree(r);
+}
+
 static void show_pagemaps(struct cr_img *img, void *obj)
 {
-	pb_show_plain_pretty(img, PB_PAGEMAP, "nr_pages:%u");
+	PagemapHead *h = obj;
+
+	if (h->has_rec_size && h->rec_size)
+		show_pagemap_recs(img, h->rec_size);
+	else
+		pb_show_plain_pretty(img, PB_PAGEMAP, "nr_pages:%u");
 }
 
 void show_siginfo(struct cr_img *img)
@@ -336,6 +362,8 @@ static struct show_image_info show_infos[] = {
 	{ ITIMERS_MAGIC,	PB_ITIMER,		false,	NULL, "*:%Lu", },
 	{ POSIX_TIMERS_MAGIC,	PB_POSIX_TIMER,		false,	NULL, "*:%d 5:%Lu 7:%Lu 8:%lu 9:%Lu 10:%Lu", },
 	{ NETDEV_MAGIC,		PB_NETDEV,		false,	NULL, "2:%d", },
+	{ PAGES_INDEX_MAGIC,	PB_PAGES_BLOCK,		false,	NULL, NULL, },
+	{ HOTMAP_MAGIC,		PB_HOT_RANGE,		false,	NULL, NULL, },
 
 	{ PAGEMAP_MAGIC,	PB_PAGEMAP_HEAD,	true,	show_pagemaps,		NULL, },
 	{ PIPES_DATA_MAGIC,	PB_PIPE_DATA,		false,	pipe_data_handler,	NULL, },
@@ -0,0 +1,519 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+
+#include "crtools.h"
+#include "archive.h"
+#include "cr_options.h"
+#include "image.h"
+#include "page-read.h"
+#include "servicefd.h"
+#include "syscall.h"
+#include "xmalloc.h"
+#include "log.h"
+
+#include "protobuf.h"
+#include "protobuf/pagemap.pb-c.h"
+
+#undef	LOG_PREFIX
+#define LOG_PREFIX "squash: "
+
+/*
+ * Squashing of a snapshot chain. Every task's pagemap is replaced
+ * with a flat one holding all the pages that restore would read,
+ * taken from whatever parent they are in, so the images dir stops
+ * referring to the parent snapshots. Pages superseded in children
+ * are not copied at all, zero ones stay as zero entries.
+ *
+ * The new images are written into SQUASH_DIR first, then moved
+ * into the images dir, the parent link being removed the last.
+ */
+
+#define SQUASH_DIR		"squash.tmp"
+#define SQUASH_BUF_PAGES	64
+
+struct squash_task {
+	int		pid;
+	bool		done;		/* squashed pagemap is in SQUASH_DIR */
+	u32		old_id;		/* pages image it replaces */
+	bool		old_shared;
+	bool		old_comp;
+	u32		new_id;
+};
+
+struct squash {
+	struct cr_img	*pmi;
+	struct cr_img	*pi;
+	PagemapEntry	pe;		/* pending, grows with adjacent pages */
+	unsigned long	pages_off;	/* of pe's pages if it has ones */
+	unsigned long	nr_copied;
+	unsigned long	nr_zero;
+};
+
+static bool no_copy_range;
+
+static int squash_flush(struct squash *sq)
+{
+	PagemapEntry *pe = &sq->pe;
+	int ret;
+
+	if (!pe->nr_pages)
+		return 0;
+
+	if (opts.pagemap_fixed) {
+		struct pagemap_rec r = {
+			.vaddr		= pe->vaddr,
+			.nr_pages	= pe->nr_pages,
+			.off		= sq->pages_off,
+			.flags		= pe->zero ? PE_ZERO : 0,
+		};
+
+		ret = write_img(sq->pmi, &r);
+	} else
+		ret = pb_write_one(sq->pmi, pe, PB_PAGEMAP);
+
+	if (!pe->zero)
+		sq->pages_off += pe->nr_pages * PAGE_SIZE;
+	pe->nr_pages = 0;
+
+	return ret < 0 ? -1 : 0;
+}
+
+static int squash_add(struct squash *sq, unsigned long vaddr,
+		unsigned long nr, bool zero)
+{
+	PagemapEntry *pe = &sq->pe;
+
+	if (zero)
+		sq->nr_zero += nr;
+	else
+		sq->nr_copied += nr;
+
+	if (pe->nr_pages && pe->zero == zero &&
+	    pe->vaddr + pe->nr_pages * PAGE_SIZE == vaddr) {
+		pe->nr_pages += nr;
+		return 0;
+	}
+
+	if (squash_flush(sq))
+		return -1;
+
+	pe->vaddr = vaddr;
+	pe->nr_pages = nr;
+	pe->has_zero = zero;
+	pe->zero = zero;
+
+	return 0;
+}
+
+/*
+ * Copies the pages in the kernel, filesystems supporting that
+ * share the blocks with the parent's image instead of copying.
+ * Returns 1 if it can't be done and pages are to be read.
+ */
+static int copy_pages_range(int from, loff_t off, int to, unsigned long len)
+{
+	unsigned long done = 0;
+
+	if (no_copy_range)
+		return 1;
+
+	while (done < len) {
+		long ret;
+
+		ret = sys_copy_file_range(from, &off, to, NULL, len - done, 0);
+		if (ret < 0) {
+			if (!done && (ret == -ENOSYS || ret == -EXDEV ||
+				      ret == -EINVAL || ret == -EOPNOTSUPP)) {
+				pr_info("No copy_file_range for pages (%ld)\n", ret);
+				no_copy_range = true;
+				return 1;
+			}
+
+			pr_err("Can't copy pages (%ld)\n", ret);
+			return -1;
+		}
+
+		if (ret == 0) {
+			pr_err("Pages image ended at %lx\n", (unsigned long)off);
+			return -1;
+		}
+
+		done += ret;
+	}
+
+	return 0;
+}
+
+static int squash_copy(struct squash *sq, struct page_read *pr,
+		unsigned long vaddr, unsigned long nr)
+{
+	static char buf[SQUASH_BUF_PAGES * PAGE_SIZE];
+	unsigned long len = nr * PAGE_SIZE, left;
+	int to = img_raw_fd(sq->pi);
+	int ret;
+
+	/* Compressed images' pages have to be unpacked */
+	if (!pr->cr) {
+		ret = copy_pages_range(img_raw_fd(pr->pi),
+				pr->pi_off + img_raw_off(pr->pi), to, len);
+		if (ret < 0)
+			return -1;
+		if (ret == 0) {
+			pr->skip_pages(pr, len);
+			return squash_add(sq, vaddr, nr, false);
+		}
+	}
+
+	for (left = nr; left; ) {
+		unsigned long n = min(left, (unsigned long)SQUASH_BUF_PAGES);
+
+		if (pr->read_pages(pr, vaddr + (nr - left) * PAGE_SIZE, n, buf, 0) < 0)
+			return -1;
+
+		if (write(to, buf, n * PAGE_SIZE) != n * PAGE_SIZE) {
+			pr_perror("Can't write squashed pages");
+			return -1;
+		}
+
+		left -= n;
+	}
+
+	return squash_add(sq, vaddr, nr, false);
+}
+
+/*
+ * Puts the vaddr:nr pages as @pr sees them into the squashed
+ * images, going to parents for the ones being there.
+ */
+static int squash_range(struct squash *sq, struct page_read *pr,
+		unsigned long vaddr, unsigned long nr)
+{
+	while (nr) {
+		unsigned long n, len;
+		int ret;
+
+		ret = seek_pagemap_page(pr, vaddr, true);
+		if (ret <= 0)
+			return -1;
+
+		n = pr->pe->nr_pages - (vaddr - pr->pe->vaddr) / PAGE_SIZE;
+		if (n > nr)
+			n = nr;
+		len = n * PAGE_SIZE;
+
+		if (pr->pe->zero) {
+			ret = squash_add(sq, vaddr, n, true);
+			pr->skip_pages(pr, len);
+		} else if (pr->pe->in_parent) {
+			ret = squash_range(sq, pr->parent, vaddr, n);
+			pr->skip_pages(pr, len);
+		} else
+			ret = squash_copy(sq, pr, vaddr, n);
+
+		if (ret)
+			return -1;
+
+		vaddr += len;
+		nr -= n;
+	}
+
+	return 0;
+}
+
+/* Finds out the pages image the task's pagemap refers to now */
+static int read_old_head(struct squash_task *t)
+{
+	struct cr_img *img;
+	PagemapHead *h;
+	int ret = 0;
+
+	img = open_image(CR_FD_PAGEMAP, O_RSTR, (long)t->pid);
+	if (!img)
+		return -1;
+
+	/* Old format pages-PID images are never in a chain */
+	if (empty_image(img))
+		goto out;
+
+	ret = pb_read_one(img, &h, PB_PAGEMAP_HEAD);
+	if (ret < 0)
+		goto out;
+
+	t->old_id = h->pages_id;
+	t->old_shared = h->has_pages_shared && h->pages_shared;
+	t->old_comp = h->has_block_size && h->block_size;
+	pagemap_head__free_unpacked(h, NULL);
+	ret = 1;
+out:
+	close_image(img);
+	return ret;
+}
+
+static int squash_one(struct squash_task *t, int tdfd)
+{
+	PagemapHead ph = PAGEMAP_HEAD__INIT;
+	struct squash sq = { };
+	struct page_read pr;
+	struct iovec iov;
+	int ret;
+
+	ret = read_old_head(t);
+	if (ret <= 0)
+		return ret;
+
+	ret = open_page_read(t->pid, &pr, PR_TASK);
+	if (ret <= 0)
+		return -1;
+
+	if (!pr.parent) {
+		pr_info("%d: No parent pagemap\n", t->pid);
+		ret = 0;
+		goto out;
+	}
+
+	ret = -1;
+	sq.pmi = open_image_at(tdfd, CR_FD_PAGEMAP, O_DUMP, (long)t->pid);
+	if (!sq.pmi)
+		goto out;
+
+	if (opts.pagemap_fixed) {
+		ph.has_rec_size = true;
+		ph.rec_size = sizeof(struct pagemap_rec);
+	}
+
+	sq.pi = open_pages_image_at(tdfd, O_DUMP, sq.pmi, &ph);
+	if (!sq.pi)
+		goto out;
+
+	t->new_id = ph.pages_id;
+	pagemap_entry__init(&sq.pe);
+
+	while (1) {
+		ret = pr.get_pagemap(&pr, &iov);
+		if (ret <= 0)
+			break;
+
+		ret = squash_range(&sq, &pr, (unsigned long)iov.iov_base,
+				iov.iov_len / PAGE_SIZE);
+		pr.put_pagemap(&pr);
+		if (ret)
+			break;
+	}
+
+	if (!ret)
+		ret = squash_flush(&sq);
+	if (!ret) {
+		pr_info("%d: %lu pages copied, %lu zero\n",
+				t->pid, sq.nr_copied, sq.nr_zero);
+		t->done = true;
+	}
+out:
+	if (sq.pi)
+		close_image(sq.pi);
+	if (sq.pmi)
+		close_image(sq.pmi);
+	pr.close(&pr);
+	return ret;
+}
+
+static void squash_img_name(char *buf, int type, ...)
+{
+	va_list args;
+
+	va_start(args, type);
+	vsnprintf(buf, PATH_MAX, imgset_template[type].fmt, args);
+	va_end(args);
+}
+
+static int move_image(int tdfd, int dfd, char *name)
+{
+	if (renameat(tdfd, name, dfd, name)) {
+		pr_perror("Can't move squashed %s", name);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void drop_image(int dfd, char *name)
+{
+	if (unlinkat(dfd, name, 0) && errno != ENOENT)
+		pr_perror("Can't remove old %s", name);
+}
+
+static void remove_squash_dir(int dfd)
+{
+	struct dirent *de;
+	DIR *d;
+	int fd;
+
+	fd = openat(dfd, SQUASH_DIR, O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		return;
+
+	d = fdopendir(fd);
+	if (!d) {
+		close(fd);
+		return;
+	}
+
+	while ((de = readdir(d)) != NULL)
+		if (de->d_name[0] != '.')
+			unlinkat(fd, de->d_name, 0);
+
+	closedir(d);
+	if (unlinkat(dfd, SQUASH_DIR, AT_REMOVEDIR))
+		pr_perror("Can't remove " SQUASH_DIR);
+}
+
+/*
+ * Collects the tasks by their pagemaps and the highest pages
+ * image ID in use, the new pages images go above it.
+ */
+static int collect_squash_tasks(int dfd, struct squash_task **tasks,
+		int *nr, u32 *max_id)
+{
+	struct dirent *de;
+	DIR *d;
+	int fd;
+
+	fd = dup(dfd);
+	if (fd < 0) {
+		pr_perror("Can't dup images dir");
+		return -1;
+	}
+
+	d = fdopendir(fd);
+	if (!d) {
+		pr_perror("Can't read images dir");
+		close(fd);
+		return -1;
+	}
+
+	rewinddir(d);
+	while ((de = readdir(d)) != NULL) {
+		unsigned int id;
+		int pid;
+
+		if (sscanf(de->d_name, "pages-%u.img", &id) == 1) {
+			if (id > *max_id)
+				*max_id = id;
+			continue;
+		}
+
+		if (sscanf(de->d_name, "pagemap-%d.img", &pid) != 1)
+			continue;
+
+		if (xrealloc_safe(tasks, (*nr + 1) * sizeof(**tasks))) {
+			closedir(d);
+			return -1;
+		}
+
+		memzero(&(*tasks)[*nr], sizeof(**tasks));
+		(*tasks)[*nr].pid = pid;
+		(*nr)++;
+	}
+
+	closedir(d);
+	return 0;
+}
+
+int cr_squash(void)
+{
+	int dfd = get_service_fd(IMG_FD_OFF), tdfd;
+	struct squash_task *tasks = NULL;
+	char name[PATH_MAX];
+	int i, nr = 0, ret = -1;
+	u32 max_id = 0;
+
+	if (!faccessat(dfd, ARCHIVE_NAME, F_OK, 0)) {
+		pr_err("Can't squash archived images\n");
+		return -1;
+	}
+
+	if (faccessat(dfd, CR_PARENT_LINK, F_OK, AT_SYMLINK_NOFOLLOW)) {
+		pr_info("No parent snapshot, nothing to squash\n");
+		return 0;
+	}
+
+	if (collect_squash_tasks(dfd, &tasks, &nr, &max_id))
+		goto out;
+
+	if (mkdirat(dfd, SQUASH_DIR, 0700)) {
+		pr_perror("Can't create " SQUASH_DIR);
+		goto out;
+	}
+
+	tdfd = openat(dfd, SQUASH_DIR, O_RDONLY | O_DIRECTORY);
+	if (tdfd < 0) {
+		pr_perror("Can't open " SQUASH_DIR);
+		goto out_rm;
+	}
+
+	pin_page_id(max_id + 1);
+
+	for (i = 0; i < nr; i++) {
+		pr_info("Squashing pagemap of %d\n", tasks[i].pid);
+		if (squash_one(&tasks[i], tdfd) < 0)
+			goto out_close;
+	}
+
+	/*
+	 * Pages images first, they are not referred to till the
+	 * pagemaps replace the old ones.
+	 */
+	for (i = 0; i < nr; i++) {
+		if (!tasks[i].done)
+			continue;
+
+		squash_img_name(name, CR_FD_PAGES, tasks[i].new_id);
+		if (move_image(tdfd, dfd, name))
+			goto out_close;
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (!tasks[i].done)
+			continue;
+
+		squash_img_name(name, CR_FD_PAGEMAP, (long)tasks[i].pid);
+		if (move_image(tdfd, dfd, name))
+			goto out_close;
+	}
+
+	for (i = 0; i < nr; i++) {
+		struct squash_task *t = &tasks[i];
+
+		/* The store can be used by shmem pagemaps as well */
+		if (!t->done || t->old_shared)
+			continue;
+
+		squash_img_name(name, CR_FD_PAGES, t->old_id);
+		drop_image(dfd, name);
+		if (t->old_comp) {
+			squash_img_name(name, CR_FD_PAGES_INDEX, t->old_id);
+			drop_image(dfd, name);
+		}
+	}
+
+	if (unlinkat(dfd, CR_PARENT_LINK, 0)) {
+		pr_perror("Can't remove parent link");
+		goto out_close;
+	}
+
+	pr_info("Squashed %d pagemaps\n", nr);
+	ret = 0;
+out_close:
+	close(tdfd);
+out_rm:
+	remove_squash_dir(dfd);
+out:
+	xfree(tasks);
+	return ret;
+}
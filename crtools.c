@@ -42,6 +42,7 @@
 #include "irmap.h"
 #include "fault-injection.h"
 #include "lsm.h"
+#include "uffd.h"
 
 #include "setproctitle.h"
 
@@ -65,6 +66,7 @@ void init_opts(void)
 	opts.manage_cgroups = CG_MODE_DEFAULT;
 	opts.ps_socket = -1;
 	opts.ghost_limit = DEFAULT_GHOST_LIMIT;
+	opts.max_pre_dumps = DEFAULT_MAX_PRE_DUMPS;
 }
 
 static int parse_ns_string(const char *ptr)
@@ -255,6 +257,21 @@ int main(int argc, char *argv[], char *envp[])
 		{ "ghost-limit",		required_argument,	0, 1069 },
 		{ "irmap-scan-path",		required_argument,	0, 1070 },
 		{ "lsm-profile",		required_argument,	0, 1071 },
+		{ "dump-jobs",			required_argument,	0, 1072 },
+		{ "compress",			no_argument,		0, 1073 },
+		{ "lazy-pages",			no_argument,		0, 1074 },
+		{ "page-server-batch",		no_argument,		0, 1075 },
+		{ "page-dedup",			no_argument,		0, 1076 },
+		{ "skip-zero-pages",		no_argument,		0, 1077 },
+		{ "downtime",			required_argument,	0, 1078 },
+		{ "max-pre-dumps",		required_argument,	0, 1079 },
+		{ "log-async",			no_argument,		0, 1080 },
+		{ "archive",			no_argument,		0, 1081 },
+		{ "pagemap-fixed",		no_argument,		0, 1082 },
+		{ "kerndat-reprobe",		no_argument,		0, 1083 },
+		{ "pre-dump-mode",		required_argument,	0, 1084 },
+		{ "pre-dump-mem-limit",		required_argument,	0, 1085 },
+		{ "hot-pages",			no_argument,		0, 1086 },
 		{ },
 	};
 
@@ -504,6 +521,80 @@ int main(int argc, char *argv[], char *envp[])
 			if (parse_lsm_arg(optarg) < 0)
 				return -1;
 			break;
+		case 1072:
+			{
+				char *end;
+				long jobs;
+
+				jobs = strtol(optarg, &end, 10);
+				if (end == optarg || *end || jobs < 1 || jobs > INT_MAX)
+					goto bad_arg;
+				opts.dump_jobs = jobs;
+			}
+			break;
+		case 1073:
+#ifdef CONFIG_HAS_LZ4
+			opts.compress = true;
+			break;
+#else
+			pr_msg("Error: CRIU is built without LZ4, pages can't be compressed\n");
+			return 1;
+#endif
+		case 1074:
+#ifdef CONFIG_HAS_UFFD
+			opts.lazy_pages = true;
+			break;
+#else
+			pr_msg("Error: CRIU is built without userfaultfd, lazy restore is impossible\n");
+			return 1;
+#endif
+		case 1075:
+			opts.ps_batch = true;
+			break;
+		case 1076:
+			opts.page_dedup = true;
+			break;
+		case 1077:
+			opts.skip_zero_pages = true;
+			break;
+		case 1078:
+			opts.downtime = atoi(optarg);
+			if (!opts.downtime)
+				goto bad_arg;
+			break;
+		case 1079:
+			opts.max_pre_dumps = atoi(optarg);
+			if (!opts.max_pre_dumps)
+				goto bad_arg;
+			break;
+		case 1080:
+			opts.log_async = true;
+			break;
+		case 1081:
+			opts.archive = true;
+			break;
+		case 1082:
+			opts.pagemap_fixed = true;
+			break;
+		case 1083:
+			opts.kerndat_reprobe = true;
+			break;
+		case 1084:
+			if (!strcmp(optarg, "splice"))
+				opts.pre_dump_mode = PRE_DUMP_SPLICE;
+			else if (!strcmp(optarg, "read"))
+				opts.pre_dump_mode = PRE_DUMP_READ;
+			else
+				goto bad_arg;
+			break;
+		case 1085:
+			opts.pre_dump_mem_limit = parse_size(optarg);
+			if (!opts.pre_dump_mem_limit)
+				goto bad_arg;
+			break;
+		case 1086:
+			opts.hot_pages = true;
+			break;
 		case 'M':
 			{
 				char *aux;
@@ -576,6 +667,11 @@ int main(int argc, char *argv[], char *envp[])
 		opts.exec_cmd[argc - optind - 1] = NULL;
 	}
 
+	if (opts.page_dedup && opts.compress) {
+		pr_msg("Error: --page-dedup and --compress cannot be used together\n");
+		goto usage;
+	}
+
 	/* We must not open imgs dir, if service is called */
 	if (strcmp(argv[optind], "service")) {
 		ret = open_image_dir(imgs_dir);
@@ -610,6 +706,8 @@ int main(int argc, char *argv[], char *envp[])
 
 		if (!tree_id)
 			goto opt_pid_missing;
+		if (opts.downtime)
+			return cr_iter_dump_tasks(tree_id);
 		return cr_dump_tasks(tree_id);
 	}
 
@@ -652,12 +750,18 @@ int main(int argc, char *argv[], char *envp[])
 	if (!strcmp(argv[optind], "page-server"))
 		return cr_page_server(opts.daemon_mode, -1) > 0 ? 0 : 1;
 
+	if (!strcmp(argv[optind], "lazy-pages"))
+		return cr_lazy_pages(opts.daemon_mode) != 0;
+
 	if (!strcmp(argv[optind], "service"))
 		return cr_service(opts.daemon_mode);
 
 	if (!strcmp(argv[optind], "dedup"))
 		return cr_dedup() != 0;
 
+	if (!strcmp(argv[optind], "squash"))
+		return cr_squash() != 0;
+
 	if (!strcmp(argv[optind], "cpuinfo")) {
 		if (!argv[optind + 1])
 			goto usage;
@@ -676,8 +780,10 @@ usage:
 "  criu check [--ms]\n"
 "  criu exec -p PID <syscall-string>\n"
 "  criu page-server\n"
+"  criu lazy-pages\n"
 "  criu service [<options>]\n"
 "  criu dedup\n"
+"  criu squash\n"
 "\n"
 "Commands:\n"
 "  dump           checkpoint a process/tree identified by pid\n"
@@ -686,8 +792,10 @@ usage:
 "  check          checks whether the kernel support is up-to-date\n"
 "  exec           execute a system call by other task\n"
 "  page-server    launch page server\n"
+"  lazy-pages     serve memory of tasks restored with --lazy-pages\n"
 "  service        launch service\n"
 "  dedup          remove duplicates in memory dump\n"
+"  squash         merge parent snapshots' memory into the images dir\n"
 "  cpuinfo dump   writes cpu information into image file\n"
 "  cpuinfo check  validates cpu information read from image file\n"
 	);
@@ -716,6 +824,7 @@ usage:
 "                        restore making it the parent of the restored process\n"
 "  --freeze-cgroup\n"
 "                        use cgroup freezer to collect processes\n"
+"  --kerndat-reprobe     probe kernel features again, not using /run/criu.kdat\n"
 "\n"
 "* Special resources support:\n"
 "  -x|--" USK_EXT_PARAM "inode,.." "      allow external unix connections (optionally can be assign socket's inode that allows one-sided dump)\n"
@@ -757,6 +866,7 @@ usage:
 "* Logging:\n"
 "  -o|--log-file FILE    log file name\n"
 "     --log-pid          enable per-process logging to separate FILE.pid files\n"
+"     --log-async        write log lines from a buffer in a separate process\n"
 "  -v[NUM]               set logging level (higher level means more output):\n"
 "                          -v1|-v    - only errors and messages\n"
 "                          -v2|-vv   - also warnings (default level)\n"
@@ -767,10 +877,28 @@ usage:
 "  --track-mem           turn on memory changes tracker in kernel\n"
 "  --prev-images-dir DIR path to images from previous dump (relative to -D)\n"
 "  --page-server         send pages to page server (see options below as well)\n"
+"  --page-server-batch   send pages to page server in batches per pipe buffer\n"
 "  --auto-dedup          when used on dump it will deduplicate \"old\" data in\n"
 "                        pages images of previous dump\n"
 "                        when used on restore, as soon as page is restored, it\n"
 "                        will be punched from the image.\n"
+"  --dump-jobs N         dump memory of up to N tasks in parallel\n"
+"  --compress            write pages images compressed with LZ4\n"
+"  --page-dedup          store pages with the same contents only once\n"
+"  --skip-zero-pages     don't put pages filled with zeroes into images\n"
+"  --archive             put all images into one images.cra file\n"
+"  --pagemap-fixed       write pagemaps of fixed-size binary-searchable records\n"
+"  --downtime MS         on dump pre-dump memory iteratively until the tasks\n"
+"                        can be dumped frozen for about MS milliseconds\n"
+"  --max-pre-dumps N     do at most N pre-dumps with --downtime (default 8)\n"
+"  --pre-dump-mode MODE  splice (default) memory with parasite while tasks\n"
+"                        are frozen or read it after they resume\n"
+"  --pre-dump-mem-limit size\n"
+"                        keep at most size of memory in pipes on pre-dump,\n"
+"                        writing it out while the tasks are still frozen\n"
+"  --hot-pages           on pre-dump mark pages idle, on dump record pages\n"
+"                        touched since then to restore them first\n"
+"  --lazy-pages          on restore leave anonymous memory to lazy-pages daemon\n"
 "\n"
 "Page/Service server options:\n"
 "  --address ADDR        address of server or service\n"
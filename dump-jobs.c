@@ -0,0 +1,269 @@
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "cr_options.h"
+#include "dump-jobs.h"
+#include "image.h"
+#include "mem.h"
+#include "page-xfer.h"
+#include "pstree.h"
+#include "stats.h"
+#include "util.h"
+#include "xmalloc.h"
+
+#undef	LOG_PREFIX
+#define LOG_PREFIX "dump-jobs: "
+
+struct dump_worker {
+	bool			busy;
+	unsigned int		nr_tasks;
+	struct dump_stats_part	total;
+};
+
+static LIST_HEAD(running_jobs);
+static unsigned int nr_running;
+
+static struct dump_worker *workers;
+/* Shared with the workers, each one fills its slot before exit */
+static struct dump_stats_part *worker_parts;
+
+int dump_jobs_init(void)
+{
+	if (opts.dump_jobs <= 1)
+		return 0;
+
+	pr_info("Will dump memory with %u workers\n", opts.dump_jobs);
+
+	workers = xzalloc(opts.dump_jobs * sizeof(*workers));
+	if (!workers)
+		return -1;
+
+	worker_parts = mmap(NULL, opts.dump_jobs * sizeof(*worker_parts),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, 0, 0);
+	if (worker_parts == MAP_FAILED) {
+		pr_perror("Can't map dump workers stats");
+		xfree(workers);
+		workers = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+void dump_jobs_fini(void)
+{
+	unsigned int i;
+
+	if (!workers)
+		return;
+
+	BUG_ON(nr_running);
+
+	for (i = 0; i < opts.dump_jobs; i++) {
+		struct dump_worker *w = &workers[i];
+
+		pr_info("Worker %u: %u tasks, %lu pages written, %lu skipped, "
+				"memdump %ld.%06lds memwrite %ld.%06lds\n", i,
+				w->nr_tasks, w->total.counts[CNT_PAGES_WRITTEN],
+				w->total.counts[CNT_PAGES_SKIPPED_PARENT],
+				(long)w->total.memdump.tv_sec, (long)w->total.memdump.tv_usec,
+				(long)w->total.memwrite.tv_sec, (long)w->total.memwrite.tv_usec);
+	}
+
+	munmap(worker_parts, opts.dump_jobs * sizeof(*worker_parts));
+	xfree(workers);
+	workers = NULL;
+}
+
+unsigned int dump_jobs_running(void)
+{
+	return nr_running;
+}
+
+struct dump_job *alloc_dump_job(struct pstree_item *item,
+		struct parasite_ctl *ctl, struct vm_area_list *vmas)
+{
+	struct dump_job *job;
+
+	job = xmalloc(sizeof(*job));
+	if (!job)
+		return NULL;
+
+	job->pid = -1;
+	job->fd = -1;
+	job->slot = -1;
+	job->item = item;
+	job->ctl = ctl;
+
+	/* The worker gets the vmas, the caller's list is left empty */
+	job->vmas = *vmas;
+	INIT_LIST_HEAD(&job->vmas.h);
+	list_splice_init(&vmas->h, &job->vmas.h);
+	vmas->nr = 0;
+
+	return job;
+}
+
+static int dump_job_worker(struct dump_job *job)
+{
+	int ret;
+
+	dump_stats_part_reset();
+	pin_page_id(job->pages_id);
+	page_server_use_stream(job->slot);
+
+	ret = parasite_dump_pages_seized(job->ctl, &job->vmas, NULL);
+
+	dump_stats_part_get(&worker_parts[job->slot]);
+	return ret;
+}
+
+int dump_job_start(struct dump_job *job)
+{
+	int p[2], i;
+
+	BUG_ON(nr_running >= opts.dump_jobs);
+
+	for (i = 0; i < opts.dump_jobs; i++)
+		if (!workers[i].busy)
+			break;
+	BUG_ON(i == opts.dump_jobs);
+
+	if (pipe(p)) {
+		pr_perror("Can't make status pipe for dump worker");
+		return -1;
+	}
+
+	job->slot = i;
+	job->pages_id = reserve_page_id();
+
+	job->pid = fork();
+	if (job->pid < 0) {
+		pr_perror("Can't fork dump worker");
+		close(p[0]);
+		close(p[1]);
+		return -1;
+	}
+
+	if (job->pid == 0) {
+		int ret;
+
+		close(p[0]);
+		ret = dump_job_worker(job);
+		if (write(p[1], &ret, sizeof(ret)) != sizeof(ret))
+			pr_perror("Can't report dump worker status");
+		exit(ret ? 1 : 0);
+	}
+
+	close(p[1]);
+	job->fd = p[0];
+
+	workers[i].busy = true;
+	list_add_tail(&job->l, &running_jobs);
+	nr_running++;
+
+	pr_info("Started worker %d in slot %d for %d\n",
+			job->pid, job->slot, job->item->pid.real);
+	return 0;
+}
+
+static int dump_job_collect(struct dump_job *job)
+{
+	int ret, status;
+
+	ret = read(job->fd, &status, sizeof(status));
+	if (ret != sizeof(status)) {
+		pr_err("Dump worker %d died (%d)\n", job->pid, ret);
+		status = -1;
+	}
+
+	close(job->fd);
+	job->fd = -1;
+
+	if (waitpid(job->pid, &ret, 0) != job->pid) {
+		pr_perror("Can't wait dump worker %d", job->pid);
+		status = -1;
+	} else if (!WIFEXITED(ret) || WEXITSTATUS(ret)) {
+		pr_err("Dump worker %d exited with %#x\n", job->pid, ret);
+		status = -1;
+	}
+
+	if (!status) {
+		struct dump_worker *w = &workers[job->slot];
+		struct dump_stats_part *part = &worker_parts[job->slot];
+		int i;
+
+		dump_stats_part_add(part);
+
+		w->nr_tasks++;
+		for (i = 0; i < DUMP_CNT_NR_STATS; i++)
+			w->total.counts[i] += part->counts[i];
+		timeradd(&w->total.memdump, &part->memdump, &w->total.memdump);
+		timeradd(&w->total.memwrite, &part->memwrite, &w->total.memwrite);
+	}
+
+	workers[job->slot].busy = false;
+	list_del(&job->l);
+	nr_running--;
+
+	return status;
+}
+
+/*
+ * Waits for any of the running workers to finish and returns its
+ * job. The @status is set to 0 if the worker dumped all the pages.
+ */
+struct dump_job *dump_job_wait(int *status)
+{
+	struct pollfd pfds[nr_running];
+	struct dump_job *job;
+	int i;
+
+	BUG_ON(!nr_running);
+
+	i = 0;
+	list_for_each_entry(job, &running_jobs, l) {
+		pfds[i].fd = job->fd;
+		pfds[i].events = POLLIN;
+		i++;
+	}
+
+	while (poll(pfds, nr_running, -1) < 0) {
+		if (errno == EINTR)
+			continue;
+		pr_perror("Can't poll dump workers");
+		/* Reap the first one anyway, the caller will abort */
+		job = list_first_entry(&running_jobs, struct dump_job, l);
+		kill(job->pid, SIGKILL);
+		dump_job_collect(job);
+		*status = -1;
+		return job;
+	}
+
+	i = 0;
+	list_for_each_entry(job, &running_jobs, l) {
+		if (pfds[i].revents)
+			break;
+		i++;
+	}
+
+	BUG_ON(&job->l == &running_jobs);
+
+	*status = dump_job_collect(job);
+	return job;
+}
+
+void dump_jobs_kill(void)
+{
+	struct dump_job *job;
+
+	list_for_each_entry(job, &running_jobs, l) {
+		pr_warn("Killing dump worker %d\n", job->pid);
+		kill(job->pid, SIGKILL);
+	}
+}
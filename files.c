@@ -676,6 +676,13 @@ int prepare_ctl_tty(int pid, struct rst_info *rst_info, u32 ctl_tty_id)
 	return 0;
 }
 
+static int collect_fdinfo(void *e, void *arg)
+{
+	struct pstree_item *item = arg;
+
+	return collect_fd(item->pid.virt, e, rsti(item));
+}
+
 int prepare_fd_pid(struct pstree_item *item)
 {
 	int ret = 0;
@@ -704,19 +711,8 @@ int prepare_fd_pid(struct pstree_item *item)
 			return -1;
 	}
 
-	while (1) {
-		FdinfoEntry *e;
-
-		ret = pb_read_one_eof(img, &e, PB_FDINFO);
-		if (ret <= 0)
-			break;
-
-		ret = collect_fd(pid, e, rst_info);
-		if (ret < 0) {
-			fdinfo_entry__free_unpacked(e, NULL);
-			break;
-		}
-	}
+	/* The entries are kept in fdinfo_list_entry-s */
+	ret = pb_read_all(img, PB_FDINFO, true, collect_fdinfo, item);
 
 	close_image(img);
 	return ret;
@@ -0,0 +1,345 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+
+#include "asm/types.h"
+#include "compiler.h"
+#include "xmalloc.h"
+#include "image.h"
+#include "util.h"
+#include "log.h"
+#include "kerndat.h"
+#include "mem.h"
+#include "pagemap-cache.h"
+#include "hotmap.h"
+
+#include "protobuf.h"
+
+#undef	LOG_PREFIX
+#define LOG_PREFIX "hotmap: "
+
+#define PAGE_IDLE_BITMAP	"/sys/kernel/mm/page_idle/bitmap"
+
+/* Words of the idle bitmap kept at hands, each covers 64 PFNs */
+#define HOTMAP_WORDS		512
+/* Pagemap entries read at once */
+#define HOTMAP_PMES		512
+
+struct hotmap {
+	int		pagemap_fd;
+	int		idle_fd;
+	bool		record;
+
+	/* A window of the idle bitmap, being filled or read */
+	u64		words[HOTMAP_WORDS];
+	unsigned long	start;		/* first word in there */
+	unsigned int	nr;		/* words in use */
+
+	struct cr_img	*img;
+	HotRangeEntry	cur;		/* range being collected */
+	unsigned long	nr_pages;	/* marked or found hot */
+};
+
+static int hotmap_flush_idle(struct hotmap *hm)
+{
+	size_t len = hm->nr * sizeof(u64);
+
+	if (!hm->nr)
+		return 0;
+
+	if (pwrite(hm->idle_fd, hm->words, len, hm->start * sizeof(u64)) != len) {
+		pr_perror("Can't mark pages idle");
+		return -1;
+	}
+
+	hm->nr = 0;
+	return 0;
+}
+
+static int hotmap_mark(struct hotmap *hm, u64 pfn)
+{
+	unsigned long w = pfn / 64;
+
+	if (hm->nr && (w < hm->start || w >= hm->start + HOTMAP_WORDS)) {
+		if (hotmap_flush_idle(hm))
+			return -1;
+	}
+
+	if (!hm->nr) {
+		memzero(hm->words, sizeof(hm->words));
+		hm->start = w;
+	}
+
+	hm->words[w - hm->start] |= 1ULL << (pfn % 64);
+	if (w - hm->start >= hm->nr)
+		hm->nr = w - hm->start + 1;
+
+	return 0;
+}
+
+static int hotmap_is_idle(struct hotmap *hm, u64 pfn)
+{
+	unsigned long w = pfn / 64;
+
+	if (!hm->nr || w < hm->start || w >= hm->start + hm->nr) {
+		ssize_t ret;
+
+		/* The tail beyond the last PFN is cut off by kernel */
+		memzero(hm->words, sizeof(hm->words));
+		ret = pread(hm->idle_fd, hm->words, sizeof(hm->words), w * sizeof(u64));
+		if (ret <= 0) {
+			pr_perror("Can't read idle pages bitmap at %lx", w);
+			return -1;
+		}
+
+		hm->start = w;
+		hm->nr = HOTMAP_WORDS;
+	}
+
+	return !!(hm->words[w - hm->start] & (1ULL << (pfn % 64)));
+}
+
+static int hotmap_put_range(struct hotmap *hm)
+{
+	if (!hm->cur.nr_pages)
+		return 0;
+
+	if (pb_write_one(hm->img, &hm->cur, PB_HOT_RANGE))
+		return -1;
+
+	hm->cur.nr_pages = 0;
+	return 0;
+}
+
+static int hotmap_add_hot(struct hotmap *hm, unsigned long vaddr)
+{
+	hm->nr_pages++;
+
+	if (hm->cur.nr_pages &&
+	    hm->cur.vaddr + hm->cur.nr_pages * PAGE_SIZE == vaddr) {
+		hm->cur.nr_pages++;
+		return 0;
+	}
+
+	if (hotmap_put_range(hm))
+		return -1;
+
+	hm->cur.vaddr = vaddr;
+	hm->cur.nr_pages = 1;
+	return 0;
+}
+
+/* Returns 1 if PFNs are not shown, idle tracking can't work then */
+static int hotmap_page(struct hotmap *hm, unsigned long vaddr, u64 pme)
+{
+	u64 pfn = PME_PFRAME(pme);
+	int idle;
+
+	if (!(pme & PME_PRESENT) || pfn == kdat.zero_page_pfn)
+		return 0;
+
+	if (!pfn)
+		return 1;
+
+	if (!hm->record) {
+		hm->nr_pages++;
+		return hotmap_mark(hm, pfn);
+	}
+
+	idle = hotmap_is_idle(hm, pfn);
+	if (idle < 0)
+		return -1;
+
+	return idle ? 0 : hotmap_add_hot(hm, vaddr);
+}
+
+int hotmap_area(struct hotmap *hm, unsigned long start, unsigned long end)
+{
+	u64 map[HOTMAP_PMES];
+	unsigned long addr, i, nr;
+
+	for (addr = start; addr < end; addr += nr * PAGE_SIZE) {
+		nr = min_t(unsigned long, (end - addr) / PAGE_SIZE, HOTMAP_PMES);
+
+		if (pread(hm->pagemap_fd, map, nr * sizeof(u64),
+			  PAGEMAP_PFN_OFF(addr)) != nr * sizeof(u64)) {
+			pr_perror("Can't read pagemap at %lx", addr);
+			return -1;
+		}
+
+		for (i = 0; i < nr; i++) {
+			int ret;
+
+			ret = hotmap_page(hm, addr + i * PAGE_SIZE, map[i]);
+			if (ret < 0)
+				return -1;
+			if (ret) {
+				pr_err("No PFNs in pagemap, can't track pages\n");
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+int hotmap_open(struct hotmap **hmp, pid_t pid, pid_t vpid, bool record)
+{
+	struct hotmap *hm;
+
+	*hmp = NULL;
+
+	hm = xzalloc(sizeof(*hm));
+	if (!hm)
+		return -1;
+
+	hm->record = record;
+	hm->pagemap_fd = -1;
+	hot_range_entry__init(&hm->cur);
+
+	hm->idle_fd = open(PAGE_IDLE_BITMAP, record ? O_RDONLY : O_WRONLY);
+	if (hm->idle_fd < 0) {
+		if (errno != ENOENT) {
+			pr_perror("Can't open " PAGE_IDLE_BITMAP);
+			goto err;
+		}
+
+		pr_warn("No idle page tracking, not tracking hot pages\n");
+		xfree(hm);
+		return 0;
+	}
+
+	hm->pagemap_fd = open_proc(pid, "pagemap");
+	if (hm->pagemap_fd < 0)
+		goto err;
+
+	if (record) {
+		hm->img = open_image(CR_FD_HOTMAP, O_DUMP, (long)vpid);
+		if (!hm->img)
+			goto err;
+	}
+
+	*hmp = hm;
+	return 0;
+
+err:
+	close_safe(&hm->pagemap_fd);
+	close_safe(&hm->idle_fd);
+	xfree(hm);
+	return -1;
+}
+
+int hotmap_close(struct hotmap *hm)
+{
+	int ret;
+
+	if (!hm)
+		return 0;
+
+	if (hm->record) {
+		ret = hotmap_put_range(hm);
+		close_image(hm->img);
+		pr_info("%lu pages hot\n", hm->nr_pages);
+	} else {
+		ret = hotmap_flush_idle(hm);
+		pr_info("%lu pages marked idle\n", hm->nr_pages);
+	}
+
+	close_safe(&hm->pagemap_fd);
+	close_safe(&hm->idle_fd);
+	xfree(hm);
+	return ret;
+}
+
+int hot_ranges_load(pid_t vpid, struct hot_ranges *hr)
+{
+	struct cr_img *img;
+	int ret = 0;
+
+	hr->r = NULL;
+	hr->nr = 0;
+
+	img = open_image(CR_FD_HOTMAP, O_RSTR, (long)vpid);
+	if (!img)
+		return -1;
+
+	while (!empty_image(img)) {
+		HotRangeEntry *e, **r;
+
+		ret = pb_read_one_eof(img, &e, PB_HOT_RANGE);
+		if (ret <= 0)
+			break;
+
+		if (hr->nr && hr->r[hr->nr - 1]->vaddr >= e->vaddr) {
+			pr_err("Hot ranges of %d are not sorted\n", vpid);
+			hot_range_entry__free_unpacked(e, NULL);
+			ret = -1;
+			break;
+		}
+
+		r = xrealloc(hr->r, (hr->nr + 1) * sizeof(*r));
+		if (!r) {
+			hot_range_entry__free_unpacked(e, NULL);
+			ret = -1;
+			break;
+		}
+
+		hr->r = r;
+		hr->r[hr->nr++] = e;
+	}
+
+	close_image(img);
+
+	if (ret < 0) {
+		hot_ranges_free(hr);
+		return -1;
+	}
+
+	pr_info("%u hot ranges for %d\n", hr->nr, vpid);
+	return 0;
+}
+
+/*
+ * Tells whether @addr is hot. The @end is where the hot range it is
+ * in ends, or where the next one starts if it's not hot.
+ */
+bool hot_ranges_find(struct hot_ranges *hr, unsigned long addr, unsigned long *end)
+{
+	unsigned int lo = 0, hi = hr->nr;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		HotRangeEntry *e = hr->r[mid];
+
+		if (e->vaddr + (u64)e->nr_pages * PAGE_SIZE <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == hr->nr) {
+		*end = ~0UL;
+		return false;
+	}
+
+	if (hr->r[lo]->vaddr > addr) {
+		*end = hr->r[lo]->vaddr;
+		return false;
+	}
+
+	*end = hr->r[lo]->vaddr + (u64)hr->r[lo]->nr_pages * PAGE_SIZE;
+	return true;
+}
+
+void hot_ranges_free(struct hot_ranges *hr)
+{
+	unsigned int i;
+
+	for (i = 0; i < hr->nr; i++)
+		hot_range_entry__free_unpacked(hr->r[i], NULL);
+
+	xfree(hr->r);
+	hr->r = NULL;
+	hr->nr = 0;
+}
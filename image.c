@@ -1,6 +1,7 @@
 #include <unistd.h>
 #include <stdarg.h>
 #include <fcntl.h>
+#include "archive.h"
 #include "crtools.h"
 #include "cr_options.h"
 #include "imgset.h"
@@ -236,6 +237,7 @@ struct cr_img *open_image_at(int dfd, int type, unsigned long flags, ...)
 	if (!img)
 		return NULL;
 
+	img->ar = NULL;
 	oflags = flags | imgset_template[type].oflags;
 
 	va_start(args, flags);
@@ -308,6 +310,12 @@ static int do_open_image(struct cr_img *img, int dfd, int type, unsigned long of
 
 	flags = oflags & ~(O_NOBUF | O_SERVICE);
 
+	ret = archive_open_image(img, dfd, type, flags, path);
+	if (ret < 0)
+		goto err;
+	if (ret)
+		goto opened;
+
 	ret = openat(dfd, path, flags, CR_FD_PERM);
 	if (ret < 0) {
 		if (!(flags & O_CREAT) && (errno == ENOENT)) {
@@ -321,6 +329,7 @@ static int do_open_image(struct cr_img *img, int dfd, int type, unsigned long of
 	}
 
 	img->_x.fd = ret;
+opened:
 	if (oflags & O_NOBUF)
 		bfd_setraw(&img->_x);
 	else {
@@ -377,7 +386,9 @@ void close_image(struct cr_img *img)
 		 */
 		unlinkat(get_service_fd(IMG_FD_OFF), img->path, 0);
 		xfree(img->path);
-	} else if (!empty_image(img))
+	} else if (img->ar)
+		archive_close_image(img);
+	else if (!empty_image(img))
 		bclose(&img->_x);
 
 	xfree(img);
@@ -389,6 +400,7 @@ struct cr_img *img_from_fd(int fd)
 
 	img = xmalloc(sizeof(*img));
 	if (img) {
+		img->ar = NULL;
 		img->_x.fd = fd;
 		bfd_setraw(&img->_x);
 	}
@@ -446,29 +458,53 @@ void up_page_ids_base(void)
 	page_ids += 0x10000;
 }
 
-struct cr_img *open_pages_image_at(int dfd, unsigned long flags, struct cr_img *pmi)
+/*
+ * Dump workers (dump-jobs.c) open pages images in forked
+ * copies of criu, so the ID has to be taken in the parent
+ * and then pinned in the worker.
+ */
+unsigned long reserve_page_id(void)
 {
-	unsigned id;
+	return page_ids++;
+}
 
+void pin_page_id(unsigned long id)
+{
+	page_ids = id;
+}
+
+/*
+ * On read the @ph gets the head found in the pagemap, on write the
+ * caller fills everything but the pages_id, which is generated here.
+ */
+struct cr_img *open_pages_image_at(int dfd, unsigned long flags,
+		struct cr_img *pmi, PagemapHead *ph)
+{
 	if (flags == O_RDONLY || flags == O_RDWR) {
 		PagemapHead *h;
 		if (pb_read_one(pmi, &h, PB_PAGEMAP_HEAD) < 0)
 			return NULL;
-		id = h->pages_id;
+		ph->pages_id = h->pages_id;
+		ph->has_block_size = h->has_block_size;
+		ph->block_size = h->block_size;
+		ph->has_pages_shared = h->has_pages_shared;
+		ph->pages_shared = h->pages_shared;
+		ph->has_rec_size = h->has_rec_size;
+		ph->rec_size = h->rec_size;
 		pagemap_head__free_unpacked(h, NULL);
 	} else {
-		PagemapHead h = PAGEMAP_HEAD__INIT;
-		id = h.pages_id = page_ids++;
-		if (pb_write_one(pmi, &h, PB_PAGEMAP_HEAD) < 0)
+		ph->pages_id = page_ids++;
+		if (pb_write_one(pmi, ph, PB_PAGEMAP_HEAD) < 0)
 			return NULL;
 	}
 
-	return open_image_at(dfd, CR_FD_PAGES, flags, id);
+	return open_image_at(dfd, CR_FD_PAGES, flags, ph->pages_id);
 }
 
-struct cr_img *open_pages_image(unsigned long flags, struct cr_img *pmi)
+struct cr_img *open_pages_image(unsigned long flags, struct cr_img *pmi,
+		PagemapHead *ph)
 {
-	return open_pages_image_at(get_service_fd(IMG_FD_OFF), flags, pmi);
+	return open_pages_image_at(get_service_fd(IMG_FD_OFF), flags, pmi, ph);
 }
 
 /*
@@ -0,0 +1,50 @@
+#ifndef __CR_ARCHIVE_H__
+#define __CR_ARCHIVE_H__
+
+#include <stdbool.h>
+
+#include "asm/int.h"
+
+/*
+ * Images archive -- all the images of the dump in one file.
+ *
+ * The images go one after another, pages images start at page
+ * boundary so that these can be mapped. The index of images and
+ * the tail follow them:
+ *
+ *	head | image | image | ... | index entries | tail
+ *
+ * The tail is the last thing written, a file without one is
+ * a dump that failed.
+ */
+
+#define ARCHIVE_NAME		"images.cra"
+#define ARCHIVE_NAME_LEN	64
+
+struct archive_head {
+	u32	magic;
+	u32	pad;
+};
+
+struct archive_entry {
+	char	name[ARCHIVE_NAME_LEN];	/* as the image file would be called */
+	u64	off;
+	u64	size;
+};
+
+struct archive_tail {
+	u32	magic;
+	u32	nr;
+	u64	index_off;
+};
+
+struct cr_img;
+
+extern int archive_create(void);
+extern int archive_finish(bool commit);
+
+extern int archive_open_image(struct cr_img *img, int dfd, int type,
+			      int flags, char *path);
+extern void archive_close_image(struct cr_img *img);
+
+#endif /* __CR_ARCHIVE_H__ */
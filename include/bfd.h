@@ -1,6 +1,8 @@
 #ifndef __CR_BFD_H__
 #define __CR_BFD_H__
 
+#include <sys/types.h>
+
 #include "err.h"
 
 struct bfd_buf;
@@ -30,11 +32,13 @@ static inline void bfd_setraw(struct bfd *b)
 int bfdopenr(struct bfd *f);
 int bfdopenw(struct bfd *f);
 void bclose(struct bfd *f);
+int bflush(struct bfd *f);
 char *breadline(struct bfd *f);
 char *breadchr(struct bfd *f, char c);
 int bwrite(struct bfd *f, const void *buf, int sz);
 struct iovec;
 int bwritev(struct bfd *f, const struct iovec *iov, int cnt);
 int bread(struct bfd *f, void *buf, int sz);
+ssize_t bread_all(struct bfd *f, void **buf);
 int bfd_flush_images(void);
 #endif
@@ -38,6 +38,17 @@ struct cg_root_opt {
  */
 #define DEFAULT_GHOST_LIMIT	(1 << 20)
 
+/*
+ * How many pre-dumps an iterative dump does at most by default.
+ */
+#define DEFAULT_MAX_PRE_DUMPS	8
+
+/*
+ * How pre-dump gets the tasks' memory.
+ */
+#define PRE_DUMP_SPLICE		0	/* parasite vmsplices it while frozen */
+#define PRE_DUMP_READ		1	/* criu reads it after tasks resume */
+
 struct irmap;
 
 struct irmap_path_opt {
@@ -65,6 +76,7 @@ struct cr_options {
 	bool			link_remap_ok;
 	unsigned int		rst_namespaces_flags;
 	bool			log_file_per_pid;
+	bool			log_async;
 	bool			swrk_restore;
 	char			*output;
 	char			*root;
@@ -79,9 +91,23 @@ struct cr_options {
 	unsigned short		port;
 	char			*addr;
 	int			ps_socket;
+	bool			ps_batch;
 	bool			track_mem;
 	char			*img_parent;
 	bool			auto_dedup;
+	unsigned int		dump_jobs;
+	bool			compress;
+	bool			page_dedup;
+	bool			skip_zero_pages;
+	bool			archive;
+	bool			pagemap_fixed;
+	bool			kerndat_reprobe;
+	int			pre_dump_mode;
+	size_t			pre_dump_mem_limit;	/* bytes, 0 means no limit */
+	bool			hot_pages;
+	unsigned int		downtime;	/* ms, iterative dump */
+	unsigned int		max_pre_dumps;
+	bool			lazy_pages;
 	unsigned int		cpu_cap;
 	bool			force_irmap;
 	char			**exec_cmd;
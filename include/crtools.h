@@ -17,12 +17,14 @@ extern void kill_inventory(void);
 
 extern int cr_dump_tasks(pid_t pid);
 extern int cr_pre_dump_tasks(pid_t pid);
+extern int cr_iter_dump_tasks(pid_t pid);
 extern int cr_restore_tasks(void);
 extern int cr_show(int pid);
 extern int convert_to_elf(char *elf_path, int fd_core);
 extern int cr_check(void);
 extern int cr_exec(int pid, char **opts);
 extern int cr_dedup(void);
+extern int cr_squash(void);
 
 extern int check_add_feature(char *arg);
 
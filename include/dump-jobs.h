@@ -0,0 +1,48 @@
+#ifndef __CR_DUMP_JOBS_H__
+#define __CR_DUMP_JOBS_H__
+
+#include <sys/types.h>
+
+#include "list.h"
+#include "vma.h"
+
+struct parasite_ctl;
+struct pstree_item;
+
+/*
+ * dump_job -- memory of one task being dumped by a worker.
+ *
+ * After the parasite is set up and everything but pages is
+ * written, the task's pages are dumped in a forked copy of
+ * criu, talking to the parasite daemon via ctl->tsock. The
+ * tasks have different mm-s (see dump_task_kobj_ids), so up
+ * to opts.dump_jobs of them can be dumped in parallel.
+ *
+ * Curing the parasite and dumping threads needs ptrace, so
+ * these are done by the parent once the worker is done.
+ */
+struct dump_job {
+	pid_t			pid;		/* worker pid */
+	int			fd;		/* worker's status pipe */
+	int			slot;		/* worker slot for stats */
+	unsigned long		pages_id;
+
+	struct pstree_item	*item;
+	struct parasite_ctl	*ctl;
+	struct vm_area_list	vmas;
+
+	struct list_head	l;
+};
+
+extern int dump_jobs_init(void);
+extern void dump_jobs_fini(void);
+
+extern struct dump_job *alloc_dump_job(struct pstree_item *item,
+				       struct parasite_ctl *ctl,
+				       struct vm_area_list *vmas);
+extern int dump_job_start(struct dump_job *job);
+extern struct dump_job *dump_job_wait(int *status);
+extern unsigned int dump_jobs_running(void);
+extern void dump_jobs_kill(void);
+
+#endif /* __CR_DUMP_JOBS_H__ */
@@ -0,0 +1,37 @@
+#ifndef __CR_HOTMAP_H__
+#define __CR_HOTMAP_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "protobuf/pagemap.pb-c.h"
+
+/*
+ * Working set tracking with the kernel's idle page tracking. Pre-dump
+ * marks the pages of the tasks idle, dump finds which of them are not
+ * idle anymore, i.e. were touched in between, and writes them as hot
+ * ranges into hotmap-<pid>.img. Restore populates these first.
+ */
+
+struct hotmap;
+
+/*
+ * With @record the hot pages are written for @vpid, otherwise the
+ * pages are marked idle. The @hm is NULL if there's no idle page
+ * tracking in the kernel.
+ */
+extern int hotmap_open(struct hotmap **hm, pid_t pid, pid_t vpid, bool record);
+extern int hotmap_area(struct hotmap *hm, unsigned long start, unsigned long end);
+extern int hotmap_close(struct hotmap *hm);
+
+struct hot_ranges {
+	HotRangeEntry		**r;
+	unsigned int		nr;
+};
+
+extern int hot_ranges_load(pid_t vpid, struct hot_ranges *hr);
+extern bool hot_ranges_find(struct hot_ranges *hr, unsigned long addr,
+			    unsigned long *end);
+extern void hot_ranges_free(struct hot_ranges *hr);
+
+#endif /* __CR_HOTMAP_H__ */
@@ -84,6 +84,8 @@ enum {
 	CR_FD_TMPFS_DEV,
 	CR_FD_BINFMT_MISC,
 	CR_FD_PAGES,
+	CR_FD_PAGES_INDEX,
+	CR_FD_HOTMAP,
 
 	CR_FD_VMAS,
 	CR_FD_PAGES_OLD,
@@ -82,6 +82,9 @@
  *  	memory map for socket
  *  - AIO ring
  *  	memory area serves AIO buffers
+ *  - THP
+ *  	private anonymous area, which had transparent huge
+ *  	pages in it at dump time
  *  - unsupported
  *  	stands for any unknown memory areas, usually means
  *  	we don't know how to work with it and should stop
@@ -105,11 +108,15 @@
 #define VMA_AREA_SOCKET		(1 <<  11)
 #define VMA_AREA_VVAR		(1 <<  12)
 #define VMA_AREA_AIORING	(1 <<  13)
+#define VMA_AREA_THP		(1 <<  14)
 
 #define VMA_UNSUPP		(1 <<  31)
 
 #define CR_CAP_SIZE	2
 
+/* Longest nodes bitmap of memory policies */
+#define NUMA_MAX_NODES	1024
+
 #define TASK_COMM_LEN 16
 
 #define TASK_ALIVE		0x1
@@ -129,6 +136,8 @@ extern bool img_common_magic;
 #define O_SHOW		(O_RDONLY | O_NOBUF)
 #define O_RSTR		(O_RDONLY)
 
+struct archive_img;
+
 struct cr_img {
 	union {
 		struct bfd _x;
@@ -139,6 +148,7 @@ struct cr_img {
 			char *path;
 		};
 	};
+	struct archive_img *ar;	/* for images in archive.c */
 };
 
 #define EMPTY_IMG_FD	(-404)
@@ -165,15 +175,27 @@ static inline int img_raw_fd(struct cr_img *img)
 	return img->_x.fd;
 }
 
+/*
+ * Raw images can be slices of the images archive, their data
+ * starts at img_raw_off() in the img_raw_fd().
+ */
+extern off_t img_raw_off(struct cr_img *img);
+extern int img_raw_size(struct cr_img *img, off_t *size);
+
 extern int open_image_dir(char *dir);
 extern void close_image_dir(void);
 
 extern struct cr_img *open_image_at(int dfd, int type, unsigned long flags, ...);
 #define open_image(typ, flags, ...) open_image_at(-1, typ, flags, ##__VA_ARGS__)
 extern int open_image_lazy(struct cr_img *img);
-extern struct cr_img *open_pages_image(unsigned long flags, struct cr_img *pmi);
-extern struct cr_img *open_pages_image_at(int dfd, unsigned long flags, struct cr_img *pmi);
+struct _PagemapHead;
+extern struct cr_img *open_pages_image(unsigned long flags, struct cr_img *pmi,
+				       struct _PagemapHead *ph);
+extern struct cr_img *open_pages_image_at(int dfd, unsigned long flags,
+					  struct cr_img *pmi, struct _PagemapHead *ph);
 extern void up_page_ids_base(void);
+extern unsigned long reserve_page_id(void);
+extern void pin_page_id(unsigned long id);
 
 extern struct cr_img *img_from_fd(int fd); /* for cr-show mostly */
 
@@ -21,9 +21,12 @@ struct kerndat_s {
 	int last_cap;
 	u64 zero_page_pfn;
 	bool has_dirty_track;
+	bool has_pagemap_scan;
 	bool has_memfd;
+	bool has_clone3_set_tid;
 	bool has_fdinfo_lock;
 	unsigned long task_size;
+	unsigned long thp_size;		/* 0 if no THP */
 	bool ipv6;
 };
 
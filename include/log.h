@@ -12,6 +12,7 @@ extern void log_closedir(void);
 
 extern void log_set_fd(int fd);
 extern int log_get_fd(void);
+extern void log_flush(void);
 
 extern void log_set_loglevel(unsigned int loglevel);
 extern unsigned int log_get_loglevel(void);
@@ -91,6 +91,8 @@
 #define USERNS_MAGIC		0x55474906 /* Kazan */
 #define SECCOMP_MAGIC		0x64413049 /* Kostomuksha */
 #define BINFMT_MISC_MAGIC	0x67343323 /* Apatity */
+#define PAGES_INDEX_MAGIC	0x62351519 /* Kandalaksha */
+#define HOTMAP_MAGIC		0x63403922 /* Severomorsk */
 
 #define IFADDR_MAGIC		RAW_IMAGE_MAGIC
 #define ROUTE_MAGIC		RAW_IMAGE_MAGIC
@@ -109,5 +111,6 @@
  */
 #define STATS_MAGIC		0x57093306 /* Ostashkov */
 #define IRMAP_CACHE_MAGIC	0x57004059 /* Ivanovo */
+#define ARCHIVE_MAGIC		0x57464056 /* Kostroma */
 
 #endif /* __CR_MAGIC_H__ */
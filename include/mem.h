@@ -1,10 +1,14 @@
 #ifndef __CR_MEM_H__
 #define __CR_MEM_H__
 
+#include <stdbool.h>
+#include <sys/types.h>
+
 struct parasite_ctl;
 struct vm_area_list;
 struct page_pipe;
 struct pstree_item;
+struct list_head;
 
 extern int prepare_mm_pid(struct pstree_item *i);
 extern int do_task_reset_dirty_track(int pid);
@@ -12,6 +16,9 @@ extern unsigned int dump_pages_args_size(struct vm_area_list *vmas);
 extern int parasite_dump_pages_seized(struct parasite_ctl *ctl,
 				      struct vm_area_list *vma_area_list,
 				      struct page_pipe **pp);
+extern int predump_pages_collect(pid_t pid, pid_t vpid, struct vm_area_list *vmas,
+				 struct list_head *readers);
+extern int predump_pages_read(struct list_head *readers, bool dump);
 
 #define PME_PRESENT		(1ULL << 63)
 #define PME_SWAP		(1ULL << 62)
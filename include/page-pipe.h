@@ -100,6 +100,11 @@ extern struct page_pipe *create_page_pipe(unsigned int nr,
 extern void destroy_page_pipe(struct page_pipe *p);
 extern int page_pipe_add_page(struct page_pipe *p, unsigned long addr);
 extern int page_pipe_add_hole(struct page_pipe *p, unsigned long addr);
+extern int page_pipe_add_pages(struct page_pipe *p, unsigned long addr,
+			       unsigned long *nr);
+extern int page_pipe_add_holes(struct page_pipe *p, unsigned long addr,
+			       unsigned long nr);
+extern unsigned long page_pipe_nr_pages(struct page_pipe *pp);
 
 extern void debug_show_page_pipe(struct page_pipe *pp);
 void page_pipe_reinit(struct page_pipe *pp);
@@ -1,8 +1,12 @@
 #ifndef __CR_PAGE_READ_H__
 #define __CR_PAGE_READ_H__
 
+#include "asm/int.h"
+#include "list.h"
 #include "protobuf/pagemap.pb-c.h"
 
+struct comp_reader;
+
 /*
  * page_read -- engine, that reads pages from image file(s)
  *
@@ -47,7 +51,12 @@ struct page_read {
 	 */
 	int (*get_pagemap)(struct page_read *, struct iovec *iov);
 	/* reads page from current pagemap */
-	int (*read_pages)(struct page_read *, unsigned long vaddr, int nr, void *);
+	int (*read_pages)(struct page_read *, unsigned long vaddr, int nr,
+			  void *, unsigned flags);
+	/* completes the PR_ASYNC reads of the whole chain */
+	int (*sync)(struct page_read *);
+	/* moves past len bytes of current pagemap w/o reading them */
+	void (*skip_pages)(struct page_read *, unsigned long len);
 	/* stop working on current pagemap */
 	void (*put_pagemap)(struct page_read *);
 	void (*close)(struct page_read *);
@@ -55,8 +64,21 @@ struct page_read {
 	/* Private data of reader */
 	struct cr_img *pmi;
 	struct cr_img *pi;
+	struct comp_reader *cr;		/* set if pi is compressed */
+	void *pi_map;			/* pi mapped with PR_MMAP */
+	unsigned long pi_map_len;
+	unsigned long pi_off;		/* where cvaddr's page is in pi */
+	bool pi_shared;			/* pi is a page store */
+
+	struct list_head async;		/* PR_ASYNC reads not yet done */
+	unsigned long nr_saved;		/* reads merged into others */
 
 	PagemapEntry *pe;		/* current pagemap we are on */
+	void *pm_recs;			/* pagemap of pagemap_rec-s */
+	unsigned int pm_rec_size;
+	unsigned long pm_nr;		/* number of them */
+	unsigned long pm_next;		/* the one get_pagemap gives next */
+	PagemapEntry pm_pe;		/* ->pe points here with pm_recs */
 	struct page_read *parent;	/* parent pagemap (if ->in_parent
 					   pagemap is met in image, then
 					   go to this guy for page, see
@@ -68,11 +90,32 @@ struct page_read {
 	unsigned id; /* for logging */
 };
 
+/*
+ * Fixed-size pagemap entry. When pagemap_head.rec_size is set
+ * the head is followed by these instead of pagemap_entry-s. As
+ * they are all of the same size and sorted by vaddr, the entry
+ * for any address is binary-searched, not scanned for.
+ */
+struct pagemap_rec {
+	u64	vaddr;
+	u64	off;		/* of the pages in the pages image */
+	u32	nr_pages;
+	u32	flags;
+};
+
+#define PE_IN_PARENT	0x1
+#define PE_ZERO		0x2
+
 #define PR_SHMEM	0x1
 #define PR_TASK		0x2
 
 #define PR_TYPE_MASK	0x3
 #define PR_MOD		0x4	/* Will need to modify */
+#define PR_MMAP		0x8	/* Read pages via mapped image */
+
+/* Flags for ->read_pages */
+#define PR_ASYNC	0x10	/* Only queue the read till ->sync */
+#define PR_ZEROED	0x20	/* The buffer is known to be zeroed */
 
 /*
  * -1 -- error
@@ -0,0 +1,19 @@
+#ifndef __CR_PAGE_STORE_H__
+#define __CR_PAGE_STORE_H__
+
+#include "asm/int.h"
+
+/*
+ * page_store -- pages image shared by all the pagemaps written by
+ * this criu process with --page-dedup. Every distinct page content
+ * is put there once and pagemap entries refer to it by offset (see
+ * the pagemap_entry.off and pagemap_head.pages_shared).
+ */
+
+/* Opens the store if not yet and returns its pages image id */
+extern int page_store_get_id(u32 *pages_id);
+/* Finds or puts the @page into the store, its offset goes to @off */
+extern int page_store_add(void *page, u64 *off);
+extern int page_store_fini(void);
+
+#endif /* __CR_PAGE_STORE_H__ */
@@ -2,6 +2,9 @@
 #define __CR_PAGE_XFER__H__
 #include "page-read.h"
 
+struct comp_writer;
+struct page_xfer_batch;
+
 extern int cr_page_server(bool daemon_mode, int cfd);
 
 /*
@@ -17,6 +20,14 @@ struct page_xfer {
 	int (*write_pages)(struct page_xfer *self, int pipe, unsigned long len);
 	/* transfers one hole -- vaddr:len entry w/o pages */
 	int (*write_hole)(struct page_xfer *self, struct iovec *iov);
+	/* transfers one vaddr:len entry of zero pages, w/o pages */
+	int (*write_zero)(struct page_xfer *self, struct iovec *iov);
+	/*
+	 * optional, transfers a batch of entries and then pages of
+	 * them from the pipe, used instead of the three above
+	 */
+	int (*write_batch)(struct page_xfer *self,
+			   struct page_xfer_batch *b, int pipe);
 	void (*close)(struct page_xfer *self);
 
 	/* private data for every page-xfer engine */
@@ -24,11 +35,17 @@ struct page_xfer {
 		struct /* local */ {
 			struct cr_img *pmi; /* pagemaps */
 			struct cr_img *pi;  /* pages */
+			struct comp_writer *cw; /* compressor for pi */
+			struct iovec store_iov; /* pages to put into store */
+			unsigned long store_pending; /* bytes of them in pipe */
+			bool pm_fixed; /* pagemap is of pagemap_rec-s */
+			unsigned long pages_off; /* where next pages go in pi */
 		};
 
 		struct /* page-server */ {
 			int sk;
 			u64 dst_id;
+			struct page_xfer_batch *batch;
 		};
 	};
 
@@ -37,9 +54,15 @@ struct page_xfer {
 
 extern int open_page_xfer(struct page_xfer *xfer, int fd_type, long id);
 struct page_pipe;
+struct page_pipe_buf;
 extern int page_xfer_dump_pages(struct page_xfer *, struct page_pipe *,
 				unsigned long off);
-extern int connect_to_page_server(void);
+extern int page_xfer_dump_buf(struct page_xfer *, struct page_pipe *,
+			      struct page_pipe_buf *, unsigned int *hole,
+			      unsigned long off);
+extern int connect_to_page_server(unsigned int nr_streams);
+extern unsigned int page_server_streams(void);
+extern void page_server_use_stream(unsigned int idx);
 extern int disconnect_from_page_server(void);
 
 extern int check_parent_page_xfer(int fd_type, long id);
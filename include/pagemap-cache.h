@@ -2,6 +2,7 @@
 #define __CR_PAGEMAP_H__
 
 #include <sys/types.h>
+#include <sys/ioctl.h>
 #include "asm/page.h"
 #include "asm/int.h"
 
@@ -11,6 +12,52 @@ struct vma_area;
 
 #define PAGEMAP_PFN_OFF(addr)	(PAGE_PFN(addr) * sizeof(u64))
 
+/*
+ * PAGEMAP_SCAN ioctl on /proc/PID/pagemap (linux 6.7+). Declared
+ * here under our own names, since linux/fs.h doesn't mix well with
+ * the libc headers and older ones lack it anyway.
+ */
+#define PMC_PAGE_IS_WPALLOWED	(1 << 0)
+#define PMC_PAGE_IS_WRITTEN	(1 << 1)
+#define PMC_PAGE_IS_FILE	(1 << 2)
+#define PMC_PAGE_IS_PRESENT	(1 << 3)
+#define PMC_PAGE_IS_SWAPPED	(1 << 4)
+#define PMC_PAGE_IS_PFNZERO	(1 << 5)
+#define PMC_PAGE_IS_HUGE	(1 << 6)
+#define PMC_PAGE_IS_SOFT_DIRTY	(1 << 7)
+
+/*
+ * What the cache asks the scan for. The kerndat probe uses the same,
+ * since PMC_PAGE_IS_SOFT_DIRTY is only accepted from linux 6.8.
+ */
+#define PMC_SCAN_ANYOF_MASK	(PMC_PAGE_IS_PRESENT | PMC_PAGE_IS_SWAPPED)
+#define PMC_SCAN_RETURN_MASK	(PMC_PAGE_IS_PRESENT | PMC_PAGE_IS_SWAPPED | \
+				 PMC_PAGE_IS_FILE | PMC_PAGE_IS_PFNZERO | \
+				 PMC_PAGE_IS_SOFT_DIRTY)
+
+struct pmc_page_region {
+	u64	start;
+	u64	end;
+	u64	categories;
+};
+
+struct pmc_scan_arg {
+	u64	size;
+	u64	flags;
+	u64	start;
+	u64	end;
+	u64	walk_end;
+	u64	vec;
+	u64	vec_len;
+	u64	max_pages;
+	u64	category_inverted;
+	u64	category_mask;
+	u64	category_anyof_mask;
+	u64	return_mask;
+};
+
+#define PMC_PAGEMAP_SCAN	_IOWR('f', 16, struct pmc_scan_arg)
+
 typedef struct {
 	pid_t			pid;		/* which process it belongs */
 	unsigned long		start;		/* start of area */
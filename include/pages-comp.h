@@ -0,0 +1,40 @@
+#ifndef __CR_PAGES_COMP_H__
+#define __CR_PAGES_COMP_H__
+
+#include <sys/types.h>
+
+#include "asm/types.h"
+
+/*
+ * Compressed pages image.
+ *
+ * When dumping with --compress the pages-<id>.img is written as a
+ * stream of independently LZ4-compressed blocks, each carrying
+ * block_size bytes of pages (the last one may be shorter). Where
+ * the block makes no sense to compress it's stored as is. The
+ * pages-index-<id>.img keeps one entry per block saying where it
+ * starts in the pages image and what its compressed length is.
+ *
+ * Since every block but the last has the same decompressed size,
+ * any logical offset in pages is mapped to its block with a single
+ * division, so restore reads the needed block only.
+ */
+
+#define PAGES_COMP_BLOCK_SIZE	(16 * PAGE_SIZE)
+
+struct cr_img;
+struct comp_writer;
+struct comp_reader;
+
+extern struct comp_writer *comp_writer_open(int dfd, u32 pages_id,
+					     u32 block_size, struct cr_img *pi);
+extern int comp_writer_splice(struct comp_writer *cw, int pipe, unsigned long len);
+extern int comp_writer_close(struct comp_writer *cw);
+
+extern struct comp_reader *comp_reader_open(int dfd, u32 pages_id,
+					     u32 block_size, struct cr_img *pi);
+extern int comp_reader_pread(struct comp_reader *cr, void *buf,
+			     unsigned long len, u64 off);
+extern void comp_reader_close(struct comp_reader *cr);
+
+#endif /* __CR_PAGES_COMP_H__ */
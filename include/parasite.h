@@ -157,6 +157,8 @@ struct parasite_dump_thread {
 	tls_t			tls;
 	stack_t			sas;
 	int			pdeath_sig;
+	int			mempolicy;
+	u64			mempolicy_nodes[NUMA_MAX_NODES / 64];
 };
 
 /*
@@ -0,0 +1,13 @@
+#ifndef __CR_PME_SCAN_H__
+#define __CR_PME_SCAN_H__
+
+#include "asm/int.h"
+
+/*
+ * Returns the index of the first of @nr pagemap entries at @map,
+ * which has a page (present or swapped out), or @nr if there's
+ * no such. Used to skip holes in sparse mappings in bulk.
+ */
+extern unsigned long pme_find_mapped(const u64 *map, unsigned long nr);
+
+#endif /* __CR_PME_SCAN_H__ */
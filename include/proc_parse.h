@@ -123,8 +123,10 @@ extern int parse_pid_stat(pid_t pid, struct proc_pid_stat *s);
 extern unsigned int parse_pid_loginuid(pid_t pid, int *err);
 extern int parse_pid_oom_score_adj(pid_t pid, int *err);
 extern int parse_smaps(pid_t pid, struct vm_area_list *vma_area_list);
+extern int parse_numa_maps(pid_t pid, struct vm_area_list *vma_area_list);
 extern int parse_self_maps_lite(struct vm_area_list *vms);
 extern int parse_pid_status(pid_t pid, struct proc_status_creds *);
+extern int parse_pid_nspid(pid_t pid, pid_t *vpid);
 
 struct inotify_wd_entry {
 	InotifyWdEntry e;
@@ -57,6 +57,8 @@ enum {
 	PB_USERNS,
 	PB_NETNS,
 	PB_BINFMT_MISC,		/* 50 */
+	PB_PAGES_BLOCK,
+	PB_HOT_RANGE,
 
 	/* PB_AUTOGEN_STOP */
 
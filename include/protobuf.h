@@ -16,6 +16,14 @@ extern int do_pb_read_one(struct cr_img *, void **objp, int type, bool eof);
 
 extern int pb_write_one(struct cr_img *, void *obj, int type);
 
+/*
+ * Reads all the entries of the image at once and calls @fn for each.
+ * With @keep the objects are never freed (and can't be), otherwise
+ * each one is freed after @fn returns.
+ */
+extern int pb_read_all(struct cr_img *, int type, bool keep,
+		       int (*fn)(void *obj, void *arg), void *arg);
+
 #define pb_pksize(__obj, __proto_message_name)						\
 	(__proto_message_name ##__get_packed_size(__obj) + sizeof(u32))
 
@@ -93,6 +93,9 @@ struct thread_restore_args {
 	unsigned int			siginfo_n;
 
 	int				pdeath_sig;
+
+	int				mempolicy;
+	u64				mempolicy_nodes[NUMA_MAX_NODES / 64];
 } __aligned(64);
 
 struct task_restore_args {
@@ -174,6 +177,8 @@ struct task_restore_args {
 
 	int				seccomp_mode;
 
+	int				uffd;			/* userfaultfd for lazy VMAs or -1 */
+
 #ifdef CONFIG_VDSO
 	unsigned long			vdso_rt_size;
 	struct vdso_symtable		vdso_sym_rt;		/* runtime vdso symbols */
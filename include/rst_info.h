@@ -1,6 +1,8 @@
 #ifndef __CR_RST_INFO_H__
 #define __CR_RST_INFO_H__
 
+#include <sys/time.h>
+
 #include "lock.h"
 #include "list.h"
 #include "vma.h"
@@ -66,6 +68,10 @@ struct rst_info {
 	bool			has_seccomp;
 
 	void			*breakpoint;
+
+	/* When the task got forked and when it forked its children */
+	struct timeval		forked_at;
+	struct timeval		children_at;
 };
 
 #endif /* __CR_RST_INFO_H__ */
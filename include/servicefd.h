@@ -19,6 +19,7 @@ enum sfd_type {
 	CGROUP_YARD,
 	USERNSD_SK,	/* Socket for usernsd */
 	NS_FD_OFF,	/* Node's net namespace fd */
+	LAZY_PAGES_SK_OFF, /* Socket to pass userfaultfd-s to lazy-pages */
 
 	SERVICE_FD_MAX
 };
@@ -1,6 +1,8 @@
 #ifndef __CR_STATS_H__
 #define __CR_STATS_H__
 
+#include <sys/time.h>
+
 enum {
 	TIME_FREEZING,
 	TIME_FROZEN,
@@ -14,6 +16,7 @@ enum {
 enum {
 	TIME_FORK,
 	TIME_RESTORE,
+	TIME_PREPARE,
 
 	RESTORE_TIME_NS_STATS,
 };
@@ -25,6 +28,7 @@ enum {
 	CNT_PAGES_SCANNED,
 	CNT_PAGES_SKIPPED_PARENT,
 	CNT_PAGES_WRITTEN,
+	CNT_PAGES_ZERO,
 
 	DUMP_CNT_NR_STATS,
 };
@@ -33,12 +37,29 @@ enum {
 	CNT_PAGES_COMPARED,
 	CNT_PAGES_SKIPPED_COW,
 	CNT_PAGES_RESTORED,
+	CNT_PAGE_READS_SAVED,
 
 	RESTORE_CNT_NR_STATS,
 };
 
 extern void cnt_add(int c, unsigned long val);
 
+/*
+ * Counters and memory dump timings accumulated by a dump
+ * worker process, see dump-jobs.c, or by a pre-dump run by
+ * cr-iter-dump.c
+ */
+struct dump_stats_part {
+	unsigned long	counts[DUMP_CNT_NR_STATS];
+	struct timeval	frozen;
+	struct timeval	memdump;
+	struct timeval	memwrite;
+};
+
+extern void dump_stats_part_reset(void);
+extern void dump_stats_part_get(struct dump_stats_part *part);
+extern void dump_stats_part_add(const struct dump_stats_part *part);
+
 #define DUMP_STATS	1
 #define RESTORE_STATS	2
 
@@ -82,4 +82,18 @@ struct krlimit {
 
 struct siginfo;
 
+/* The clone_args of clone3(), up to set_tid_size (linux 5.5) */
+struct clone3_args {
+	u64 flags;
+	u64 pidfd;
+	u64 child_tid;
+	u64 parent_tid;
+	u64 exit_signal;
+	u64 stack;
+	u64 stack_size;
+	u64 tls;
+	u64 set_tid;
+	u64 set_tid_size;
+};
+
 #endif /* __CR_SYSCALL_TYPES_H__ */
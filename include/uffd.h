@@ -0,0 +1,21 @@
+#ifndef __CR_UFFD_H__
+#define __CR_UFFD_H__
+
+struct task_restore_args;
+
+/*
+ * Lazy restore of private anonymous memory.
+ *
+ * On restore with --lazy-pages the contents of such VMAs is not
+ * read from images. Instead each task creates a userfaultfd and
+ * sends it to the lazy-pages daemon, the restorer registers the
+ * VMAs with it and the task is resumed with its memory empty.
+ * The daemon then copies the pages in on faults, and pushes the
+ * rest in the background while the task doesn't fault.
+ */
+
+extern int prepare_lazy_pages_socket(void);
+extern int setup_uffd(int pid, struct task_restore_args *ta);
+extern int cr_lazy_pages(bool daemon_mode);
+
+#endif /* __CR_UFFD_H__ */
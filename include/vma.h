@@ -1,6 +1,8 @@
 #ifndef __CR_VMA_H__
 #define __CR_VMA_H__
 
+#include <sys/mman.h>
+
 #include "asm/types.h"
 #include "image.h"
 #include "list.h"
@@ -101,6 +103,31 @@ static inline bool vma_entry_is_private(VmaEntry *entry,
 		 (entry->end <= task_size);
 }
 
+/*
+ * Anonymous private memory that can be left empty on restore
+ * and filled by the lazy-pages daemon via userfaultfd.
+ */
+static inline bool vma_entry_can_be_lazy(VmaEntry *entry)
+{
+	return vma_entry_is(entry, VMA_AREA_REGULAR)	&&
+		vma_entry_is(entry, VMA_ANON_PRIVATE)	&&
+		!vma_entry_is(entry, VMA_AREA_VDSO)	&&
+		!vma_entry_is(entry, VMA_AREA_VVAR)	&&
+		!vma_entry_is(entry, VMA_AREA_VSYSCALL)	&&
+		!(entry->flags & MAP_LOCKED);
+}
+
+/*
+ * Areas that had huge pages on dump. On restore these are premapped
+ * at the same offset from a huge page boundary as they have in the
+ * task, so that huge pages survive moving them into place.
+ */
+static inline bool vma_entry_is_thp(VmaEntry *entry)
+{
+	return vma_entry_is(entry, VMA_AREA_THP) &&
+		!(entry->flags & MAP_GROWSDOWN);
+}
+
 static inline bool vma_area_is_private(struct vma_area *vma,
 				       unsigned long task_size)
 {
@@ -1,10 +1,13 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/file.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/utsname.h>
 #include <errno.h>
 
 #include "log.h"
@@ -12,12 +15,14 @@
 #include "kerndat.h"
 #include "fs-magic.h"
 #include "mem.h"
+#include "pagemap-cache.h"
 #include "compiler.h"
 #include "sysctl.h"
 #include "syscall.h"
 #include "asm/types.h"
 #include "cr_options.h"
 #include "util.h"
+#include "xmalloc.h"
 #include "lsm.h"
 
 struct kerndat_s kdat = {
@@ -236,6 +241,51 @@ out:
 	return 0;
 }
 
+static int kerndat_has_pagemap_scan(void)
+{
+	struct pmc_page_region reg;
+	struct pmc_scan_arg arg = {
+		.size			= sizeof(arg),
+		.vec			= (unsigned long)&reg,
+		.vec_len		= 1,
+		.category_anyof_mask	= PMC_SCAN_ANYOF_MASK,
+		.return_mask		= PMC_SCAN_RETURN_MASK,
+	};
+	void *addr;
+	int fd, ret;
+
+	addr = mmap(NULL, PAGE_SIZE, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED) {
+		pr_perror("Can't map page for pagemap scan");
+		return -1;
+	}
+
+	fd = open("/proc/self/pagemap", O_RDONLY);
+	if (fd < 0) {
+		pr_perror("Can't open pagemap file");
+		munmap(addr, PAGE_SIZE);
+		return -1;
+	}
+
+	arg.start = (unsigned long)addr;
+	arg.end = arg.start + PAGE_SIZE;
+
+	ret = ioctl(fd, PMC_PAGEMAP_SCAN, &arg);
+	if (ret >= 0) {
+		pr_info("Pagemap scan is supported on kernel\n");
+		kdat.has_pagemap_scan = true;
+		ret = 0;
+	} else if (errno == ENOTTY || errno == EINVAL) {
+		pr_info("Pagemap scan is not supported, reading pagemap\n");
+		ret = 0;
+	} else
+		pr_perror("Can't check pagemap scan");
+
+	close(fd);
+	munmap(addr, PAGE_SIZE);
+	return ret;
+}
+
 /* The page frame number (PFN) is constant for the zero page */
 static int init_zero_page_pfn()
 {
@@ -333,6 +383,33 @@ out:
 	return exit_code;
 }
 
+static int get_thp_size(void)
+{
+	FILE *f;
+	int ret;
+
+	f = fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r");
+	if (!f) {
+		if (errno != ENOENT) {
+			pr_perror("Can't open THP size");
+			return -1;
+		}
+		pr_info("No transparent huge pages\n");
+		kdat.thp_size = 0;
+		return 0;
+	}
+
+	ret = fscanf(f, "%lu", &kdat.thp_size);
+	fclose(f);
+	if (ret != 1 || kdat.thp_size & (kdat.thp_size - 1)) {
+		pr_err("Bad THP size\n");
+		return -1;
+	}
+
+	pr_debug("Found THP size of %lx\n", kdat.thp_size);
+	return 0;
+}
+
 static int get_ipv6()
 {
 	if (access("/proc/sys/net/ipv6", F_OK) < 0) {
@@ -348,21 +425,167 @@ static int get_ipv6()
 	return 0;
 }
 
+/*
+ * Probing the kernel takes a while, so the results are kept in a
+ * file till reboot. Things that depend on namespaces or sysctls,
+ * which can change any time, are not taken from there.
+ */
+
+#define KERNDAT_CACHE_FILE	"/run/criu.kdat"
+#define KERNDAT_CACHE_MAGIC	0x5441444b	/* KDAT */
+#define KERNDAT_CACHE_VERSION	3
+
+/* Which of kerndat_init-s have their results in the cache */
+#define KDAT_PROBED_DUMP	0x1
+#define KDAT_PROBED_RST		0x2
+
+struct kerndat_cache {
+	u32			magic;
+	u32			version;
+	u32			size;		/* of kerndat_s */
+	u32			probed;
+	char			boot_id[40];
+	char			release[80];
+	struct kerndat_s	kdat;
+};
+
+static u32 kdat_cached;
+static bool kdat_cache_read;
+
+static int kerndat_cache_key(struct kerndat_cache *c)
+{
+	struct utsname u;
+	int fd, ret;
+
+	memzero(c, sizeof(*c));
+	c->magic = KERNDAT_CACHE_MAGIC;
+	c->version = KERNDAT_CACHE_VERSION;
+	c->size = sizeof(c->kdat);
+
+	fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY);
+	if (fd < 0) {
+		pr_perror("Can't open boot_id");
+		return -1;
+	}
+
+	ret = read(fd, c->boot_id, sizeof(c->boot_id) - 1);
+	close(fd);
+	if (ret <= 0) {
+		pr_perror("Can't read boot_id");
+		return -1;
+	}
+	c->boot_id[strcspn(c->boot_id, "\n")] = '\0';
+
+	if (uname(&u)) {
+		pr_perror("Can't get kernel release");
+		return -1;
+	}
+	snprintf(c->release, sizeof(c->release), "%s", u.release);
+
+	return 0;
+}
+
+static void kerndat_load_cache(void)
+{
+	struct kerndat_cache c, key;
+	int fd, ret, rshare;
+
+	if (kdat_cache_read)
+		return;
+	kdat_cache_read = true;
+
+	if (opts.kerndat_reprobe)
+		return;
+
+	fd = open(KERNDAT_CACHE_FILE, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			pr_warn("Can't open " KERNDAT_CACHE_FILE ": %m\n");
+		return;
+	}
+
+	ret = read(fd, &c, sizeof(c));
+	close(fd);
+
+	if (kerndat_cache_key(&key))
+		return;
+
+	/* Another kernel, boot or criu version -- probe again */
+	if (ret != sizeof(c) || c.magic != key.magic ||
+	    c.version != key.version || c.size != key.size ||
+	    strcmp(c.boot_id, key.boot_id) || strcmp(c.release, key.release)) {
+		pr_info("Stale kerndat cache, will re-probe\n");
+		return;
+	}
+
+	rshare = kdat.tcp_max_rshare;
+	kdat = c.kdat;
+	kdat.tcp_max_rshare = rshare;
+	kdat_cached = c.probed;
+
+	pr_info("Using kerndat cache (%#x)\n", kdat_cached);
+}
+
+static void kerndat_save_cache(u32 probed)
+{
+	char path[] = KERNDAT_CACHE_FILE ".XXXXXX";
+	struct kerndat_cache c;
+	int fd, ret;
+
+	if (kerndat_cache_key(&c))
+		return;
+
+	c.probed = kdat_cached | probed;
+	c.kdat = kdat;
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		pr_info("Can't create kerndat cache: %m\n");
+		return;
+	}
+
+	ret = write(fd, &c, sizeof(c));
+	close(fd);
+
+	/* Workers may save it concurrently, rename makes it atomic */
+	if (ret != sizeof(c) || rename(path, KERNDAT_CACHE_FILE)) {
+		pr_warn("Can't write kerndat cache: %m\n");
+		unlink(path);
+		return;
+	}
+
+	kdat_cached = c.probed;
+}
+
 int kerndat_init(void)
 {
-	int ret;
+	int ret = 0;
+
+	kerndat_load_cache();
+	if (kdat_cached & KDAT_PROBED_DUMP) {
+		if (opts.track_mem && !kdat.has_dirty_track) {
+			pr_err("Tracking memory is not available\n");
+			ret = -1;
+		}
+		goto live;
+	}
 
 	ret = kerndat_get_shmemdev();
 	if (!ret)
 		ret = kerndat_get_dirty_track();
 	if (!ret)
 		ret = init_zero_page_pfn();
+	if (!ret)
+		ret = kerndat_has_pagemap_scan();
 	if (!ret)
 		ret = get_last_cap();
 	if (!ret)
 		ret = kerndat_fdinfo_has_lock();
 	if (!ret)
 		ret = get_task_size();
+	if (!ret)
+		kerndat_save_cache(KDAT_PROBED_DUMP);
+live:
 	if (!ret)
 		ret = get_ipv6();
 
@@ -371,6 +594,28 @@ int kerndat_init(void)
 	return ret;
 }
 
+/*
+ * Kernels knowing set_tid refuse set_tid_size without set_tid
+ * with EINVAL, older clone3 says E2BIG on the unknown fields
+ * and still older kernels have no clone3 at all.
+ */
+static int kerndat_has_clone3_set_tid(void)
+{
+	struct clone3_args args = {
+		.set_tid_size	= 1,
+	};
+	long ret;
+
+	ret = sys_clone3(&args, sizeof(args));
+	if (ret == -EINVAL) {
+		pr_info("clone3 with set_tid is supported\n");
+		kdat.has_clone3_set_tid = true;
+	} else
+		pr_info("No clone3 with set_tid (%ld), will use ns_last_pid\n", ret);
+
+	return 0;
+}
+
 int kerndat_init_rst(void)
 {
 	int ret;
@@ -382,12 +627,25 @@ int kerndat_init_rst(void)
 	 */
 
 	ret = tcp_read_sysctl_limits();
-	if (!ret)
-		ret = get_last_cap();
+	if (ret)
+		return ret;
+
+	kerndat_load_cache();
+	if (kdat_cached & KDAT_PROBED_RST)
+		goto live;
+
+	ret = get_last_cap();
 	if (!ret)
 		ret = kerndat_has_memfd_create();
+	if (!ret)
+		ret = kerndat_has_clone3_set_tid();
 	if (!ret)
 		ret = get_task_size();
+	if (!ret)
+		ret = get_thp_size();
+	if (!ret)
+		kerndat_save_cache(KDAT_PROBED_RST);
+live:
 	if (!ret)
 		ret = get_ipv6();
 
@@ -7,8 +7,13 @@
 #include <limits.h>
 
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <signal.h>
 
 #include <fcntl.h>
 
@@ -18,6 +23,8 @@
 #include "cr_options.h"
 #include "servicefd.h"
 #include "security.h"
+#include "lock.h"
+#include "setproctitle.h"
 
 #define DEFAULT_LOGFD		STDERR_FILENO
 /* Enable timestamps if verbosity is increased from default */
@@ -35,6 +42,79 @@ static struct timeval start;
  */
 #define TS_BUF_OFF	12
 
+/*
+ * Asynchronous logging (--log-async). Instead of writing each line
+ * into the log file, the line goes into a ring in shared memory, so
+ * that all the forked criu processes put lines there too, and a
+ * flusher process drains it into the file in big writes.
+ *
+ * Producers reserve space by moving the head with cmpxchg, copy the
+ * line in and then publish its header. Drained space is zeroed, so
+ * that a header is never seen before it's published. The flusher
+ * (or a producer that has to, see log_ring_sync) takes the lock,
+ * copies published lines out and moves the tail. Timestamps are
+ * stored raw and only printed by the drainer.
+ *
+ * Lines of errors are drained by the producer itself right away, so
+ * they are in the file by the time the error is handled. Lines left
+ * in the ring if a criu process crashes are drained by the flusher,
+ * and when the process having started the flusher dies, the flusher
+ * drains everything and quits, making the rest of logging sync.
+ *
+ * A reserved record carries the pid of its producer. If the producer
+ * is killed before publishing it, the drainer finds the pid dead and
+ * drops the record. An error line that is stuck behind a record not
+ * published yet is taken back and written directly. If the ring stays
+ * full anyway, e.g. the producer was killed right after moving the
+ * head, the ring is given up and the rest of logging is direct.
+ *
+ * The drain lock holds the pid of the drainer the same way. A drainer
+ * killed with the lock held is found dead by the next one, which takes
+ * the lock over and finishes dropping the record the dead one was at
+ * (the lines it had copied out are lost). Producers don't wait for the
+ * lock longer than for the ring, an error line is written directly then.
+ * Processes whose pids mean nothing to the flusher never drain, they
+ * write the lines that need draining directly.
+ */
+#define LOG_RING_SIZE		(4 << 20)
+#define LOG_RING_MASK		(LOG_RING_SIZE - 1)
+#define LOG_RING_WAIT_MS	20
+#define LOG_RING_OUT		(64 << 10)
+#define LOG_RING_TRIES		LOG_RING_WAIT_MS	/* a ms each */
+
+#define LOG_REC_READY		(1u << 31)
+#define LOG_REC_SKIP		(1u << 30)	/* padding up to ring end */
+#define LOG_REC_TS		(1u << 29)
+#define LOG_REC_BUSY		(1u << 28)	/* reserved, not published yet */
+#define LOG_REC_LEN_MASK	(0xffffff)
+
+struct log_rec {
+	atomic_t	hdr;
+	s32		owner;		/* pid of the producer, 0 if unknown */
+	u32		ts_sec;
+	u32		ts_usec;
+	char		text[0];
+};
+
+#define LOG_REC_SIZE(len)	round_up(sizeof(struct log_rec) + (len), sizeof(u32))
+
+struct log_ring {
+	atomic_t	head;
+	atomic_t	tail;
+	atomic_t	sleeping;	/* flusher waits for lines */
+	atomic_t	stop;		/* flusher is asked to quit */
+	atomic_t	gone;		/* no flusher, drain sync */
+	atomic_t	stuck;		/* ring is given up, write directly */
+	u64		pidns;		/* owners' pids are from this one */
+	atomic_t	lock;		/* drainer's pid */
+	atomic_t	drain_to;	/* tail after the record being dropped */
+	char		data[LOG_RING_SIZE];
+};
+
+static struct log_ring *log_ring;
+static pid_t log_ring_owner;
+static pid_t log_flusher;
+
 static void timediff(struct timeval *from, struct timeval *to)
 {
 	to->tv_sec -= from->tv_sec;
@@ -64,6 +144,397 @@ int log_get_fd(void)
 	return fd < 0 ? DEFAULT_LOGFD : fd;
 }
 
+static void log_write(int fd, const char *buf, int size)
+{
+	int ret, off = 0;
+
+	while (off < size) {
+		ret = write(fd, buf + off, size - off);
+		if (ret <= 0)
+			break;
+		off += ret;
+	}
+}
+
+/*
+ * The pid to put into records as their owner. Restored tasks may live
+ * in another pid namespace, their pids mean nothing to the flusher,
+ * so these are 0 and their records are never dropped.
+ */
+static pid_t log_ring_self(void)
+{
+	static pid_t pid, self;
+	pid_t p = getpid();
+
+	if (p != pid) {
+		struct stat st;
+
+		pid = p;
+		self = 0;
+		if (!stat("/proc/self/ns/pid", &st) && st.st_ino == log_ring->pidns)
+			self = p;
+	}
+
+	return self;
+}
+
+/* A record reserved by a process killed before publishing it */
+static bool log_rec_orphan(struct log_rec *rec, u32 hdr)
+{
+	if (!(hdr & LOG_REC_BUSY) || rec->owner <= 0 || !log_ring_self())
+		return false;
+
+	return kill(rec->owner, 0) < 0 && errno == ESRCH;
+}
+
+/* Frees the record at @tail of @size bytes, producers expect it zeroed */
+static void log_ring_consume(struct log_rec *rec, u32 tail, u32 size)
+{
+	memzero(rec, size);
+	atomic_set(&log_ring->tail, tail + size);
+	atomic_set(&log_ring->drain_to, 0);
+}
+
+/* Called with log_ring->lock held */
+static void log_ring_drain(int fd)
+{
+	static char out[LOG_RING_OUT];
+	u32 tail = atomic_read(&log_ring->tail);
+	int off = 0;
+
+	while (tail != (u32)atomic_read(&log_ring->head)) {
+		struct log_rec *rec = (void *)log_ring->data + (tail & LOG_RING_MASK);
+		u32 hdr = atomic_read(&rec->hdr);
+		u32 len = hdr & LOG_REC_LEN_MASK;
+		u32 size = (hdr & LOG_REC_SKIP) ? len : LOG_REC_SIZE(len);
+
+		/* Being written, the rest will be drained next time */
+		if (!(hdr & LOG_REC_READY) && !log_rec_orphan(rec, hdr))
+			break;
+
+		/* Also a barrier before reading the text */
+		atomic_cmpxchg(&log_ring->drain_to, 0, tail + size);
+
+		if ((hdr & LOG_REC_READY) && !(hdr & LOG_REC_SKIP)) {
+			if (off + TS_BUF_OFF + len > sizeof(out)) {
+				log_write(fd, out, off);
+				off = 0;
+			}
+
+			if (hdr & LOG_REC_TS) {
+				snprintf(out + off, TS_BUF_OFF, "(%02u.%06u)",
+						rec->ts_sec, rec->ts_usec);
+				out[off + TS_BUF_OFF - 1] = ' ';
+				off += TS_BUF_OFF;
+			}
+
+			memcpy(out + off, rec->text, len);
+			off += len;
+		}
+
+		log_ring_consume(rec, tail, size);
+		tail += size;
+	}
+
+	log_write(fd, out, off);
+}
+
+/* The drainer before was killed in the middle of dropping a record */
+static void log_ring_recover(void)
+{
+	u32 tail = atomic_read(&log_ring->tail);
+	u32 to = atomic_read(&log_ring->drain_to);
+
+	if (to && to != tail)
+		log_ring_consume((void *)log_ring->data + (tail & LOG_RING_MASK),
+				 tail, to - tail);
+	else
+		atomic_set(&log_ring->drain_to, 0);
+}
+
+/*
+ * Takes the drain lock, waiting at most @tries ms for it, or for
+ * as long as it takes if @tries is 0. Returns -1 if not taken.
+ */
+static int log_ring_lock(int tries)
+{
+	pid_t me = log_ring_self();
+
+	if (!me)
+		return -1;
+
+	while (1) {
+		struct timespec to = { .tv_nsec = 1000000 };
+		int owner;
+
+		owner = atomic_cmpxchg(&log_ring->lock, 0, me);
+		if (!owner)
+			return 0;
+
+		if (kill(owner, 0) < 0 && errno == ESRCH &&
+		    atomic_cmpxchg(&log_ring->lock, owner, me) == owner) {
+			log_ring_recover();
+			return 0;
+		}
+
+		if (tries && !--tries)
+			return -1;
+
+		/* Wakes up every ms to check the owner is still there */
+		sys_futex((u32 *)&log_ring->lock.counter, FUTEX_WAIT, owner, &to, NULL, 0);
+	}
+}
+
+static void log_ring_unlock(void)
+{
+	atomic_set(&log_ring->lock, 0);
+	sys_futex((u32 *)&log_ring->lock.counter, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+static void log_ring_sync(void)
+{
+	if (log_ring_lock(LOG_RING_TRIES))
+		return;
+
+	log_ring_drain(log_get_fd());
+	log_ring_unlock();
+}
+
+static void log_ring_wake(void)
+{
+	if (atomic_read(&log_ring->sleeping))
+		sys_futex((u32 *)&log_ring->head.counter, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/*
+ * Reserves room for a record of @len bytes of text, skipping the
+ * ring tail if the record doesn't fit there. Returns NULL if the
+ * ring is full.
+ */
+static struct log_rec *log_ring_reserve(u32 len)
+{
+	u32 head, off, need, size = LOG_REC_SIZE(len);
+	struct log_rec *rec;
+
+	do {
+		head = atomic_read(&log_ring->head);
+		off = head & LOG_RING_MASK;
+		need = size;
+		if (off + size > LOG_RING_SIZE)
+			need += LOG_RING_SIZE - off;
+
+		if (head + need - (u32)atomic_read(&log_ring->tail) > LOG_RING_SIZE)
+			return NULL;
+	} while ((u32)atomic_cmpxchg(&log_ring->head, head, head + need) != head);
+
+	rec = (void *)log_ring->data + off;
+	if (need != size) {
+		atomic_cmpxchg(&rec->hdr, 0, LOG_REC_READY | LOG_REC_SKIP |
+				(LOG_RING_SIZE - off));
+		rec = (void *)log_ring->data;
+	}
+
+	rec->owner = log_ring_self();
+	atomic_cmpxchg(&rec->hdr, 0, LOG_REC_BUSY | len);
+
+	if (head + need - (u32)atomic_read(&log_ring->tail) > LOG_RING_SIZE / 2)
+		log_ring_wake();
+
+	return rec;
+}
+
+/*
+ * Returns -1 if the line didn't get into the file via the ring
+ * and is to be written directly.
+ */
+static int log_ring_put(unsigned int loglevel, const char *text, u32 len, bool ts)
+{
+	struct log_rec *rec;
+	u32 hdr = LOG_REC_READY | len;
+	int tries = 0;
+
+	if (atomic_read(&log_ring->stuck))
+		return -1;
+
+	/* Can't drain, see log_ring_lock */
+	if ((loglevel <= LOG_ERROR || atomic_read(&log_ring->gone)) &&
+	    !log_ring_self())
+		return -1;
+
+	while (!(rec = log_ring_reserve(len))) {
+		if (++tries > LOG_RING_TRIES) {
+			atomic_set(&log_ring->stuck, 1);
+			return -1;
+		}
+
+		log_ring_sync();
+		usleep(1000);
+	}
+
+	if (ts) {
+		struct timeval t;
+
+		gettimeofday(&t, NULL);
+		timediff(&start, &t);
+		rec->ts_sec = t.tv_sec;
+		rec->ts_usec = t.tv_usec;
+		hdr |= LOG_REC_TS;
+	}
+
+	memcpy(rec->text, text, len);
+	atomic_cmpxchg(&rec->hdr, LOG_REC_BUSY | len, hdr);
+
+	if (loglevel > LOG_ERROR && !atomic_read(&log_ring->gone))
+		return 0;
+
+	if (log_ring_lock(LOG_RING_TRIES)) {
+		if (loglevel > LOG_ERROR)
+			return 0;
+
+		/*
+		 * The drainer is stuck. The line is written directly,
+		 * and may get into the file once more when it's drained.
+		 */
+		return -1;
+	}
+
+	log_ring_drain(log_get_fd());
+	if (loglevel <= LOG_ERROR && atomic_read(&rec->hdr) == hdr) {
+		/* Behind a line not published yet, don't wait for it */
+		atomic_set(&rec->hdr, LOG_REC_READY | LOG_REC_SKIP | LOG_REC_SIZE(len));
+		log_ring_unlock();
+		return -1;
+	}
+	log_ring_unlock();
+
+	return 0;
+}
+
+static void log_flusher_sig(int sig)
+{
+	atomic_set(&log_ring->stop, 1);
+}
+
+static void log_flusher_loop(void)
+{
+	struct sigaction sa = {
+		.sa_handler	= log_flusher_sig,
+		.sa_flags	= SA_RESTART,
+	};
+	int fd = log_get_fd();
+
+	setproctitle("log-flusher");
+
+	/* Drain everything and quit once our starter dies */
+	sigaction(SIGTERM, &sa, NULL);
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+	if (getppid() != log_ring_owner)
+		atomic_set(&log_ring->stop, 1);
+
+	while (1) {
+		struct timespec to = { .tv_nsec = LOG_RING_WAIT_MS * 1000000 };
+		u32 head;
+
+		log_ring_lock(0);
+		log_ring_drain(fd);
+		if (atomic_read(&log_ring->stop)) {
+			atomic_set(&log_ring->gone, 1);
+			log_ring_drain(fd);
+			log_ring_unlock();
+			break;
+		}
+		log_ring_unlock();
+
+		head = atomic_read(&log_ring->head);
+		atomic_set(&log_ring->sleeping, 1);
+		if (head == (u32)atomic_read(&log_ring->tail))
+			sys_futex((u32 *)&log_ring->head.counter, FUTEX_WAIT,
+					head, &to, NULL, 0);
+		atomic_set(&log_ring->sleeping, 0);
+	}
+
+	_exit(0);
+}
+
+static void log_ring_stop(void)
+{
+	int status;
+
+	if (getpid() != log_ring_owner) {
+		/* A forked criu quits, just put its lines out */
+		log_ring_sync();
+		return;
+	}
+
+	atomic_set(&log_ring->stop, 1);
+	sys_futex((u32 *)&log_ring->head.counter, FUTEX_WAKE, 1, NULL, NULL, 0);
+	waitpid(log_flusher, &status, __WCLONE);
+
+	munmap(log_ring, sizeof(*log_ring));
+	log_ring = NULL;
+}
+
+static void log_ring_exit(void)
+{
+	if (log_ring)
+		log_ring_stop();
+}
+
+static int log_ring_start(void)
+{
+	static bool registered;
+	struct stat st;
+
+	/* Pids of the drainers are checked against this one */
+	if (stat("/proc/self/ns/pid", &st)) {
+		pr_warn("Can't find out pid namespace, logging synchronously\n");
+		return 0;
+	}
+
+	log_ring = mmap(NULL, sizeof(*log_ring), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (log_ring == MAP_FAILED) {
+		log_ring = NULL;
+		pr_perror("Can't map log ring");
+		return -1;
+	}
+
+	atomic_set(&log_ring->lock, 0);
+	log_ring_owner = getpid();
+	log_ring->pidns = st.st_ino;
+
+	/*
+	 * No exit signal for the flusher, so that it doesn't
+	 * confuse the code waiting for children
+	 */
+	log_flusher = sys_clone(0, NULL, NULL, NULL);
+	if (log_flusher == 0)
+		log_flusher_loop();
+	if (log_flusher < 0) {
+		pr_err("Can't start log flusher: %d\n", log_flusher);
+		munmap(log_ring, sizeof(*log_ring));
+		log_ring = NULL;
+		return -1;
+	}
+
+	if (!registered) {
+		atexit(log_ring_exit);
+		registered = true;
+	}
+
+	return 0;
+}
+
+/*
+ * Puts all the lines logged so far into the log file, for
+ * when somebody else is about to write there directly.
+ */
+void log_flush(void)
+{
+	if (log_ring)
+		log_ring_sync();
+}
+
 static void reset_buf_off(void)
 {
 	if (current_loglevel >= LOG_TIMESTAMP)
@@ -77,6 +548,16 @@ int log_init(const char *output)
 {
 	int new_logfd, fd;
 
+	if (log_ring) {
+		/* Re-initialized with new file, e.g. in service */
+		if (getpid() == log_ring_owner)
+			log_ring_stop();
+		else {
+			log_ring_sync();
+			log_ring = NULL;
+		}
+	}
+
 	gettimeofday(&start, NULL);
 	reset_buf_off();
 
@@ -105,6 +586,9 @@ int log_init(const char *output)
 	if (fd < 0)
 		goto err;
 
+	if (opts.log_async && !opts.log_file_per_pid)
+		return log_ring_start();
+
 	return 0;
 
 err:
@@ -137,6 +621,8 @@ int log_init_by_pid(void)
 
 void log_fini(void)
 {
+	if (log_ring)
+		log_ring_stop();
 	close_service_fd(LOG_FD_OFF);
 }
 
@@ -155,8 +641,9 @@ unsigned int log_get_loglevel(void)
 
 static void __print_on_level(unsigned int loglevel, const char *format, va_list params)
 {
-	int fd, size, ret, off = 0;
+	int fd, size, off = 0;
 	int __errno = errno;
+	bool ts = current_loglevel >= LOG_TIMESTAMP;
 
 	if (unlikely(loglevel == LOG_MSG)) {
 		fd = STDOUT_FILENO;
@@ -165,19 +652,28 @@ static void __print_on_level(unsigned int loglevel, const char *format, va_list
 		if (loglevel > current_loglevel)
 			return;
 		fd = log_get_fd();
-		if (current_loglevel >= LOG_TIMESTAMP)
+		if (ts && !log_ring)
 			print_ts();
 	}
 
 	size  = vsnprintf(buffer + buf_off, sizeof buffer - buf_off, format, params);
 	size += buf_off;
+	if (size > sizeof buffer - 1)
+		size = sizeof buffer - 1;
 
-	while (off < size) {
-		ret = write(fd, buffer + off, size - off);
-		if (ret <= 0)
-			break;
-		off += ret;
+	if (log_ring && loglevel != LOG_MSG) {
+		int ts_off = ts ? TS_BUF_OFF : 0;
+
+		/* The timestamp is printed by the drainer */
+		if (!log_ring_put(loglevel, buffer + ts_off, size - ts_off, ts))
+			goto out;
+
+		if (ts)
+			print_ts();
 	}
+
+	log_write(fd, buffer + off, size - off);
+out:
 	errno =  __errno;
 }
 
@@ -3,6 +3,8 @@
 #include <sys/mman.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/uio.h>
 
 #include "cr_options.h"
 #include "servicefd.h"
@@ -20,6 +22,9 @@
 #include "restorer.h"
 #include "files-reg.h"
 #include "pagemap-cache.h"
+#include "pme-scan.h"
+#include "syscall.h"
+#include "hotmap.h"
 
 #include "protobuf.h"
 #include "protobuf/pagemap.pb-c.h"
@@ -117,38 +122,69 @@ static inline bool page_in_parent(u64 pme)
  * the memory contents is present in the pagent image set.
  */
 
+static inline bool dump_page_as_hole(u64 pme, bool has_parent)
+{
+	/*
+	 * If we're doing incremental dump (parent images
+	 * specified) and page is not soft-dirty -- we dump
+	 * hole and expect the parent images to contain this
+	 * page. The latter would be checked in page-xfer.
+	 */
+	return has_parent && page_in_parent(pme);
+}
+
+/*
+ * Pagemap is walked by runs of pages of the same kind, which
+ * go into the page pipe at once. Unmapped areas, which take
+ * the most of sparse mappings, are skipped in bulk.
+ */
 static int generate_iovs(struct vma_area *vma, struct page_pipe *pp, u64 *map, u64 *off, bool has_parent)
 {
 	u64 *at = &map[PAGE_PFN(*off)];
 	unsigned long pfn, nr_to_scan;
 	unsigned long pages[2] = {};
+	/* vDSO is dumped regardless of the pagemap */
+	bool skip_unmapped = !vma_entry_is(vma->e, VMA_AREA_VDSO);
 
 	nr_to_scan = (vma_area_len(vma) - *off) / PAGE_SIZE;
 
-	for (pfn = 0; pfn < nr_to_scan; pfn++) {
-		unsigned long vaddr;
+	for (pfn = 0; pfn < nr_to_scan; ) {
+		unsigned long vaddr, nr;
+		bool hole;
 		int ret;
 
-		if (!should_dump_page(vma->e, at[pfn]))
+		if (skip_unmapped) {
+			pfn += pme_find_mapped(at + pfn, nr_to_scan - pfn);
+			if (pfn == nr_to_scan)
+				break;
+		}
+
+		if (!should_dump_page(vma->e, at[pfn])) {
+			pfn++;
 			continue;
+		}
 
-		vaddr = vma->e->start + *off + pfn * PAGE_SIZE;
+		hole = dump_page_as_hole(at[pfn], has_parent);
+		for (nr = 1; pfn + nr < nr_to_scan; nr++) {
+			u64 pme = at[pfn + nr];
 
-		/*
-		 * If we're doing incremental dump (parent images
-		 * specified) and page is not soft-dirty -- we dump
-		 * hole and expect the parent images to contain this
-		 * page. The latter would be checked in page-xfer.
-		 */
+			if (!should_dump_page(vma->e, pme) ||
+			    dump_page_as_hole(pme, has_parent) != hole)
+				break;
+		}
 
-		if (has_parent && page_in_parent(at[pfn])) {
-			ret = page_pipe_add_hole(pp, vaddr);
-			pages[0]++;
+		vaddr = vma->e->start + *off + pfn * PAGE_SIZE;
+
+		if (hole) {
+			ret = page_pipe_add_holes(pp, vaddr, nr);
+			pages[0] += nr;
 		} else {
-			ret = page_pipe_add_page(pp, vaddr);
-			pages[1]++;
+			ret = page_pipe_add_pages(pp, vaddr, &nr);
+			pages[1] += nr;
 		}
 
+		pfn += nr;
+
 		if (ret) {
 			*off += pfn * PAGE_SIZE;
 			return ret;
@@ -194,15 +230,33 @@ static struct parasite_dump_pages_args *prep_dump_pages_args(struct parasite_ctl
 	return args;
 }
 
+static int xfer_pages_buf(struct page_xfer *xfer, struct page_pipe *pp,
+			  struct page_pipe_buf *ppb, unsigned int *hole)
+{
+	int ret;
+
+	timing_start(TIME_MEMWRITE);
+	ret = page_xfer_dump_buf(xfer, pp, ppb, hole, 0);
+	timing_stop(TIME_MEMWRITE);
+
+	return ret;
+}
+
 static int dump_pages(struct page_pipe *pp, struct parasite_ctl *ctl,
 			struct parasite_dump_pages_args *args, struct page_xfer *xfer)
 {
-	struct page_pipe_buf *ppb;
+	struct page_pipe_buf *ppb, *prev = NULL;
+	unsigned int hole = 0;
 	int ret = 0;
 
 	debug_show_page_pipe(pp);
 
-	/* Step 2 -- grab pages into page-pipe */
+	/*
+	 * Step 2 -- grab pages into page-pipe
+	 *
+	 * The parasite drains memory into a buffer asynchronously,
+	 * so while it does so we write the previous one.
+	 */
 	list_for_each_entry(ppb, &pp->bufs, l) {
 		args->nr_segs = ppb->nr_segs;
 		args->nr_pages = ppb->pages_in;
@@ -216,21 +270,29 @@ static int dump_pages(struct page_pipe *pp, struct parasite_ctl *ctl,
 		if (ret)
 			return -1;
 
+		/*
+		 * Step 3 -- write pages into image (or delay writing for
+		 *           pre-dump action (see pre_dump_one_task)
+		 */
+		if (xfer && prev && xfer_pages_buf(xfer, pp, prev, &hole)) {
+			/* Don't leave the parasite in the middle of a command */
+			__parasite_wait_daemon_ack(PARASITE_CMD_DUMPPAGES, ctl);
+			return -1;
+		}
+
 		ret = __parasite_wait_daemon_ack(PARASITE_CMD_DUMPPAGES, ctl);
 		if (ret < 0)
 			return -1;
 
 		args->off += args->nr_segs;
+		prev = ppb;
 	}
 
-	/*
-	 * Step 3 -- write pages into image (or delay writing for
-	 *           pre-dump action (see pre_dump_one_task)
-	 */
 	if (xfer) {
-		timing_start(TIME_MEMWRITE);
-		ret = page_xfer_dump_pages(xfer, pp, 0);
-		timing_stop(TIME_MEMWRITE);
+		if (prev && xfer_pages_buf(xfer, pp, prev, &hole))
+			return -1;
+		/* The holes after the last buffer */
+		ret = xfer_pages_buf(xfer, pp, NULL, &hole);
 	}
 
 	return ret;
@@ -376,6 +438,286 @@ int parasite_dump_pages_seized(struct parasite_ctl *ctl,
 	return ret;
 }
 
+/*
+ * Pre-dump with --pre-dump-mode read. While the task is frozen only
+ * the pagemap is generated and the dirty bits are reset, the pages
+ * themselves are read with process_vm_readv() after the task is let
+ * go. Whatever it changes meanwhile is soft-dirty again and gets into
+ * the next dump, so the parasite is not needed at all.
+ */
+struct predump_reader {
+	pid_t			pid;
+	pid_t			vpid;
+	int			pidfd;	/* tells whether the task is still there */
+	int			mem_fd;	/* /proc/pid/mem, for PROT_NONE areas */
+	struct page_pipe	*pp;
+	struct iovec		*iovs;
+	struct list_head	l;
+};
+
+#define PREDUMP_READ_CHUNK	(64 * PAGE_SIZE)
+
+static void predump_reader_free(struct predump_reader *r)
+{
+	if (r->pp)
+		destroy_page_pipe(r->pp);
+	close_safe(&r->pidfd);
+	close_safe(&r->mem_fd);
+	xfree(r->iovs);
+	xfree(r);
+}
+
+int predump_pages_collect(pid_t pid, pid_t vpid, struct vm_area_list *vmas,
+			  struct list_head *readers)
+{
+	pmc_t pmc = PMC_INIT;
+	struct predump_reader *r;
+	struct vma_area *vma;
+	int ret = -1, has_parent;
+
+	pr_info("Collecting pages to read (pid: %d)\n", pid);
+
+	BUG_ON(kdat.zero_page_pfn == 0);
+
+	r = xzalloc(sizeof(*r));
+	if (!r)
+		return -1;
+
+	r->pid = pid;
+	r->vpid = vpid;
+	r->pidfd = -1;
+	r->mem_fd = -1;
+
+	timing_start(TIME_MEMDUMP);
+
+	r->iovs = xmalloc((vmas->priv_size + 1) * sizeof(struct iovec));
+	if (!r->iovs)
+		goto out;
+
+	if (pmc_init(&pmc, pid, &vmas->h, vmas->longest * PAGE_SIZE))
+		goto out;
+
+	r->pp = create_page_pipe(vmas->priv_size, r->iovs, false);
+	if (!r->pp)
+		goto out_pmc;
+
+	has_parent = check_parent_page_xfer(CR_FD_PAGEMAP, vpid);
+	if (has_parent < 0)
+		goto out_pmc;
+
+	list_for_each_entry(vma, &vmas->h, list) {
+		u64 off = 0;
+		u64 *map;
+
+		if (!vma_area_is_private(vma, kdat.task_size))
+			continue;
+
+		map = pmc_get_map(&pmc, vma);
+		if (!map)
+			goto out_pmc;
+
+		if (generate_iovs(vma, r->pp, map, &off, has_parent))
+			goto out_pmc;
+	}
+
+	debug_show_page_pipe(r->pp);
+
+	if (task_reset_dirty_track(pid))
+		goto out_pmc;
+
+	r->mem_fd = open_proc(pid, "mem");
+	if (r->mem_fd < 0)
+		goto out_pmc;
+
+	/*
+	 * Without pidfd there's no telling the task from another one
+	 * that got its pid, so all the reading goes via the mem file.
+	 */
+	r->pidfd = sys_pidfd_open(pid, 0);
+	if (r->pidfd < 0) {
+		if (r->pidfd != -ENOSYS) {
+			pr_err("Can't open pidfd for %d: %d\n", pid, r->pidfd);
+			goto out_pmc;
+		}
+		r->pidfd = -1;
+	}
+
+	list_add_tail(&r->l, readers);
+	ret = 0;
+out_pmc:
+	pmc_fini(&pmc);
+out:
+	timing_stop(TIME_MEMDUMP);
+	if (ret)
+		predump_reader_free(r);
+	return ret;
+}
+
+static bool predump_task_gone(struct predump_reader *r)
+{
+	struct pollfd pfd = { .fd = r->pidfd, .events = POLLIN, };
+
+	/* pidfd gets readable once the task exits */
+	return poll(&pfd, 1, 0) != 0;
+}
+
+static int predump_read_pages(struct predump_reader *r, char *buf,
+			      unsigned long vaddr, size_t len)
+{
+	ssize_t ret, done = 0;
+
+	if (r->pidfd >= 0) {
+		struct iovec local = { .iov_base = buf, .iov_len = len, };
+		struct iovec remote = { .iov_base = (void *)vaddr, .iov_len = len, };
+
+		ret = process_vm_readv(r->pid, &local, 1, &remote, 1, 0);
+		if (ret > 0)
+			done = ret;
+	}
+
+	/* Areas without PROT_READ can only be read via the mem file */
+	while (done < len) {
+		ret = pread(r->mem_fd, buf + done, len - done, vaddr + done);
+		if (ret <= 0)
+			break;
+		done += ret;
+	}
+
+	/*
+	 * Unmapped after the pagemap was generated, the next dump
+	 * will see it anyway, so whatever is put here is fine.
+	 */
+	if (done < len) {
+		pr_debug("Can't read %lx-%lx of %d, zeroing\n",
+				vaddr + done, vaddr + len, r->pid);
+		memset(buf + done, 0, len - done);
+	}
+
+	return 0;
+}
+
+static int predump_fill_ppb(struct predump_reader *r, struct page_pipe_buf *ppb)
+{
+	static char buf[PREDUMP_READ_CHUNK];
+	unsigned int i;
+
+	for (i = 0; i < ppb->nr_segs; i++) {
+		struct iovec *iov = &ppb->iov[i];
+		size_t off, len;
+
+		for (off = 0; off < iov->iov_len; off += len) {
+			len = min_t(size_t, iov->iov_len - off, sizeof(buf));
+
+			if (predump_read_pages(r, buf, (unsigned long)iov->iov_base + off, len))
+				return -1;
+
+			if (write(ppb->p[1], buf, len) != len) {
+				pr_perror("Can't put pages of %d into pipe", r->pid);
+				return -1;
+			}
+		}
+	}
+
+	if (r->pidfd >= 0 && predump_task_gone(r)) {
+		pr_err("Task %d exited while its pages were read\n", r->pid);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * The pages are marked idle only after they are read, reading them
+ * makes them young again. The holes are the pages not changed since
+ * the previous pre-dump, these are to be tracked too.
+ */
+static int predump_mark_idle(struct predump_reader *r)
+{
+	struct page_pipe_buf *ppb;
+	struct hotmap *hm;
+	struct iovec *iov;
+	unsigned int i;
+
+	if (hotmap_open(&hm, r->pid, r->vpid, false))
+		return -1;
+	if (!hm)
+		return 0;
+
+	list_for_each_entry(ppb, &r->pp->bufs, l) {
+		for (i = 0; i < ppb->nr_segs; i++) {
+			iov = &ppb->iov[i];
+			if (hotmap_area(hm, (unsigned long)iov->iov_base,
+					(unsigned long)iov->iov_base + iov->iov_len))
+				goto err;
+		}
+	}
+
+	for (i = 0; i < r->pp->free_hole; i++) {
+		iov = &r->pp->holes[i];
+		if (hotmap_area(hm, (unsigned long)iov->iov_base,
+				(unsigned long)iov->iov_base + iov->iov_len))
+			goto err;
+	}
+
+	return hotmap_close(hm);
+err:
+	hotmap_close(hm);
+	return -1;
+}
+
+static int predump_read_one(struct predump_reader *r)
+{
+	struct page_xfer xfer;
+	struct page_pipe_buf *ppb;
+	unsigned int hole = 0;
+	int ret;
+
+	pr_info("Reading pages (pid: %d)\n", r->pid);
+
+	ret = open_page_xfer(&xfer, CR_FD_PAGEMAP, r->vpid);
+	if (ret < 0)
+		return -1;
+
+	list_for_each_entry(ppb, &r->pp->bufs, l) {
+		ret = predump_fill_ppb(r, ppb);
+		if (!ret)
+			ret = page_xfer_dump_buf(&xfer, r->pp, ppb, &hole, 0);
+		if (ret)
+			goto out;
+	}
+
+	/* The holes after the last buffer */
+	ret = page_xfer_dump_buf(&xfer, r->pp, NULL, &hole, 0);
+	if (!ret && opts.hot_pages)
+		ret = predump_mark_idle(r);
+out:
+	xfer.close(&xfer);
+	return ret;
+}
+
+/*
+ * Reads and writes the pages collected, or just drops them all
+ * if @dump is false, since the pre-dump has failed.
+ */
+int predump_pages_read(struct list_head *readers, bool dump)
+{
+	struct predump_reader *r, *tmp;
+	int ret = 0;
+
+	list_for_each_entry_safe(r, tmp, readers, l) {
+		if (dump && !ret) {
+			timing_start(TIME_MEMWRITE);
+			ret = predump_read_one(r);
+			timing_stop(TIME_MEMWRITE);
+		}
+
+		list_del(&r->l);
+		predump_reader_free(r);
+	}
+
+	return ret;
+}
+
 static inline int collect_filemap(struct vma_area *vma)
 {
 	struct file_desc *fd;
@@ -445,6 +787,9 @@ int prepare_mm_pid(struct pstree_item *i)
 			ri->vmas.priv_size += vma_area_len(vma);
 			if (vma->e->flags & MAP_GROWSDOWN)
 				ri->vmas.priv_size += PAGE_SIZE;
+			/* Room to align it to a huge page, see map_private_vma */
+			if (vma_entry_is_thp(vma->e) && kdat.thp_size)
+				ri->vmas.priv_size += kdat.thp_size - PAGE_SIZE;
 		}
 
 		pr_info("vma 0x%"PRIx64" 0x%"PRIx64"\n", vma->e->start, vma->e->end);
@@ -8,21 +8,23 @@
 #include "util.h"
 #include "page-pipe.h"
 
-/* can existing iov accumulate the page? */
-static inline bool iov_grow_page(struct iovec *iov, unsigned long addr)
+/* can existing iov accumulate the pages? */
+static inline bool iov_grow_pages(struct iovec *iov, unsigned long addr,
+		unsigned long nr)
 {
 	if ((unsigned long)iov->iov_base + iov->iov_len == addr) {
-		iov->iov_len += PAGE_SIZE;
+		iov->iov_len += nr * PAGE_SIZE;
 		return true;
 	}
 
 	return false;
 }
 
-static inline void iov_init(struct iovec *iov, unsigned long addr)
+static inline void iov_init(struct iovec *iov, unsigned long addr,
+		unsigned long nr)
 {
 	iov->iov_base = (void *)addr;
-	iov->iov_len = PAGE_SIZE;
+	iov->iov_len = nr * PAGE_SIZE;
 }
 
 static int page_pipe_grow(struct page_pipe *pp)
@@ -124,19 +126,23 @@ void page_pipe_reinit(struct page_pipe *pp)
 		BUG(); /* It can't fail, because ppb is in free_bufs */
 }
 
-static inline int try_add_page_to(struct page_pipe *pp, struct page_pipe_buf *ppb,
-		unsigned long addr)
+/*
+ * Puts up to @nr pages into the @ppb and returns how many of
+ * them fit, 0 means another buf is needed.
+ */
+static inline unsigned long try_add_pages_to(struct page_pipe *pp,
+		struct page_pipe_buf *ppb, unsigned long addr, unsigned long nr)
 {
 	if (ppb->pages_in == ppb->pipe_size) {
 		unsigned long new_size = ppb->pipe_size << 1;
 		int ret;
 
 		if (new_size > PIPE_MAX_SIZE)
-			return 1;
+			return 0;
 
 		ret = fcntl(ppb->p[0], F_SETPIPE_SZ, new_size * PAGE_SIZE);
 		if (ret < 0)
-			return 1; /* need to add another buf */
+			return 0; /* need to add another buf */
 
 		ret /= PAGE_SIZE;
 		BUG_ON(ret < ppb->pipe_size);
@@ -145,51 +151,77 @@ static inline int try_add_page_to(struct page_pipe *pp, struct page_pipe_buf *pp
 		ppb->pipe_size = ret;
 	}
 
+	if (nr > ppb->pipe_size - ppb->pages_in)
+		nr = ppb->pipe_size - ppb->pages_in;
+
 	if (ppb->nr_segs) {
-		if (iov_grow_page(&ppb->iov[ppb->nr_segs - 1], addr))
+		if (iov_grow_pages(&ppb->iov[ppb->nr_segs - 1], addr, nr))
 			goto out;
 
 		if (ppb->nr_segs == UIO_MAXIOV)
 			/* XXX -- shrink pipe back? */
-			return 1;
+			return 0;
 	}
 
 	pr_debug("Add iov to page pipe (%u iovs, %u/%u total)\n",
 			ppb->nr_segs, pp->free_iov, pp->nr_iovs);
-	iov_init(&ppb->iov[ppb->nr_segs++], addr);
+	iov_init(&ppb->iov[ppb->nr_segs++], addr, nr);
 	pp->free_iov++;
 	BUG_ON(pp->free_iov > pp->nr_iovs);
 out:
-	ppb->pages_in++;
-	return 0;
+	ppb->pages_in += nr;
+	return nr;
 }
 
-static inline int try_add_page(struct page_pipe *pp, unsigned long addr)
+static inline unsigned long try_add_pages(struct page_pipe *pp,
+		unsigned long addr, unsigned long nr)
 {
 	BUG_ON(list_empty(&pp->bufs));
-	return try_add_page_to(pp, list_entry(pp->bufs.prev, struct page_pipe_buf, l), addr);
+	return try_add_pages_to(pp, list_entry(pp->bufs.prev, struct page_pipe_buf, l),
+			addr, nr);
 }
 
-int page_pipe_add_page(struct page_pipe *pp, unsigned long addr)
+/*
+ * Adds the run of @nr pages starting at @addr. On return the @nr
+ * is the number of pages actually added, which is less than asked
+ * if an error (e.g. -EAGAIN in chunk mode) occurred.
+ */
+int page_pipe_add_pages(struct page_pipe *pp, unsigned long addr,
+		unsigned long *nr)
 {
-	int ret;
+	unsigned long done = 0;
+	int ret = 0;
 
-	ret = try_add_page(pp, addr);
-	if (ret <= 0)
-		return ret;
+	while (done < *nr) {
+		unsigned long added;
 
-	ret = page_pipe_grow(pp);
-	if (ret < 0)
-		return ret;
+		added = try_add_pages(pp, addr + done * PAGE_SIZE, *nr - done);
+		if (added) {
+			done += added;
+			continue;
+		}
+
+		/* A fresh buf always has room for a page */
+		ret = page_pipe_grow(pp);
+		if (ret < 0)
+			break;
+	}
 
-	ret = try_add_page(pp, addr);
-	BUG_ON(ret > 0);
+	*nr = done;
 	return ret;
 }
 
+int page_pipe_add_page(struct page_pipe *pp, unsigned long addr)
+{
+	unsigned long nr = 1;
+
+	return page_pipe_add_pages(pp, addr, &nr);
+}
+
 #define PP_HOLES_BATCH	32
 
-int page_pipe_add_hole(struct page_pipe *pp, unsigned long addr)
+int page_pipe_add_holes(struct page_pipe *pp, unsigned long addr,
+		unsigned long nr)
 {
 	if (pp->free_hole >= pp->nr_holes) {
 		pp->holes = xrealloc(pp->holes,
@@ -201,14 +233,30 @@ int page_pipe_add_hole(struct page_pipe *pp, unsigned long addr)
 	}
 
 	if (pp->free_hole &&
-			iov_grow_page(&pp->holes[pp->free_hole - 1], addr))
+			iov_grow_pages(&pp->holes[pp->free_hole - 1], addr, nr))
 		goto out;
 
-	iov_init(&pp->holes[pp->free_hole++], addr);
+	iov_init(&pp->holes[pp->free_hole++], addr, nr);
 out:
 	return 0;
 }
 
+int page_pipe_add_hole(struct page_pipe *pp, unsigned long addr)
+{
+	return page_pipe_add_holes(pp, addr, 1);
+}
+
+unsigned long page_pipe_nr_pages(struct page_pipe *pp)
+{
+	struct page_pipe_buf *ppb;
+	unsigned long nr = 0;
+
+	list_for_each_entry(ppb, &pp->bufs, l)
+		nr += ppb->pages_in;
+
+	return nr;
+}
+
 void debug_show_page_pipe(struct page_pipe *pp)
 {
 	struct page_pipe_buf *ppb;
@@ -1,11 +1,18 @@
 #include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 
 #include "image.h"
 #include "cr_options.h"
 #include "servicefd.h"
 #include "page-read.h"
+#include "pages-comp.h"
+#include "stats.h"
+#include "xmalloc.h"
 
 #include "protobuf.h"
 #include "protobuf/pagemap.pb-c.h"
@@ -30,7 +37,8 @@ static int get_page_vaddr(struct page_read *pr, struct iovec *iov)
 	return 1;
 }
 
-static int read_page(struct page_read *pr, unsigned long vaddr, int nr, void *buf)
+static int read_page(struct page_read *pr, unsigned long vaddr, int nr,
+		void *buf, unsigned flags)
 {
 	int ret;
 
@@ -45,6 +53,21 @@ static int read_page(struct page_read *pr, unsigned long vaddr, int nr, void *bu
 	return 1;
 }
 
+static void skip_page(struct page_read *pr, unsigned long len)
+{
+	char buf[PAGE_SIZE];
+
+	BUG_ON(len != PAGE_SIZE);
+
+	/* Old images have pages inline, just read it out */
+	read_page(pr, 0, 1, buf, 0);
+}
+
+static int sync_page(struct page_read *pr)
+{
+	return 0;
+}
+
 void pagemap2iovec(PagemapEntry *pe, struct iovec *iov)
 {
 	iov->iov_base = decode_pointer(pe->vaddr);
@@ -70,6 +93,8 @@ static int get_pagemap(struct page_read *pr, struct iovec *iov)
 
 	pr->pe = pe;
 	pr->cvaddr = (unsigned long)iov->iov_base;
+	if (pe->has_off)
+		pr->pi_off = pe->off;
 
 	if (pe->in_parent && !pr->parent) {
 		pr_err("No parent for snapshot pagemap\n");
@@ -84,7 +109,51 @@ static void put_pagemap(struct page_read *pr)
 	pagemap_entry__free_unpacked(pr->pe, NULL);
 }
 
-static int read_pagemap_page(struct page_read *pr, unsigned long vaddr, int nr, void *buf);
+static inline struct pagemap_rec *pagemap_rec(struct page_read *pr, unsigned long i)
+{
+	return pr->pm_recs + i * pr->pm_rec_size;
+}
+
+/* Makes the i-th record the current pagemap */
+static void set_pagemap_rec(struct page_read *pr, unsigned long i)
+{
+	struct pagemap_rec *r = pagemap_rec(pr, i);
+	PagemapEntry *pe = &pr->pm_pe;
+
+	pe->vaddr = r->vaddr;
+	pe->nr_pages = r->nr_pages;
+	pe->in_parent = !!(r->flags & PE_IN_PARENT);
+	pe->zero = !!(r->flags & PE_ZERO);
+	pe->off = r->off;
+
+	pr->pe = pe;
+	pr->cvaddr = r->vaddr;
+	pr->pi_off = r->off;
+	pr->pm_next = i + 1;
+}
+
+static int get_pagemap_rec(struct page_read *pr, struct iovec *iov)
+{
+	if (pr->pm_next == pr->pm_nr)
+		return 0;
+
+	set_pagemap_rec(pr, pr->pm_next);
+	pagemap2iovec(pr->pe, iov);
+
+	if (pr->pe->in_parent && !pr->parent) {
+		pr_err("No parent for snapshot pagemap\n");
+		return -1;
+	}
+
+	return 1;
+}
+
+static void put_pagemap_rec(struct page_read *pr)
+{
+}
+
+static int read_pagemap_page(struct page_read *pr, unsigned long vaddr, int nr,
+		void *buf, unsigned flags);
 
 static void skip_pagemap_pages(struct page_read *pr, unsigned long len)
 {
@@ -92,16 +161,61 @@ static void skip_pagemap_pages(struct page_read *pr, unsigned long len)
 		return;
 
 	pr_debug("\tpr%u Skip %lu bytes from page-dump\n", pr->id, len);
-	if (!pr->pe->in_parent)
-		lseek(img_raw_fd(pr->pi), len, SEEK_CUR);
+	if (!pr->pe->in_parent && !pr->pe->zero)
+		pr->pi_off += len;
 	pr->cvaddr += len;
 }
 
+/*
+ * Same as seek_pagemap_page, but the records let one find the
+ * entry right away and even go back to the already read ones.
+ */
+static int seek_pagemap_rec(struct page_read *pr, unsigned long vaddr, bool warn)
+{
+	unsigned long lo = 0, hi = pr->pm_nr;
+
+	/* Look for the first entry ending above vaddr */
+	while (lo < hi) {
+		unsigned long mid = (lo + hi) / 2;
+		struct pagemap_rec *r = pagemap_rec(pr, mid);
+
+		if (r->vaddr + r->nr_pages * PAGE_SIZE <= vaddr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == pr->pm_nr) {
+		pr->pm_next = lo;
+		pr->pe = NULL;
+		return 0;
+	}
+
+	set_pagemap_rec(pr, lo);
+	if (vaddr < pr->cvaddr) {
+		if (warn)
+			pr_err("Missing %lx in parent pagemap, next entry: base=%lx\n",
+					vaddr, pr->cvaddr);
+		return 0;
+	}
+
+	if (pr->pe->in_parent && !pr->parent) {
+		pr_err("No parent for snapshot pagemap\n");
+		return -1;
+	}
+
+	skip_pagemap_pages(pr, vaddr - pr->cvaddr);
+	return 1;
+}
+
 int seek_pagemap_page(struct page_read *pr, unsigned long vaddr, bool warn)
 {
 	int ret;
 	struct iovec iov;
 
+	if (pr->pm_recs)
+		return seek_pagemap_rec(pr, vaddr, warn);
+
 	if (pr->pe)
 		pagemap2iovec(pr->pe, &iov);
 	else
@@ -143,7 +257,136 @@ static inline void pagemap_bound_check(PagemapEntry *pe, unsigned long vaddr, in
 	}
 }
 
-static int read_pagemap_page(struct page_read *pr, unsigned long vaddr, int nr, void *buf)
+/*
+ * A run of the pages image to be read with one preadv into
+ * (possibly) many buffers.
+ */
+struct page_read_iov {
+	off_t			from;
+	off_t			end;
+	struct iovec		*to;
+	int			nr;
+	struct list_head	l;
+};
+
+static int enqueue_async_read(struct page_read *pr, void *buf,
+		unsigned long len, off_t off)
+{
+	struct page_read_iov *pio;
+
+	if (!list_empty(&pr->async)) {
+		pio = list_entry(pr->async.prev, struct page_read_iov, l);
+		if (pio->end == off && pio->nr < IOV_MAX) {
+			struct iovec *last = &pio->to[pio->nr - 1];
+
+			if (last->iov_base + last->iov_len == buf)
+				last->iov_len += len;
+			else {
+				if (xrealloc_safe(&pio->to, (pio->nr + 1) * sizeof(*pio->to)))
+					return -1;
+
+				pio->to[pio->nr].iov_base = buf;
+				pio->to[pio->nr].iov_len = len;
+				pio->nr++;
+			}
+
+			pio->end += len;
+			pr->nr_saved++;
+			return 0;
+		}
+	}
+
+	pio = xmalloc(sizeof(*pio));
+	if (!pio)
+		return -1;
+
+	pio->to = xmalloc(sizeof(*pio->to));
+	if (!pio->to) {
+		xfree(pio);
+		return -1;
+	}
+
+	pio->from = off;
+	pio->end = off + len;
+	pio->to[0].iov_base = buf;
+	pio->to[0].iov_len = len;
+	pio->nr = 1;
+	list_add_tail(&pio->l, &pr->async);
+	return 0;
+}
+
+static void free_async_reads(struct page_read *pr)
+{
+	struct page_read_iov *pio, *n;
+
+	list_for_each_entry_safe(pio, n, &pr->async, l) {
+		list_del(&pio->l);
+		xfree(pio->to);
+		xfree(pio);
+	}
+}
+
+static int read_async_iov(struct page_read *pr, struct page_read_iov *pio)
+{
+	struct iovec *iov = pio->to;
+	off_t off = pio->from;
+	int nr = pio->nr;
+
+	pr_debug("\tpr%u Read %d runs from %lx/%lu\n", pr->id, nr,
+			(unsigned long)off, (unsigned long)(pio->end - off));
+
+	while (nr) {
+		ssize_t ret;
+
+		ret = preadv(img_raw_fd(pr->pi), iov, nr,
+				off + img_raw_off(pr->pi));
+		if (ret <= 0) {
+			pr_perror("Can't read pages at %lx (%zd)", (unsigned long)off, ret);
+			return -1;
+		}
+
+		off += ret;
+		while (nr && ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			nr--;
+		}
+
+		if (ret) {
+			iov->iov_base += ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return 0;
+}
+
+static int sync_pagemap_pages(struct page_read *pr)
+{
+	struct page_read_iov *pio;
+	int ret = 0;
+
+	list_for_each_entry(pio, &pr->async, l) {
+		ret = read_async_iov(pr, pio);
+		if (ret)
+			break;
+	}
+
+	free_async_reads(pr);
+
+	if (pr->nr_saved) {
+		cnt_add(CNT_PAGE_READS_SAVED, pr->nr_saved);
+		pr->nr_saved = 0;
+	}
+
+	if (!ret && pr->parent)
+		ret = sync_pagemap_pages(pr->parent);
+
+	return ret;
+}
+
+static int read_pagemap_page(struct page_read *pr, unsigned long vaddr, int nr,
+		void *buf, unsigned flags)
 {
 	int ret;
 	unsigned long len = nr * PAGE_SIZE;
@@ -151,7 +394,11 @@ static int read_pagemap_page(struct page_read *pr, unsigned long vaddr, int nr,
 	pr_info("pr%u Read %lx %u pages\n", pr->id, vaddr, nr);
 	pagemap_bound_check(pr->pe, vaddr, nr);
 
-	if (pr->pe->in_parent) {
+	if (pr->pe->zero) {
+		/* Zero pages are not in the image */
+		if (!(flags & PR_ZEROED))
+			memset(buf, 0, len);
+	} else if (pr->pe->in_parent) {
 		struct page_read *ppr = pr->parent;
 
 		/*
@@ -180,7 +427,7 @@ static int read_pagemap_page(struct page_read *pr, unsigned long vaddr, int nr,
 			if (p_nr > nr)
 				p_nr = nr;
 
-			ret = read_pagemap_page(ppr, vaddr, p_nr, buf);
+			ret = read_pagemap_page(ppr, vaddr, p_nr, buf, flags);
 			if (ret == -1)
 				return ret;
 
@@ -194,16 +441,38 @@ static int read_pagemap_page(struct page_read *pr, unsigned long vaddr, int nr,
 			buf += p_nr * PAGE_SIZE;
 		} while (nr);
 	} else {
-		int fd = img_raw_fd(pr->pi);
-		off_t current_vaddr = lseek(fd, 0, SEEK_CUR);
+		unsigned long current_vaddr = pr->pi_off;
 
-		pr_debug("\tpr%u Read page from self %lx/%"PRIx64"\n", pr->id, pr->cvaddr, current_vaddr);
-		ret = read(fd, buf, len);
-		if (ret != len) {
-			pr_perror("Can't read mapping page %d", ret);
-			return -1;
+		pr_debug("\tpr%u Read page from self %lx/%lx\n", pr->id, pr->cvaddr, current_vaddr);
+		if (pr->cr) {
+			if (comp_reader_pread(pr->cr, buf, len, current_vaddr))
+				return -1;
+		} else if ((flags & PR_ASYNC) && !opts.auto_dedup) {
+			/*
+			 * Batched reads go with preadv even if the image is
+			 * mapped, the mapping is for the page-by-page ones.
+			 * Punching is done right away, so can't be async.
+			 */
+			if (enqueue_async_read(pr, buf, len, current_vaddr))
+				return -1;
+		} else if (pr->pi_map) {
+			if (current_vaddr + len > pr->pi_map_len) {
+				pr_err("Pages %lx/%lu are beyond the image\n",
+						current_vaddr, len);
+				return -1;
+			}
+			memcpy(buf, pr->pi_map + current_vaddr, len);
+		} else {
+			ret = pread(img_raw_fd(pr->pi), buf, len,
+					current_vaddr + img_raw_off(pr->pi));
+			if (ret != len) {
+				pr_perror("Can't read mapping page %d", ret);
+				return -1;
+			}
 		}
 
+		pr->pi_off += len;
+
 		if (opts.auto_dedup) {
 			ret = punch_hole(pr, current_vaddr, len, false);
 			if (ret == -1) {
@@ -229,16 +498,99 @@ static void close_page_read(struct page_read *pr)
 		pr->bunch.iov_len = 0;
 	}
 
+	if (!list_empty(&pr->async)) {
+		pr_warn("pr%u: Dropping not completed reads\n", pr->id);
+		free_async_reads(pr);
+	}
+
 	if (pr->parent) {
 		close_page_read(pr->parent);
 		xfree(pr->parent);
 	}
 
 	close_image(pr->pmi);
+	xfree(pr->pm_recs);
+	if (pr->pi_map)
+		munmap(pr->pi_map, pr->pi_map_len);
+	if (pr->cr)
+		comp_reader_close(pr->cr);
 	if (pr->pi)
 		close_image(pr->pi);
 }
 
+/*
+ * Pages image holds nothing but pages, so it can be mapped as is
+ * and the pages are taken right from the page cache instead of
+ * being read() run by run. On any problem just fall back to that.
+ */
+static void map_pages_image(struct page_read *pr)
+{
+	off_t size;
+	void *map;
+
+	if (img_raw_size(pr->pi, &size))
+		return;
+
+	if (!size)
+		return;
+
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE,
+			img_raw_fd(pr->pi), img_raw_off(pr->pi));
+	if (map == MAP_FAILED) {
+		pr_warn("Can't map %lu bytes of pages: %m\n", (unsigned long)size);
+		return;
+	}
+
+	/* Pages are mostly read in image order */
+	madvise(map, size, MADV_SEQUENTIAL);
+
+	pr->pi_map = map;
+	pr->pi_map_len = size;
+}
+
+/*
+ * The records are small, so they are just read in one go and
+ * looked up in memory.
+ */
+static int load_pagemap_recs(struct page_read *pr, unsigned int rec_size)
+{
+	unsigned long i;
+	ssize_t len;
+	void *buf;
+
+	if (rec_size < sizeof(struct pagemap_rec)) {
+		pr_err("Bad pagemap record size %u\n", rec_size);
+		return -1;
+	}
+
+	len = bread_all(&pr->pmi->_x, &buf);
+	if (len < 0)
+		return -1;
+
+	pr->pm_recs = buf;
+	pr->pm_rec_size = rec_size;
+	pr->pm_nr = len / rec_size;
+	pr->pm_next = 0;
+
+	if (len % rec_size) {
+		pr_err("Pagemap of %zd bytes is not of %u byte records\n",
+				len, rec_size);
+		return -1;
+	}
+
+	for (i = 1; i < pr->pm_nr; i++) {
+		struct pagemap_rec *p = pagemap_rec(pr, i - 1);
+
+		if (p->vaddr + p->nr_pages * PAGE_SIZE > pagemap_rec(pr, i)->vaddr) {
+			pr_err("Pagemap records are not sorted at %lu\n", i);
+			return -1;
+		}
+	}
+
+	pr_debug("Loaded %lu pagemap records\n", pr->pm_nr);
+	return 0;
+}
+
 static int try_open_parent(int dfd, int pid, struct page_read *pr, int pr_flags)
 {
 	int pfd, ret;
@@ -275,6 +627,7 @@ err_cl:
 
 int open_page_read_at(int dfd, int pid, struct page_read *pr, int pr_flags)
 {
+	PagemapHead ph = PAGEMAP_HEAD__INIT;
 	int flags, i_typ, i_typ_o;
 	static unsigned ids = 1;
 
@@ -300,9 +653,18 @@ int open_page_read_at(int dfd, int pid, struct page_read *pr, int pr_flags)
 	}
 
 	pr->pe = NULL;
+	pr->pm_recs = NULL;
 	pr->parent = NULL;
 	pr->bunch.iov_len = 0;
 	pr->bunch.iov_base = NULL;
+	pr->pi = NULL;
+	pr->cr = NULL;
+	pr->pi_map = NULL;
+	pr->pi_map_len = 0;
+	pr->pi_off = 0;
+	pr->pi_shared = false;
+	INIT_LIST_HEAD(&pr->async);
+	pr->nr_saved = 0;
 
 	pr->pmi = open_image_at(dfd, i_typ, O_RSTR, (long)pid);
 	if (!pr->pmi)
@@ -318,15 +680,40 @@ int open_page_read_at(int dfd, int pid, struct page_read *pr, int pr_flags)
 		return -1;
 	}
 
-	pr->pi = open_pages_image_at(dfd, flags, pr->pmi);
+	pr->pi = open_pages_image_at(dfd, flags, pr->pmi, &ph);
 	if (!pr->pi) {
 		close_page_read(pr);
 		return -1;
 	}
 
-	pr->get_pagemap = get_pagemap;
-	pr->put_pagemap = put_pagemap;
+	pr->pi_shared = ph.has_pages_shared && ph.pages_shared;
+
+	if (ph.has_block_size && ph.block_size) {
+		pr->cr = comp_reader_open(dfd, ph.pages_id, ph.block_size, pr->pi);
+		if (!pr->cr) {
+			close_page_read(pr);
+			return -1;
+		}
+	} else if (pr_flags & PR_MMAP)
+		map_pages_image(pr);
+
+	if (ph.has_rec_size && ph.rec_size) {
+		pagemap_entry__init(&pr->pm_pe);
+		if (load_pagemap_recs(pr, ph.rec_size)) {
+			close_page_read(pr);
+			return -1;
+		}
+
+		pr->get_pagemap = get_pagemap_rec;
+		pr->put_pagemap = put_pagemap_rec;
+	} else {
+		pr->get_pagemap = get_pagemap;
+		pr->put_pagemap = put_pagemap;
+	}
+
 	pr->read_pages = read_pagemap_page;
+	pr->skip_pages = skip_pagemap_pages;
+	pr->sync = sync_pagemap_pages;
 	pr->close = close_page_read;
 	pr->id = ids++;
 
@@ -348,7 +735,8 @@ open_old:
 	pr->get_pagemap = get_page_vaddr;
 	pr->put_pagemap = NULL;
 	pr->read_pages = read_page;
-	pr->pi = NULL;
+	pr->skip_pages = skip_page;
+	pr->sync = sync_page;
 	pr->close = close_page_read;
 
 	return 1;
@@ -0,0 +1,243 @@
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/sendfile.h>
+
+#include "asm/types.h"
+#include "crtools.h"
+#include "cr_options.h"
+#include "servicefd.h"
+#include "util.h"
+#include "syscall.h"
+#include "image.h"
+#include "list.h"
+#include "log.h"
+#include "page-store.h"
+#include "xmalloc.h"
+
+#undef	LOG_PREFIX
+#define LOG_PREFIX "page-store: "
+
+#define PAGE_STORE_HASH_BITS	20
+#define PAGE_STORE_HASH_SIZE	(1 << PAGE_STORE_HASH_BITS)
+
+struct page_store_entry {
+	u64			hash;
+	u64			off;
+	struct hlist_node	h;
+};
+
+static struct {
+	struct cr_img		*img;		/* NULL with --archive, see below */
+	int			fd;
+	off_t			base;		/* of the data in fd, see img_raw_off */
+	u32			pages_id;
+	u64			size;		/* bytes in the image */
+	unsigned long		nr_added;	/* pages asked to store */
+	struct hlist_head	*hash;
+} store;
+
+static u64 page_hash(const void *page)
+{
+	const u64 *p = page;
+	u64 h = 0xcbf29ce484222325ULL;
+	int i;
+
+	for (i = 0; i < PAGE_SIZE / sizeof(*p); i++) {
+		h = (h ^ p[i]) * 0x100000001b3ULL;
+		h ^= h >> 29;
+	}
+
+	return h;
+}
+
+/*
+ * An open pages image holds the archive end for the whole dump, and
+ * the namespaces dumpers forked meanwhile would wait for it forever.
+ * So with --archive the pages are kept in a temporary file next to
+ * the archive and are put into it by page_store_fini.
+ */
+static int page_store_open_tmp(void)
+{
+	int fd;
+
+	fd = openat(get_service_fd(IMG_FD_OFF), ".", O_TMPFILE | O_RDWR, CR_FD_PERM);
+	if (fd < 0 && (errno == EOPNOTSUPP || errno == EISDIR)) {
+		fd = sys_memfd_create("page-store", 0);
+		if (fd < 0)
+			errno = -fd;
+	}
+
+	if (fd < 0) {
+		pr_perror("Can't create page store file");
+		return -1;
+	}
+
+	store.fd = fd;
+	store.base = 0;
+	return 0;
+}
+
+static int page_store_open(void)
+{
+	if (opts.archive)
+		return page_store_open_tmp();
+
+	store.img = open_image(CR_FD_PAGES, O_DUMP, store.pages_id);
+	if (!store.img)
+		return -1;
+
+	store.fd = img_raw_fd(store.img);
+	if (store.fd < 0) {
+		close_image(store.img);
+		store.img = NULL;
+		return -1;
+	}
+
+	store.base = img_raw_off(store.img);
+	return 0;
+}
+
+int page_store_get_id(u32 *pages_id)
+{
+	if (store.hash)
+		goto out;
+
+	store.hash = xzalloc(PAGE_STORE_HASH_SIZE * sizeof(*store.hash));
+	if (!store.hash)
+		return -1;
+
+	store.pages_id = reserve_page_id();
+	if (page_store_open())
+		goto err;
+
+	store.size = 0;
+	store.nr_added = 0;
+	pr_info("Storing pages in pages-%u\n", store.pages_id);
+out:
+	*pages_id = store.pages_id;
+	return 0;
+
+err:
+	xfree(store.hash);
+	store.hash = NULL;
+	return -1;
+}
+
+/*
+ * The hash is only a hint, a page matches only if the contents
+ * stored is the same.
+ */
+static int page_store_match(struct page_store_entry *pse, void *page)
+{
+	char buf[PAGE_SIZE];
+
+	if (pread(store.fd, buf, PAGE_SIZE, store.base + pse->off) != PAGE_SIZE) {
+		pr_perror("Can't read stored page at %"PRIx64, pse->off);
+		return -1;
+	}
+
+	return memcmp(buf, page, PAGE_SIZE) == 0;
+}
+
+int page_store_add(void *page, u64 *off)
+{
+	struct page_store_entry *pse;
+	struct hlist_head *chain;
+	u64 hash;
+
+	BUG_ON(!store.hash);
+
+	store.nr_added++;
+	hash = page_hash(page);
+	chain = &store.hash[hash & (PAGE_STORE_HASH_SIZE - 1)];
+
+	hlist_for_each_entry(pse, chain, h) {
+		int ret;
+
+		if (pse->hash != hash)
+			continue;
+
+		ret = page_store_match(pse, page);
+		if (ret < 0)
+			return -1;
+		if (ret) {
+			*off = pse->off;
+			return 0;
+		}
+	}
+
+	pse = xmalloc(sizeof(*pse));
+	if (!pse)
+		return -1;
+
+	if (pwrite(store.fd, page, PAGE_SIZE, store.base + store.size) != PAGE_SIZE) {
+		pr_perror("Can't write page to store");
+		xfree(pse);
+		return -1;
+	}
+
+	pse->hash = hash;
+	pse->off = store.size;
+	hlist_add_head(&pse->h, chain);
+
+	*off = store.size;
+	store.size += PAGE_SIZE;
+	return 0;
+}
+
+static int page_store_put_tmp(void)
+{
+	struct cr_img *img;
+	off_t off = 0;
+	int ret = 0;
+
+	img = open_image(CR_FD_PAGES, O_DUMP, store.pages_id);
+	if (!img)
+		return -1;
+
+	while (off < store.size) {
+		ssize_t len;
+
+		len = sendfile(img_raw_fd(img), store.fd, &off, store.size - off);
+		if (len <= 0) {
+			pr_perror("Can't put page store into pages-%u", store.pages_id);
+			ret = -1;
+			break;
+		}
+	}
+
+	close_image(img);
+	return ret;
+}
+
+int page_store_fini(void)
+{
+	struct page_store_entry *pse;
+	struct hlist_node *n;
+	int i, ret = 0;
+
+	if (!store.hash)
+		return 0;
+
+	pr_info("%lu pages stored as %"PRIu64" unique ones\n",
+			store.nr_added, store.size / PAGE_SIZE);
+
+	for (i = 0; i < PAGE_STORE_HASH_SIZE; i++)
+		hlist_for_each_entry_safe(pse, n, &store.hash[i], h)
+			xfree(pse);
+
+	xfree(store.hash);
+	store.hash = NULL;
+
+	if (store.img) {
+		close_image(store.img);
+		store.img = NULL;
+	} else {
+		ret = page_store_put_tmp();
+		close_safe(&store.fd);
+	}
+
+	return ret;
+}
@@ -13,7 +13,11 @@
 #include "image.h"
 #include "page-xfer.h"
 #include "page-pipe.h"
+#include "pages-comp.h"
+#include "page-store.h"
 #include "util.h"
+#include "stats.h"
+#include "asm/bitops.h"
 #include "protobuf.h"
 #include "protobuf/pagemap.pb-c.h"
 
@@ -43,6 +47,9 @@ static int open_page_local_xfer(struct page_xfer *xfer, int fd_type, long id);
 #define PS_IOV_OPEN	3
 #define PS_IOV_OPEN2	4
 #define PS_IOV_PARENT	5
+#define PS_IOV_OPEN_STREAMS	6
+#define PS_IOV_BATCH	7
+#define PS_IOV_ZERO	8
 
 #define PS_IOV_FLUSH		0x1023
 #define PS_IOV_FLUSH_N_CLOSE	0x1024
@@ -76,6 +83,23 @@ static struct page_xfer_job cxfer = {
 	.dst_id = ~0,
 };
 
+/*
+ * Multi-stream page server. The client asks for N streams with
+ * PS_IOV_OPEN_STREAMS on the first connection, the server replies
+ * with the number it agrees on and accepts that many - 1 more
+ * connections, each one served by a forked copy of the server.
+ * Every pagemap is sent as a whole over one stream, so each
+ * server copy writes its own set of images and no ordering
+ * between streams is required.
+ */
+#define PS_MAX_STREAMS	32
+/* Server copies produce page images from separate ID ranges */
+#define PS_STREAM_IDS	0x100000
+
+static int ps_listen_sk = -1;
+static pid_t ps_streams[PS_MAX_STREAMS];
+static unsigned int nr_ps_streams;
+
 static void page_server_close(void)
 {
 	if (cxfer.dst_id != ~0)
@@ -176,7 +200,171 @@ static int page_server_hole(int sk, struct page_server_iov *pi)
 	return 0;
 }
 
+static int page_server_zero(int sk, struct page_server_iov *pi)
+{
+	struct page_xfer *lxfer = &cxfer.loc_xfer;
+	struct iovec iov;
+
+	pr_debug("Adding %"PRIx64"/%u zero\n", pi->vaddr, pi->nr_pages);
+
+	if (prep_loc_xfer(pi))
+		return -1;
+
+	psi2iovec(pi, &iov);
+	return lxfer->write_zero(lxfer, &iov);
+}
+
+/*
+ * Batched framing. The PS_IOV_BATCH header carries the number of
+ * PS_IOV_ADD, PS_IOV_HOLE and PS_IOV_ZERO entries in nr_pages, the entries follow
+ * it in one piece and then go the pages of all the ADD ones.
+ */
+#define PS_BATCH_MAX	256
+
+struct page_xfer_batch {
+	unsigned int		nr;
+	unsigned long		len;	/* bytes of pages for the entries */
+	struct page_server_iov	pi[PS_BATCH_MAX + 1]; /* pi[0] is the header */
+};
+
+static int page_server_batch(int sk, struct page_server_iov *pi)
+{
+	struct page_server_iov ents[PS_BATCH_MAX];
+	size_t size;
+	u32 i;
+
+	pr_debug("Adding batch of %u\n", pi->nr_pages);
+
+	if (pi->nr_pages > PS_BATCH_MAX) {
+		pr_err("Too long batch %u\n", pi->nr_pages);
+		return -1;
+	}
+
+	size = pi->nr_pages * sizeof(ents[0]);
+	if (recv(sk, ents, size, MSG_WAITALL) != size) {
+		pr_perror("Can't read batch from socket");
+		return -1;
+	}
+
+	/* The pages go in the entries order, so take them one by one */
+	for (i = 0; i < pi->nr_pages; i++) {
+		int ret;
+
+		if (ents[i].dst_id != pi->dst_id) {
+			pr_err("Batch entry for %"PRIx64" in %"PRIx64"\n",
+					ents[i].dst_id, pi->dst_id);
+			return -1;
+		}
+
+		switch (ents[i].cmd) {
+		case PS_IOV_ADD:
+			ret = page_server_add(sk, &ents[i]);
+			break;
+		case PS_IOV_HOLE:
+			ret = page_server_hole(sk, &ents[i]);
+			break;
+		case PS_IOV_ZERO:
+			ret = page_server_zero(sk, &ents[i]);
+			break;
+		default:
+			pr_err("Unexpected command %u in batch\n", ents[i].cmd);
+			ret = -1;
+			break;
+		}
+
+		if (ret)
+			return -1;
+	}
+
+	return 0;
+}
+
 static int page_server_check_parent(int sk, struct page_server_iov *pi);
+static int page_server_serve(int sk);
+
+static int page_server_open_streams(int sk, struct page_server_iov *pi)
+{
+	struct sockaddr_in caddr;
+	socklen_t clen = sizeof(caddr);
+	u32 nr = pi->nr_pages;
+
+	if (nr_ps_streams) {
+		pr_err("Streams are already opened\n");
+		return -1;
+	}
+
+	/* No way to accept more connections on a pre-connected socket */
+	if (ps_listen_sk < 0 || nr < 1)
+		nr = 1;
+	else if (nr > PS_MAX_STREAMS)
+		nr = PS_MAX_STREAMS;
+
+	pr_info("Opening %u streams (%u requested)\n", nr, pi->nr_pages);
+
+	if (write(sk, &nr, sizeof(nr)) != sizeof(nr)) {
+		pr_perror("Can't send the number of streams");
+		return -1;
+	}
+
+	while (nr_ps_streams < nr - 1) {
+		unsigned int idx = nr_ps_streams + 1;
+		int ask;
+		pid_t pid;
+
+		ask = accept(ps_listen_sk, (struct sockaddr *)&caddr, &clen);
+		if (ask < 0) {
+			pr_perror("Can't accept stream %u", idx);
+			return -1;
+		}
+
+		pr_info("Accepted stream %u from %s:%u\n", idx,
+				inet_ntoa(caddr.sin_addr),
+				(int)ntohs(caddr.sin_port));
+
+		pid = fork();
+		if (pid < 0) {
+			pr_perror("Can't fork stream %u", idx);
+			close(ask);
+			return -1;
+		}
+
+		if (pid == 0) {
+			close(ps_listen_sk);
+			close(sk);
+			close(cxfer.p[0]);
+			close(cxfer.p[1]);
+			nr_ps_streams = 0;
+
+			pin_page_id(reserve_page_id() + idx * PS_STREAM_IDS);
+			exit(page_server_serve(ask) ? 1 : 0);
+		}
+
+		close(ask);
+		ps_streams[nr_ps_streams++] = pid;
+	}
+
+	close_safe(&ps_listen_sk);
+	return 0;
+}
+
+static int page_server_wait_streams(void)
+{
+	int ret = 0, status;
+	unsigned int i;
+
+	for (i = 0; i < nr_ps_streams; i++) {
+		if (waitpid(ps_streams[i], &status, 0) != ps_streams[i]) {
+			pr_perror("Can't wait stream %d", ps_streams[i]);
+			ret = -1;
+		} else if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+			pr_err("Stream %d exited with %#x\n", ps_streams[i], status);
+			ret = -1;
+		}
+	}
+
+	nr_ps_streams = 0;
+	return ret;
+}
 
 static int page_server_serve(int sk)
 {
@@ -224,12 +412,21 @@ static int page_server_serve(int sk)
 		case PS_IOV_PARENT:
 			ret = page_server_check_parent(sk, &pi);
 			break;
+		case PS_IOV_OPEN_STREAMS:
+			ret = page_server_open_streams(sk, &pi);
+			break;
 		case PS_IOV_ADD:
 			ret = page_server_add(sk, &pi);
 			break;
 		case PS_IOV_HOLE:
 			ret = page_server_hole(sk, &pi);
 			break;
+		case PS_IOV_ZERO:
+			ret = page_server_zero(sk, &pi);
+			break;
+		case PS_IOV_BATCH:
+			ret = page_server_batch(sk, &pi);
+			break;
 		case PS_IOV_FLUSH:
 		case PS_IOV_FLUSH_N_CLOSE:
 		{
@@ -279,6 +476,8 @@ static int page_server_serve(int sk)
 	}
 
 	page_server_close();
+	if (page_store_fini())
+		ret = -1;
 	pr_info("Session over\n");
 
 	close(sk);
@@ -333,7 +532,7 @@ int cr_page_server(bool daemon_mode, int cfd)
 		goto out;
 	}
 
-	if (listen(sk, 1)) {
+	if (listen(sk, PS_MAX_STREAMS)) {
 		pr_perror("Can't listen on page server socket");
 		goto out;
 	}
@@ -379,12 +578,17 @@ no_server:
 			pr_info("Accepted connection from %s:%u\n",
 					inet_ntoa(caddr.sin_addr),
 					(int)ntohs(caddr.sin_port));
-		close(sk);
+		/* Kept for the streams, see page_server_open_streams */
+		ps_listen_sk = sk;
 	}
 
 	if (ask >= 0)
 		ret = page_server_serve(ask);
 
+	close_safe(&ps_listen_sk);
+	if (page_server_wait_streams())
+		ret = -1;
+
 	if (daemon_mode)
 		exit(ret);
 
@@ -395,63 +599,147 @@ out:
 	return -1;
 }
 
+/* The stream used by this process, see page_server_use_stream */
 static int page_server_sk = -1;
+static int page_server_sks[PS_MAX_STREAMS];
+static unsigned int nr_page_server_sks;
 
-int connect_to_page_server(void)
+static int page_server_connect(void)
 {
 	struct sockaddr_in saddr;
+	int sk;
 
-	if (!opts.use_page_server)
-		return 0;
-
-	if (opts.ps_socket != -1) {
-		page_server_sk = opts.ps_socket;
-		pr_info("Re-using ps socket %d\n", page_server_sk);
-		goto out;
-	}
-
-	pr_info("Connecting to server %s:%u\n",
-			opts.addr, (int)ntohs(opts.port));
-
-	page_server_sk = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-	if (page_server_sk < 0) {
+	sk = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (sk < 0) {
 		pr_perror("Can't create socket");
 		return -1;
 	}
 
 	if (get_sockaddr_in(&saddr))
-		return -1;
+		goto err;
 
-	if (connect(page_server_sk, (struct sockaddr *)&saddr, sizeof(saddr)) < 0) {
+	if (connect(sk, (struct sockaddr *)&saddr, sizeof(saddr)) < 0) {
 		pr_perror("Can't connect to server");
-		return -1;
+		goto err;
 	}
 
-out:
 	/*
 	 * CORK the socket at the very beginning. As per ANK
 	 * the corked by default socket with sporadic NODELAY-s
 	 * on urgent data is the smartest mode ever.
 	 */
-	tcp_cork(page_server_sk, true);
-	return 0;
+	tcp_cork(sk, true);
+	return sk;
+err:
+	close(sk);
+	return -1;
 }
 
-int disconnect_from_page_server(void)
+static int page_server_open_streams_sk(unsigned int nr_streams)
 {
 	struct page_server_iov pi = { };
-	int32_t status = -1;
-	int ret = -1;
+	u32 nr;
+
+	pi.cmd = PS_IOV_OPEN_STREAMS;
+	pi.nr_pages = nr_streams;
+
+	if (write(page_server_sk, &pi, sizeof(pi)) != sizeof(pi)) {
+		pr_perror("Can't write to page server");
+		return -1;
+	}
+
+	tcp_nodelay(page_server_sk, true);
+
+	if (read(page_server_sk, &nr, sizeof(nr)) != sizeof(nr)) {
+		pr_perror("The page server doesn't answer");
+		return -1;
+	}
+
+	if (nr < 1 || nr > nr_streams) {
+		pr_err("The page server opened bad number of streams %u\n", nr);
+		return -1;
+	}
+
+	pr_info("Page server opened %u streams\n", nr);
+
+	while (nr_page_server_sks < nr) {
+		int sk;
+
+		sk = page_server_connect();
+		if (sk < 0)
+			return -1;
+
+		page_server_sks[nr_page_server_sks++] = sk;
+	}
 
+	return 0;
+}
+
+/*
+ * Connects to the page server. With @nr_streams > 1 up to that
+ * many connections are opened, see page_server_streams() for
+ * how many were actually got.
+ */
+int connect_to_page_server(unsigned int nr_streams)
+{
 	if (!opts.use_page_server)
 		return 0;
 
-	if (page_server_sk == -1)
-		return 0;
+	if (opts.ps_socket != -1) {
+		page_server_sk = opts.ps_socket;
+		pr_info("Re-using ps socket %d\n", page_server_sk);
+		tcp_cork(page_server_sk, true);
+		goto out;
+	}
 
-	pr_info("Disconnect from the page server %s:%u\n",
+	pr_info("Connecting to server %s:%u\n",
 			opts.addr, (int)ntohs(opts.port));
 
+	page_server_sk = page_server_connect();
+	if (page_server_sk < 0)
+		return -1;
+
+out:
+	page_server_sks[0] = page_server_sk;
+	nr_page_server_sks = 1;
+
+	if (nr_streams > PS_MAX_STREAMS)
+		nr_streams = PS_MAX_STREAMS;
+
+	if (nr_streams > 1 && opts.ps_socket == -1) {
+		if (page_server_open_streams_sk(nr_streams)) {
+			disconnect_from_page_server();
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+unsigned int page_server_streams(void)
+{
+	return nr_page_server_sks ? : 1;
+}
+
+/*
+ * Makes the subsequent page-server xfers in this process go
+ * over the @idx stream. Used by the dump workers, each one
+ * talks to its own copy of the server.
+ */
+void page_server_use_stream(unsigned int idx)
+{
+	if (!nr_page_server_sks)
+		return;
+
+	BUG_ON(idx >= nr_page_server_sks);
+	page_server_sk = page_server_sks[idx];
+}
+
+static int page_server_flush(int sk)
+{
+	struct page_server_iov pi = { };
+	int32_t status = -1;
+
 	if (opts.ps_socket != -1)
 		/*
 		 * The socket might not get closed (held by
@@ -462,20 +750,42 @@ int disconnect_from_page_server(void)
 	else
 		pi.cmd = PS_IOV_FLUSH;
 
-	if (write(page_server_sk, &pi, sizeof(pi)) != sizeof(pi)) {
+	if (write(sk, &pi, sizeof(pi)) != sizeof(pi)) {
 		pr_perror("Can't write the fini command to server");
-		goto out;
+		return -1;
 	}
 
-	if (read(page_server_sk, &status, sizeof(status)) != sizeof(status)) {
+	if (read(sk, &status, sizeof(status)) != sizeof(status)) {
 		pr_perror("The page server doesn't answer");
-		goto out;
+		return -1;
 	}
 
-	ret = 0;
-out:
-	close_safe(&page_server_sk);
-	return ret ? : status;
+	return status;
+}
+
+int disconnect_from_page_server(void)
+{
+	unsigned int i;
+	int ret = 0;
+
+	if (!opts.use_page_server)
+		return 0;
+
+	if (!nr_page_server_sks)
+		return 0;
+
+	pr_info("Disconnect from the page server %s:%u\n",
+			opts.addr, (int)ntohs(opts.port));
+
+	for (i = 0; i < nr_page_server_sks; i++) {
+		if (page_server_flush(page_server_sks[i]))
+			ret = -1;
+		close(page_server_sks[i]);
+	}
+
+	nr_page_server_sks = 0;
+	page_server_sk = -1;
+	return ret;
 }
 
 static int write_pagemap_to_server(struct page_xfer *xfer,
@@ -508,24 +818,67 @@ static int write_pages_to_server(struct page_xfer *xfer,
 	return 0;
 }
 
-static int write_hole_to_server(struct page_xfer *xfer, struct iovec *iov)
+static int write_iov_to_server(struct page_xfer *xfer, struct iovec *iov, u32 cmd)
 {
 	struct page_server_iov pi;
 
-	pi.cmd = PS_IOV_HOLE;
+	pi.cmd = cmd;
 	pi.dst_id = xfer->dst_id;
 	iovec2psi(iov, &pi);
 
 	if (write(xfer->sk, &pi, sizeof(pi)) != sizeof(pi)) {
-		pr_perror("Can't write pagehole to server");
+		pr_perror("Can't write %s to server",
+				cmd == PS_IOV_HOLE ? "pagehole" : "zero pages");
 		return -1;
 	}
 
 	return 0;
 }
 
+static int write_hole_to_server(struct page_xfer *xfer, struct iovec *iov)
+{
+	return write_iov_to_server(xfer, iov, PS_IOV_HOLE);
+}
+
+static int write_zero_to_server(struct page_xfer *xfer, struct iovec *iov)
+{
+	return write_iov_to_server(xfer, iov, PS_IOV_ZERO);
+}
+
+static int write_batch_to_server(struct page_xfer *xfer,
+		struct page_xfer_batch *b, int p)
+{
+	size_t size;
+
+	if (!b->nr)
+		return 0;
+
+	pr_debug("Sending batch of %u entries, %lu pages\n",
+			b->nr, b->len / PAGE_SIZE);
+
+	b->pi[0].cmd = PS_IOV_BATCH;
+	b->pi[0].nr_pages = b->nr;
+	b->pi[0].vaddr = 0;
+	b->pi[0].dst_id = xfer->dst_id;
+
+	size = (b->nr + 1) * sizeof(b->pi[0]);
+	if (write(xfer->sk, b->pi, size) != size) {
+		pr_perror("Can't write batch to server");
+		return -1;
+	}
+
+	if (b->len && write_pages_to_server(xfer, p, b->len))
+		return -1;
+
+	b->nr = 0;
+	b->len = 0;
+	return 0;
+}
+
 static void close_server_xfer(struct page_xfer *xfer)
 {
+	xfree(xfer->batch);
+	xfer->batch = NULL;
 	xfer->sk = -1;
 }
 
@@ -538,9 +891,12 @@ static int open_page_server_xfer(struct page_xfer *xfer, int fd_type, long id)
 	xfer->write_pagemap = write_pagemap_to_server;
 	xfer->write_pages = write_pages_to_server;
 	xfer->write_hole = write_hole_to_server;
+	xfer->write_zero = write_zero_to_server;
+	xfer->write_batch = NULL;
 	xfer->close = close_server_xfer;
 	xfer->dst_id = encode_pm_id(fd_type, id);
 	xfer->parent = NULL;
+	xfer->batch = NULL;
 
 	pi.cmd = PS_IOV_OPEN2;
 	pi.dst_id = xfer->dst_id;
@@ -563,9 +919,46 @@ static int open_page_server_xfer(struct page_xfer *xfer, int fd_type, long id)
 	if (has_parent)
 		xfer->parent = (void *) 1; /* This is required for generate_iovs() */
 
+	if (opts.ps_batch) {
+		xfer->batch = xzalloc(sizeof(*xfer->batch));
+		if (!xfer->batch)
+			return -1;
+		xfer->write_batch = write_batch_to_server;
+	}
+
 	return 0;
 }
 
+/*
+ * Entries without the offset have their pages right after the
+ * previous ones, the records have it set explicitly.
+ */
+static int write_pagemap_entry(struct page_xfer *xfer, PagemapEntry *pe)
+{
+	struct pagemap_rec r;
+
+	if (!xfer->pm_fixed)
+		return pb_write_one(xfer->pmi, pe, PB_PAGEMAP);
+
+	r.vaddr = pe->vaddr;
+	r.nr_pages = pe->nr_pages;
+	r.flags = 0;
+	if (pe->in_parent)
+		r.flags |= PE_IN_PARENT;
+	if (pe->zero)
+		r.flags |= PE_ZERO;
+
+	if (pe->has_off)
+		r.off = pe->off;
+	else {
+		r.off = xfer->pages_off;
+		if (!r.flags)
+			xfer->pages_off += pe->nr_pages * PAGE_SIZE;
+	}
+
+	return write_img(xfer->pmi, &r);
+}
+
 static int write_pagemap_loc(struct page_xfer *xfer,
 		struct iovec *iov)
 {
@@ -580,7 +973,7 @@ static int write_pagemap_loc(struct page_xfer *xfer,
 			return ret;
 		}
 	}
-	return pb_write_one(xfer->pmi, &pe, PB_PAGEMAP);
+	return write_pagemap_entry(xfer, &pe);
 }
 
 static int write_pages_loc(struct page_xfer *xfer,
@@ -588,6 +981,9 @@ static int write_pages_loc(struct page_xfer *xfer,
 {
 	ssize_t ret;
 
+	if (xfer->cw)
+		return comp_writer_splice(xfer->cw, p, len);
+
 	ret = splice(p, NULL, img_raw_fd(xfer->pi), NULL, len, SPLICE_F_MOVE);
 	if (ret == -1) {
 		pr_perror("Unable to spice data");
@@ -601,6 +997,103 @@ static int write_pages_loc(struct page_xfer *xfer,
 	return 0;
 }
 
+static int write_zero_loc(struct page_xfer *xfer, struct iovec *iov)
+{
+	PagemapEntry pe = PAGEMAP_ENTRY__INIT;
+
+	iovec2pagemap(iov, &pe);
+	pe.has_zero = true;
+	pe.zero = true;
+
+	/* The parent's pages are overwritten with zeroes just like with data */
+	if (opts.auto_dedup && xfer->parent != NULL) {
+		if (dedup_one_iovec(xfer->parent, iov) == -1) {
+			pr_perror("Auto-deduplication failed");
+			return -1;
+		}
+	}
+
+	return write_pagemap_entry(xfer, &pe);
+}
+
+/* How many pages are taken from the pipe at once to put into the store */
+#define STORE_BATCH	16
+
+static int write_pagemap_store(struct page_xfer *xfer,
+		struct iovec *iov)
+{
+	if (opts.auto_dedup && xfer->parent != NULL) {
+		if (dedup_one_iovec(xfer->parent, iov) == -1) {
+			pr_perror("Auto-deduplication failed");
+			return -1;
+		}
+	}
+
+	/* The entries are written with the offsets, in write_pages_store */
+	BUG_ON(xfer->store_pending);
+	xfer->store_iov = *iov;
+	return 0;
+}
+
+/*
+ * The page server feeds pages in arbitrary chunks, so the tail
+ * of a partial page is left in the pipe till the next call.
+ */
+static int write_pages_store(struct page_xfer *xfer,
+		int p, unsigned long len)
+{
+	static char buf[STORE_BATCH * PAGE_SIZE];
+	PagemapEntry pe = PAGEMAP_ENTRY__INIT;
+
+	xfer->store_pending += len;
+	BUG_ON(xfer->store_pending > xfer->store_iov.iov_len);
+
+	pe.has_off = true;
+	pe.nr_pages = 0;
+
+	while (xfer->store_pending >= PAGE_SIZE) {
+		unsigned long chunk;
+		ssize_t ret;
+		char *page;
+
+		chunk = min(xfer->store_pending & ~(PAGE_SIZE - 1), sizeof(buf));
+		ret = read(p, buf, chunk);
+		if (ret != chunk) {
+			pr_perror("Can't read %lu bytes of pages (%zd)", chunk, ret);
+			return -1;
+		}
+
+		for (page = buf; page < buf + chunk; page += PAGE_SIZE) {
+			u64 off;
+
+			if (page_store_add(page, &off))
+				return -1;
+
+			/* Pages stored one after another go in one entry */
+			if (pe.nr_pages && pe.off + pe.nr_pages * PAGE_SIZE == off) {
+				pe.nr_pages++;
+				continue;
+			}
+
+			if (pe.nr_pages && write_pagemap_entry(xfer, &pe) < 0)
+				return -1;
+
+			pe.vaddr = encode_pointer(xfer->store_iov.iov_base + (page - buf));
+			pe.nr_pages = 1;
+			pe.off = off;
+		}
+
+		xfer->store_iov.iov_base += chunk;
+		xfer->store_iov.iov_len -= chunk;
+		xfer->store_pending -= chunk;
+	}
+
+	if (pe.nr_pages && write_pagemap_entry(xfer, &pe) < 0)
+		return -1;
+
+	return 0;
+}
+
 static int check_pagehole_in_parent(struct page_read *p, struct iovec *iov)
 {
 	int ret;
@@ -662,7 +1155,7 @@ static int write_pagehole_loc(struct page_xfer *xfer, struct iovec *iov)
 	pe.has_in_parent = true;
 	pe.in_parent = true;
 
-	if (pb_write_one(xfer->pmi, &pe, PB_PAGEMAP) < 0)
+	if (write_pagemap_entry(xfer, &pe) < 0)
 		return -1;
 
 	return 0;
@@ -675,82 +1168,351 @@ static void close_page_xfer(struct page_xfer *xfer)
 		xfree(xfer->parent);
 		xfer->parent = NULL;
 	}
-	close_image(xfer->pi);
+	if (xfer->cw && comp_writer_close(xfer->cw))
+		pr_err("Compressed pages image is incomplete\n");
+	if (xfer->pi)
+		close_image(xfer->pi);
 	close_image(xfer->pmi);
 }
 
-int page_xfer_dump_pages(struct page_xfer *xfer, struct page_pipe *pp,
-		unsigned long off)
+static int batch_add(struct page_xfer *xfer, u32 cmd, struct iovec *iov, int p)
 {
-	struct page_pipe_buf *ppb;
-	struct iovec *hole = NULL;
+	struct page_xfer_batch *b = xfer->batch;
+	struct page_server_iov *pi;
 
-	pr_debug("Transfering pages:\n");
+	if (b->nr == PS_BATCH_MAX && xfer->write_batch(xfer, b, p))
+		return -1;
 
-	if (pp->free_hole)
-		hole = &pp->holes[0];
+	pi = &b->pi[++b->nr];
+	pi->cmd = cmd;
+	pi->dst_id = xfer->dst_id;
+	iovec2psi(iov, pi);
 
-	list_for_each_entry(ppb, &pp->bufs, l) {
-		int i;
+	if (cmd == PS_IOV_ADD)
+		b->len += iov->iov_len;
 
-		pr_debug("\tbuf %d/%d\n", ppb->pages_in, ppb->nr_segs);
+	return 0;
+}
 
-		for (i = 0; i < ppb->nr_segs; i++) {
-			struct iovec *iov = &ppb->iov[i];
+static int xfer_hole(struct page_xfer *xfer, struct iovec *iov, int p)
+{
+	if (xfer->write_batch)
+		return batch_add(xfer, PS_IOV_HOLE, iov, p);
 
-			while (hole && (hole->iov_base < iov->iov_base)) {
-				BUG_ON(hole->iov_base < (void *)off);
-				hole->iov_base -= off;
-				pr_debug("\th %p [%u]\n", hole->iov_base,
-						(unsigned int)(hole->iov_len / PAGE_SIZE));
-				if (xfer->write_hole(xfer, hole))
-					return -1;
+	return xfer->write_hole(xfer, iov);
+}
+
+static int xfer_zero(struct page_xfer *xfer, struct iovec *iov, int p)
+{
+	if (xfer->write_batch)
+		return batch_add(xfer, PS_IOV_ZERO, iov, p);
+
+	return xfer->write_zero(xfer, iov);
+}
+
+static int xfer_pages(struct page_xfer *xfer, struct iovec *iov, int p)
+{
+	if (xfer->write_batch)
+		return batch_add(xfer, PS_IOV_ADD, iov, p);
+
+	if (xfer->write_pagemap(xfer, iov))
+		return -1;
+
+	return xfer->write_pages(xfer, p, iov->iov_len);
+}
+
+static int xfer_holes(struct page_xfer *xfer, struct page_pipe *pp,
+		unsigned int *hole, void *limit, unsigned long off, int p)
+{
+	for (; *hole < pp->free_hole; (*hole)++) {
+		struct iovec *h = &pp->holes[*hole];
+
+		if (limit && h->iov_base >= limit)
+			break;
+
+		BUG_ON(h->iov_base < (void *)off);
+		h->iov_base -= off;
+		pr_debug("\th %p [%u]\n", h->iov_base,
+				(unsigned int)(h->iov_len / PAGE_SIZE));
+		if (xfer_hole(xfer, h, p))
+			return -1;
+	}
 
-				hole++;
-				if (hole >= &pp->holes[pp->free_hole])
-					hole = NULL;
+	return 0;
+}
+
+/* How many pages are checked for being zero at once */
+#define ZERO_BATCH	16
+
+static bool page_is_zero(const void *page)
+{
+	const u64 *p = page;
+	int i;
+
+	for (i = 0; i < PAGE_SIZE / sizeof(*p); i += 8)
+		if (p[i] | p[i + 1] | p[i + 2] | p[i + 3] |
+		    p[i + 4] | p[i + 5] | p[i + 6] | p[i + 7])
+			return false;
+
+	return true;
+}
+
+/*
+ * Pages in the @ppb are peeked at via a tee-d copy, so that
+ * the non-zero ones still go to the image with splice. Returns
+ * a bitmap of zero pages or NULL if there are none or the copy
+ * can't be made.
+ */
+static unsigned long *find_zero_pages(struct page_pipe_buf *ppb)
+{
+	static int tp[2] = { -1, -1 };
+	static char buf[ZERO_BATCH * PAGE_SIZE];
+	unsigned long len = ppb->pages_in * PAGE_SIZE, pos;
+	unsigned long *map = NULL, nr_zero = 0;
+	ssize_t ret;
+
+	if (!len)
+		return NULL;
+
+	if (tp[0] < 0 && pipe(tp)) {
+		pr_perror("Can't make pipe for zero pages check");
+		return NULL;
+	}
+
+	if (fcntl(tp[0], F_GETPIPE_SZ) < (int)len &&
+	    fcntl(tp[0], F_SETPIPE_SZ, len) < 0) {
+		pr_debug("Can't grow zero check pipe to %lu: %m\n", len);
+		return NULL;
+	}
+
+	ret = tee(ppb->p[0], tp[1], len, SPLICE_F_NONBLOCK);
+	if (ret != len) {
+		pr_warn("Can't tee pages for zero check (%zd/%lu)\n", ret, len);
+		len = ret > 0 ? ret : 0;
+		goto drain;
+	}
+
+	map = xzalloc(BITS_TO_LONGS(ppb->pages_in) * sizeof(long));
+	if (!map)
+		goto drain;
+
+	for (pos = 0; pos < len; pos += sizeof(buf)) {
+		unsigned long chunk = min(len - pos, sizeof(buf)), i;
+
+		if (read(tp[0], buf, chunk) != chunk) {
+			pr_perror("Can't read pages for zero check");
+			xfree(map);
+			map = NULL;
+			len -= pos;
+			goto drain;
+		}
+
+		for (i = 0; i < chunk / PAGE_SIZE; i++)
+			if (page_is_zero(buf + i * PAGE_SIZE)) {
+				set_bit(pos / PAGE_SIZE + i, map);
+				nr_zero++;
 			}
+	}
+
+	if (!nr_zero) {
+		xfree(map);
+		return NULL;
+	}
 
-			BUG_ON(iov->iov_base < (void *)off);
-			iov->iov_base -= off;
-			pr_debug("\tp %p [%u]\n", iov->iov_base,
-					(unsigned int)(iov->iov_len / PAGE_SIZE));
+	cnt_add(CNT_PAGES_ZERO, nr_zero);
+	return map;
 
-			if (xfer->write_pagemap(xfer, iov))
-				return -1;
-			if (xfer->write_pages(xfer, ppb->p[0], iov->iov_len))
+drain:
+	/* Don't leave the stale copy for the next buffer */
+	while (len) {
+		unsigned long chunk = min(len, sizeof(buf));
+
+		if (read(tp[0], buf, chunk) <= 0)
+			break;
+		len -= chunk;
+	}
+	return NULL;
+}
+
+/* Drops the zero pages data from the pipe */
+static int drain_zero_pages(struct page_xfer *xfer, int p, unsigned long len)
+{
+	char buf[PAGE_SIZE];
+
+	/* Data of batched pages before these ones is still in the pipe */
+	if (xfer->write_batch && xfer->write_batch(xfer, xfer->batch, p))
+		return -1;
+
+	for (; len; len -= PAGE_SIZE)
+		if (read(p, buf, PAGE_SIZE) != PAGE_SIZE) {
+			pr_perror("Can't drain zero pages");
+			return -1;
+		}
+
+	return 0;
+}
+
+/*
+ * Transfers the @iov splitting it into runs of zero and non-zero
+ * pages, the @pg is the @iov's first page number in the buffer.
+ */
+static int xfer_pages_zmap(struct page_xfer *xfer, struct iovec *iov, int p,
+		unsigned long *zmap, unsigned long pg)
+{
+	unsigned long nr = iov->iov_len / PAGE_SIZE, i, run;
+
+	for (i = 0; i < nr; i += run) {
+		bool zero = test_bit(pg + i, zmap);
+		struct iovec r;
+
+		for (run = 1; i + run < nr; run++)
+			if (test_bit(pg + i + run, zmap) != zero)
+				break;
+
+		r.iov_base = iov->iov_base + i * PAGE_SIZE;
+		r.iov_len = run * PAGE_SIZE;
+
+		if (!zero) {
+			if (xfer_pages(xfer, &r, p))
 				return -1;
+			continue;
 		}
+
+		if (xfer_zero(xfer, &r, p) || drain_zero_pages(xfer, p, r.iov_len))
+			return -1;
 	}
 
-	while (hole) {
-		BUG_ON(hole->iov_base < (void *)off);
-		hole->iov_base -= off;
-		pr_debug("\th* %p [%u]\n", hole->iov_base,
-				(unsigned int)(hole->iov_len / PAGE_SIZE));
-		if (xfer->write_hole(xfer, hole))
+	return 0;
+}
+
+/*
+ * Transfers the @ppb and the holes of @pp lying before it, the
+ * @hole is the index of the first hole not yet transferred. With
+ * @ppb == NULL all the remaining holes are sent.
+ *
+ * The buffers should be fed in the pp->bufs order, but they don't
+ * have to be all filled at once, see dump_pages in mem.c.
+ */
+int page_xfer_dump_buf(struct page_xfer *xfer, struct page_pipe *pp,
+		struct page_pipe_buf *ppb, unsigned int *hole, unsigned long off)
+{
+	int i, p = ppb ? ppb->p[0] : -1, ret = -1;
+	unsigned long *zmap = NULL, pg = 0;
+
+	if (!ppb) {
+		if (xfer_holes(xfer, pp, hole, NULL, off, p))
 			return -1;
+		goto out;
+	}
+
+	pr_debug("\tbuf %d/%d\n", ppb->pages_in, ppb->nr_segs);
 
-		hole++;
-		if (hole >= &pp->holes[pp->free_hole])
-			hole = NULL;
+	if (opts.skip_zero_pages)
+		zmap = find_zero_pages(ppb);
+
+	for (i = 0; i < ppb->nr_segs; i++) {
+		struct iovec *iov = &ppb->iov[i];
+
+		if (xfer_holes(xfer, pp, hole, iov->iov_base, off, p))
+			goto err;
+
+		BUG_ON(iov->iov_base < (void *)off);
+		iov->iov_base -= off;
+		pr_debug("\tp %p [%u]\n", iov->iov_base,
+				(unsigned int)(iov->iov_len / PAGE_SIZE));
+
+		if (zmap)
+			ret = xfer_pages_zmap(xfer, iov, p, zmap, pg);
+		else
+			ret = xfer_pages(xfer, iov, p);
+		if (ret)
+			goto err;
+
+		pg += iov->iov_len / PAGE_SIZE;
 	}
 
+	xfree(zmap);
+out:
+	/* The batch must not take pages from the next pipe */
+	if (xfer->write_batch && xfer->write_batch(xfer, xfer->batch, p))
+		return -1;
+
 	return 0;
+
+err:
+	xfree(zmap);
+	return -1;
+}
+
+int page_xfer_dump_pages(struct page_xfer *xfer, struct page_pipe *pp,
+		unsigned long off)
+{
+	struct page_pipe_buf *ppb;
+	unsigned int hole = 0;
+
+	pr_debug("Transfering pages:\n");
+
+	list_for_each_entry(ppb, &pp->bufs, l)
+		if (page_xfer_dump_buf(xfer, pp, ppb, &hole, off))
+			return -1;
+
+	return page_xfer_dump_buf(xfer, pp, NULL, &hole, off);
 }
 
 static int open_page_local_xfer(struct page_xfer *xfer, int fd_type, long id)
 {
+	PagemapHead ph = PAGEMAP_HEAD__INIT;
+
 	xfer->pmi = open_image(fd_type, O_DUMP, id);
 	if (!xfer->pmi)
 		return -1;
 
-	xfer->pi = open_pages_image(O_DUMP, xfer->pmi);
+	xfer->pi = NULL;
+	xfer->cw = NULL;
+	xfer->store_pending = 0;
+	xfer->pages_off = 0;
+	xfer->pm_fixed = opts.pagemap_fixed;
+
+	if (xfer->pm_fixed) {
+		ph.has_rec_size = true;
+		ph.rec_size = sizeof(struct pagemap_rec);
+	}
+
+	if (opts.page_dedup) {
+		/* Pages go to the store, see write_pages_store */
+		ph.has_pages_shared = true;
+		ph.pages_shared = true;
+
+		if (page_store_get_id(&ph.pages_id) ||
+		    pb_write_one(xfer->pmi, &ph, PB_PAGEMAP_HEAD) < 0) {
+			close_image(xfer->pmi);
+			return -1;
+		}
+
+		goto open_parent;
+	}
+
+	if (opts.compress) {
+		ph.has_block_size = true;
+		ph.block_size = PAGES_COMP_BLOCK_SIZE;
+	}
+
+	xfer->pi = open_pages_image(O_DUMP, xfer->pmi, &ph);
 	if (!xfer->pi) {
 		close_image(xfer->pmi);
 		return -1;
 	}
 
+	if (opts.compress) {
+		xfer->cw = comp_writer_open(get_service_fd(IMG_FD_OFF),
+				ph.pages_id, ph.block_size, xfer->pi);
+		if (!xfer->cw) {
+			close_image(xfer->pi);
+			close_image(xfer->pmi);
+			return -1;
+		}
+	}
+
 	/*
 	 * Open page-read for parent images (if it exists). It will
 	 * be used for two things:
@@ -758,6 +1520,7 @@ static int open_page_local_xfer(struct page_xfer *xfer, int fd_type, long id)
 	 * 2) when writing a hole, the respective place would be checked
 	 *    to exist in parent (either pagemap or hole)
 	 */
+open_parent:
 	xfer->parent = NULL;
 	if (fd_type == CR_FD_PAGEMAP) {
 		int ret;
@@ -785,9 +1548,16 @@ static int open_page_local_xfer(struct page_xfer *xfer, int fd_type, long id)
 	}
 
 out:
-	xfer->write_pagemap = write_pagemap_loc;
-	xfer->write_pages = write_pages_loc;
+	if (opts.page_dedup) {
+		xfer->write_pagemap = write_pagemap_store;
+		xfer->write_pages = write_pages_store;
+	} else {
+		xfer->write_pagemap = write_pagemap_loc;
+		xfer->write_pages = write_pages_loc;
+	}
 	xfer->write_hole = write_pagehole_loc;
+	xfer->write_zero = write_zero_loc;
+	xfer->write_batch = NULL;
 	xfer->close = close_page_xfer;
 	return 0;
 }
@@ -1,5 +1,6 @@
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 
 #include "pagemap-cache.h"
 #include "compiler.h"
@@ -8,6 +9,7 @@
 #include "log.h"
 #include "vma.h"
 #include "kerndat.h"
+#include "mem.h"
 
 #undef	LOG_PREFIX
 #define LOG_PREFIX "pagemap-cache: "
@@ -20,6 +22,16 @@
 
 #define PAGEMAP_LEN(addr)	(PAGE_PFN(addr) * sizeof(u64))
 
+/* Regions fetched per PAGEMAP_SCAN call */
+#define PMC_SCAN_REGIONS	64
+
+/*
+ * PAGEMAP_SCAN doesn't report PFNs, only tells the zero page from
+ * the others. The latter get this one, which is never a real PFN,
+ * so that the pme-s still compare against kdat.zero_page_pfn.
+ */
+#define PMC_SCAN_PFN		PME_PFRAME_MASK
+
 static inline void pmc_reset(pmc_t *pmc)
 {
 	memzero(pmc, sizeof(*pmc));
@@ -60,6 +72,72 @@ static inline u64 *__pmc_get_map(pmc_t *pmc, unsigned long addr)
 	return &pmc->map[PAGE_PFN(addr - pmc->start)];
 }
 
+static u64 pmc_scan_pme(u64 categories)
+{
+	u64 pme = 0;
+
+	if (categories & PMC_PAGE_IS_PRESENT) {
+		pme |= PME_PRESENT;
+		if (categories & PMC_PAGE_IS_PFNZERO)
+			pme |= kdat.zero_page_pfn;
+		else
+			pme |= PMC_SCAN_PFN;
+	} else if (categories & PMC_PAGE_IS_SWAPPED)
+		pme |= PME_SWAP;
+
+	if (categories & PMC_PAGE_IS_FILE)
+		pme |= PME_FILE;
+	if (categories & PMC_PAGE_IS_SOFT_DIRTY)
+		pme |= PME_SOFT_DIRTY;
+
+	return pme;
+}
+
+/*
+ * Fill the window with the PAGEMAP_SCAN ioctl. The kernel only
+ * reports present and swapped ranges, with the same categories
+ * merged into one region, so for sparse areas this is way less
+ * data to copy than the raw pagemap array. The rest of the window
+ * is left zeroed, just like pagemap has it for unmapped pages.
+ */
+static int pmc_scan_cache(pmc_t *pmc, size_t size_map)
+{
+	struct pmc_page_region regs[PMC_SCAN_REGIONS];
+	struct pmc_scan_arg arg = {
+		.size			= sizeof(arg),
+		.start			= pmc->start,
+		.end			= pmc->end,
+		.vec			= (unsigned long)regs,
+		.vec_len		= ARRAY_SIZE(regs),
+		.category_anyof_mask	= PMC_SCAN_ANYOF_MASK,
+		.return_mask		= PMC_SCAN_RETURN_MASK,
+	};
+
+	memzero(pmc->map, size_map);
+
+	while (arg.start < pmc->end) {
+		int nr, i;
+
+		nr = ioctl(pmc->fd, PMC_PAGEMAP_SCAN, &arg);
+		if (nr < 0)
+			return -1;
+
+		for (i = 0; i < nr; i++) {
+			u64 pme = pmc_scan_pme(regs[i].categories);
+			u64 *map = pmc->map + PAGE_PFN(regs[i].start - pmc->start);
+			unsigned long n = PAGE_PFN(regs[i].end - regs[i].start);
+
+			while (n--)
+				*map++ = pme;
+		}
+
+		/* The vector is full, continue from where the kernel stopped */
+		arg.start = arg.walk_end;
+	}
+
+	return 0;
+}
+
 static int pmc_fill_cache(pmc_t *pmc, const struct vma_area *vma)
 {
 	unsigned long low = vma->e->start & PMC_MASK;
@@ -120,6 +198,15 @@ static int pmc_fill_cache(pmc_t *pmc, const struct vma_area *vma)
 	size_map = PAGEMAP_LEN(pmc->end - pmc->start);
 	BUG_ON(pmc->map_len < size_map);
 
+	if (kdat.has_pagemap_scan) {
+		if (!pmc_scan_cache(pmc, size_map))
+			return 0;
+
+		pr_warn("Can't scan %d's pagemap, falling back to read (%d)\n",
+			pmc->pid, errno);
+		kdat.has_pagemap_scan = false;
+	}
+
 	if (pread(pmc->fd, pmc->map, size_map, PAGEMAP_PFN_OFF(pmc->start)) != size_map) {
 		pmc_zap(pmc);
 		pr_perror("Can't read %d's pagemap file", pmc->pid);
@@ -0,0 +1,329 @@
+#include <unistd.h>
+#include <string.h>
+
+#ifdef CONFIG_HAS_LZ4
+#include <lz4.h>
+#endif
+
+#include "image.h"
+#include "pages-comp.h"
+#include "util.h"
+#include "xmalloc.h"
+
+#include "protobuf.h"
+#include "protobuf/pagemap.pb-c.h"
+
+#undef	LOG_PREFIX
+#define LOG_PREFIX "pages-comp: "
+
+struct comp_writer {
+	struct cr_img	*pi;
+	struct cr_img	*idx;
+	u32		block_size;
+	u64		off;		/* where next block goes in pi */
+
+	char		*buf;		/* raw pages of the current block */
+	unsigned long	fill;
+	char		*cbuf;
+	int		cbuf_size;
+};
+
+struct comp_block {
+	u64		off;
+	u32		len;
+	u32		size;
+};
+
+struct comp_reader {
+	struct cr_img	*pi;
+	u32		block_size;
+
+	struct comp_block *blocks;
+	unsigned long	nr_blocks;
+
+	long		cached;		/* block sitting in buf */
+	char		*buf;
+	char		*cbuf;
+};
+
+#ifdef CONFIG_HAS_LZ4
+static int comp_bound(u32 size)
+{
+	return LZ4_compressBound(size);
+}
+
+static int compress_block(char *src, int size, char *dst, int dst_size)
+{
+	return LZ4_compress_default(src, dst, size, dst_size);
+}
+
+static int decompress_block(char *src, int len, char *dst, int size)
+{
+	return LZ4_decompress_safe(src, dst, len, size);
+}
+#else
+static int comp_bound(u32 size)
+{
+	pr_err("CRIU is built without LZ4 support\n");
+	return -1;
+}
+
+static int compress_block(char *src, int size, char *dst, int dst_size)
+{
+	return -1;
+}
+
+static int decompress_block(char *src, int len, char *dst, int size)
+{
+	return -1;
+}
+#endif
+
+struct comp_writer *comp_writer_open(int dfd, u32 pages_id,
+		u32 block_size, struct cr_img *pi)
+{
+	struct comp_writer *cw;
+
+	cw = xzalloc(sizeof(*cw));
+	if (!cw)
+		return NULL;
+
+	cw->pi = pi;
+	cw->block_size = block_size;
+	cw->cbuf_size = comp_bound(block_size);
+	if (cw->cbuf_size <= 0)
+		goto err;
+
+	cw->buf = xmalloc(block_size);
+	cw->cbuf = xmalloc(cw->cbuf_size);
+	if (!cw->buf || !cw->cbuf)
+		goto err;
+
+	cw->idx = open_image_at(dfd, CR_FD_PAGES_INDEX, O_DUMP, pages_id);
+	if (!cw->idx)
+		goto err;
+
+	return cw;
+
+err:
+	xfree(cw->buf);
+	xfree(cw->cbuf);
+	xfree(cw);
+	return NULL;
+}
+
+static int comp_writer_flush(struct comp_writer *cw)
+{
+	PagesBlockEntry pbe = PAGES_BLOCK_ENTRY__INIT;
+	char *data;
+	int len;
+
+	if (!cw->fill)
+		return 0;
+
+	len = compress_block(cw->buf, cw->fill, cw->cbuf, cw->cbuf_size);
+	if (len > 0 && len < cw->fill)
+		data = cw->cbuf;
+	else {
+		/* Incompressible, keep it raw */
+		data = cw->buf;
+		len = cw->fill;
+	}
+
+	if (write_img_buf(cw->pi, data, len))
+		return -1;
+
+	pbe.off = cw->off;
+	pbe.len = len;
+	pbe.size = cw->fill;
+	if (pb_write_one(cw->idx, &pbe, PB_PAGES_BLOCK) < 0)
+		return -1;
+
+	pr_debug("Block %#"PRIx64" %lu -> %d\n", cw->off, cw->fill, len);
+
+	cw->off += len;
+	cw->fill = 0;
+	return 0;
+}
+
+int comp_writer_splice(struct comp_writer *cw, int p, unsigned long len)
+{
+	while (len) {
+		unsigned long chunk;
+		ssize_t ret;
+
+		chunk = min(len, cw->block_size - cw->fill);
+		ret = read(p, cw->buf + cw->fill, chunk);
+		if (ret <= 0) {
+			pr_perror("Can't read pages from pipe (%zd)", ret);
+			return -1;
+		}
+
+		cw->fill += ret;
+		len -= ret;
+
+		if (cw->fill == cw->block_size && comp_writer_flush(cw))
+			return -1;
+	}
+
+	return 0;
+}
+
+int comp_writer_close(struct comp_writer *cw)
+{
+	int ret;
+
+	/* Only the last block may be short, see comp_reader_pread */
+	ret = comp_writer_flush(cw);
+
+	close_image(cw->idx);
+	xfree(cw->buf);
+	xfree(cw->cbuf);
+	xfree(cw);
+
+	return ret;
+}
+
+struct comp_reader *comp_reader_open(int dfd, u32 pages_id,
+		u32 block_size, struct cr_img *pi)
+{
+	struct comp_reader *cr;
+	struct cr_img *idx;
+	int cbuf_size;
+
+	cbuf_size = comp_bound(block_size);
+	if (cbuf_size <= 0)
+		return NULL;
+
+	cr = xzalloc(sizeof(*cr));
+	if (!cr)
+		return NULL;
+
+	cr->pi = pi;
+	cr->block_size = block_size;
+	cr->cached = -1;
+
+	cr->buf = xmalloc(block_size);
+	cr->cbuf = xmalloc(cbuf_size);
+	if (!cr->buf || !cr->cbuf)
+		goto err;
+
+	idx = open_image_at(dfd, CR_FD_PAGES_INDEX, O_RSTR, pages_id);
+	if (!idx)
+		goto err;
+
+	while (1) {
+		PagesBlockEntry *pbe;
+		struct comp_block *b;
+		int ret;
+
+		ret = pb_read_one_eof(idx, &pbe, PB_PAGES_BLOCK);
+		if (ret <= 0) {
+			close_image(idx);
+			if (ret < 0)
+				goto err;
+			break;
+		}
+
+		if (pbe->len > cbuf_size || pbe->size > block_size) {
+			pr_err("Corrupted block %lu (%u/%u)\n",
+					cr->nr_blocks, pbe->len, pbe->size);
+			pages_block_entry__free_unpacked(pbe, NULL);
+			close_image(idx);
+			goto err;
+		}
+
+		if (xrealloc_safe(&cr->blocks, (cr->nr_blocks + 1) * sizeof(*b))) {
+			pages_block_entry__free_unpacked(pbe, NULL);
+			close_image(idx);
+			goto err;
+		}
+
+		b = &cr->blocks[cr->nr_blocks++];
+		b->off = pbe->off;
+		b->len = pbe->len;
+		b->size = pbe->size;
+		pages_block_entry__free_unpacked(pbe, NULL);
+	}
+
+	pr_debug("Loaded %lu blocks of %u bytes\n", cr->nr_blocks, block_size);
+	return cr;
+
+err:
+	comp_reader_close(cr);
+	return NULL;
+}
+
+static int comp_reader_load(struct comp_reader *cr, unsigned long nr)
+{
+	struct comp_block *b = &cr->blocks[nr];
+	ssize_t ret;
+
+	if (cr->cached == nr)
+		return 0;
+
+	cr->cached = -1;
+
+	ret = pread(img_raw_fd(cr->pi), b->len == b->size ? cr->buf : cr->cbuf,
+			b->len, b->off + img_raw_off(cr->pi));
+	if (ret != b->len) {
+		pr_perror("Can't read block %lu (%zd)", nr, ret);
+		return -1;
+	}
+
+	if (b->len != b->size) {
+		ret = decompress_block(cr->cbuf, b->len, cr->buf, b->size);
+		if (ret != b->size) {
+			pr_err("Can't decompress block %lu (%zd)\n", nr, ret);
+			return -1;
+		}
+	}
+
+	cr->cached = nr;
+	return 0;
+}
+
+/*
+ * Reads len bytes of pages from the logical (i.e. uncompressed)
+ * offset off in the pages image.
+ */
+int comp_reader_pread(struct comp_reader *cr, void *buf, unsigned long len, u64 off)
+{
+	while (len) {
+		unsigned long nr, boff, chunk;
+		struct comp_block *b;
+
+		nr = off / cr->block_size;
+		boff = off % cr->block_size;
+		if (nr >= cr->nr_blocks) {
+			pr_err("Offset %#"PRIx64" is beyond the image\n", off);
+			return -1;
+		}
+
+		b = &cr->blocks[nr];
+		if (boff >= b->size) {
+			pr_err("Offset %#"PRIx64" is beyond block %lu\n", off, nr);
+			return -1;
+		}
+
+		if (comp_reader_load(cr, nr))
+			return -1;
+
+		chunk = min(len, b->size - boff);
+		memcpy(buf, cr->buf + boff, chunk);
+
+		buf += chunk;
+		off += chunk;
+		len -= chunk;
+	}
+
+	return 0;
+}
+
+void comp_reader_close(struct comp_reader *cr)
+{
+	xfree(cr->blocks);
+	xfree(cr->buf);
+	xfree(cr->cbuf);
+	xfree(cr);
+}
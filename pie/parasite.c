@@ -159,6 +159,16 @@ static int dump_thread_common(struct parasite_dump_thread *ti)
 		goto out;
 
 	ret = sys_prctl(PR_GET_PDEATHSIG, (unsigned long)&ti->pdeath_sig, 0, 0, 0);
+	if (ret)
+		goto out;
+
+	ret = sys_get_mempolicy(&ti->mempolicy, (unsigned long *)ti->mempolicy_nodes,
+				NUMA_MAX_NODES, 0, 0);
+	if (ret == -ENOSYS) {
+		/* No NUMA in kernel */
+		ti->mempolicy = 0;
+		ret = 0;
+	}
 out:
 	return ret;
 }
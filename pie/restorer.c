@@ -19,6 +19,9 @@
 #include "asm/types.h"
 #include "syscall.h"
 #include "config.h"
+#ifdef CONFIG_HAS_UFFD
+#include <linux/userfaultfd.h>
+#endif
 #include "prctl.h"
 #include "log.h"
 #include "util.h"
@@ -298,6 +301,21 @@ static void restore_sched_info(struct rst_sched_param *p)
 	sys_sched_setscheduler(0, p->policy, &parm);
 }
 
+static void restore_mempolicy(struct thread_restore_args *args)
+{
+	int ret;
+
+	if (!args->mempolicy)
+		return;
+
+	ret = sys_set_mempolicy(args->mempolicy,
+				(unsigned long *)args->mempolicy_nodes,
+				NUMA_MAX_NODES + 1);
+	if (ret)
+		pr_warn("Can't restore memory policy %d: %d\n",
+				args->mempolicy, ret);
+}
+
 static void restore_rlims(struct task_restore_args *ta)
 {
 	int r;
@@ -399,6 +417,7 @@ static int restore_thread_common(struct rt_sigframe *sigframe,
 	}
 
 	restore_sched_info(&args->sp);
+	restore_mempolicy(args);
 
 	if (restore_nonsigframe_gpregs(&args->gpregs))
 		return -1;
@@ -631,6 +650,44 @@ static int vma_remap(unsigned long src, unsigned long dst, unsigned long len)
 	return 0;
 }
 
+/*
+ * Lazy VMAs are empty at this point, the lazy-pages daemon fills
+ * them on faults. Registration doesn't survive mremap, so it's
+ * done after the VMAs are put in place.
+ */
+static int enable_uffd(struct task_restore_args *args)
+{
+#ifdef CONFIG_HAS_UFFD
+	int i;
+
+	for (i = 0; i < args->vmas_n; i++) {
+		VmaEntry *vma_entry = args->vmas + i;
+		struct uffdio_register reg;
+		long ret;
+
+		if (!vma_entry_is_private(vma_entry, args->task_size))
+			continue;
+		if (!vma_entry_can_be_lazy(vma_entry))
+			continue;
+
+		reg.range.start = vma_entry->start;
+		reg.range.len = vma_entry_len(vma_entry);
+		reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+
+		ret = sys_ioctl(args->uffd, UFFDIO_REGISTER, (unsigned long)&reg);
+		if (ret) {
+			pr_err("Can't register %"PRIx64"-%"PRIx64" with uffd: %ld\n",
+					vma_entry->start, vma_entry->end, ret);
+			return -1;
+		}
+	}
+#endif
+
+	/* The daemon has its own copy */
+	sys_close(args->uffd);
+	return 0;
+}
+
 static int timerfd_arm(struct task_restore_args *args)
 {
 	int i;
@@ -951,6 +1008,9 @@ long __export_restore_task(struct task_restore_args *args)
 		}
 	}
 
+	if (args->uffd >= 0 && enable_uffd(args))
+		goto core_restore_end;
+
 #ifdef CONFIG_VDSO
 	/*
 	 * Proxify vDSO.
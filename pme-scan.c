@@ -0,0 +1,94 @@
+#include <stdbool.h>
+
+#include "asm/int.h"
+#include "mem.h"
+#include "pme-scan.h"
+
+#ifdef CONFIG_X86_64
+#include <immintrin.h>
+#endif
+
+#define PME_MAPPED	(PME_PRESENT | PME_SWAP)
+
+/* How many entries are checked at once in the vector loops */
+#define PME_SCAN_STEP	16
+
+static unsigned long pme_find_mapped_scalar(const u64 *map, unsigned long nr)
+{
+	unsigned long i = 0;
+
+	for (; i + 4 <= nr; i += 4)
+		if ((map[i] | map[i + 1] | map[i + 2] | map[i + 3]) & PME_MAPPED)
+			break;
+
+	for (; i < nr; i++)
+		if (map[i] & PME_MAPPED)
+			break;
+
+	return i;
+}
+
+#ifdef CONFIG_X86_64
+static unsigned long pme_find_mapped_sse2(const u64 *map, unsigned long nr)
+{
+	const __m128i mask = _mm_set1_epi64x(PME_MAPPED);
+	const __m128i zero = _mm_setzero_si128();
+	unsigned long i;
+
+	for (i = 0; i + PME_SCAN_STEP <= nr; i += PME_SCAN_STEP) {
+		const __m128i *v = (const __m128i *)(map + i);
+		__m128i acc;
+		int j;
+
+		acc = _mm_loadu_si128(v);
+		for (j = 1; j < PME_SCAN_STEP / 2; j++)
+			acc = _mm_or_si128(acc, _mm_loadu_si128(v + j));
+
+		acc = _mm_cmpeq_epi32(_mm_and_si128(acc, mask), zero);
+		if (_mm_movemask_epi8(acc) != 0xffff)
+			break;
+	}
+
+	return i + pme_find_mapped_scalar(map + i, nr - i);
+}
+
+static __attribute__((target("avx2")))
+unsigned long pme_find_mapped_avx2(const u64 *map, unsigned long nr)
+{
+	const __m256i mask = _mm256_set1_epi64x(PME_MAPPED);
+	unsigned long i;
+
+	for (i = 0; i + PME_SCAN_STEP <= nr; i += PME_SCAN_STEP) {
+		const __m256i *v = (const __m256i *)(map + i);
+		__m256i acc;
+		int j;
+
+		acc = _mm256_loadu_si256(v);
+		for (j = 1; j < PME_SCAN_STEP / 4; j++)
+			acc = _mm256_or_si256(acc, _mm256_loadu_si256(v + j));
+
+		if (!_mm256_testz_si256(acc, mask))
+			break;
+	}
+
+	return i + pme_find_mapped_scalar(map + i, nr - i);
+}
+#endif
+
+static unsigned long (*pme_find_mapped_fn)(const u64 *map, unsigned long nr);
+
+unsigned long pme_find_mapped(const u64 *map, unsigned long nr)
+{
+	if (!pme_find_mapped_fn) {
+		pme_find_mapped_fn = pme_find_mapped_scalar;
+#ifdef CONFIG_X86_64
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+			pme_find_mapped_fn = pme_find_mapped_avx2;
+		else
+			pme_find_mapped_fn = pme_find_mapped_sse2;
+#endif
+	}
+
+	return pme_find_mapped_fn(map, nr);
+}
@@ -9,6 +9,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <linux/fs.h>
+#include <linux/mempolicy.h>
 
 #include "asm/types.h"
 #include "list.h"
@@ -554,6 +555,17 @@ int parse_smaps(pid_t pid, struct vm_area_list *vma_area_list)
 				 */
 				vma_area = NULL;
 				goto err;
+			} else if (!strncmp(str, "AnonHugePages:", 14)) {
+				unsigned long kb;
+
+				BUG_ON(!vma_area);
+				if (sscanf(str + 14, "%lu", &kb) != 1) {
+					pr_err("Can't parse: %s\n", str);
+					goto err;
+				}
+				if (kb && vma_area_is(vma_area, VMA_ANON_PRIVATE))
+					vma_area->e->status |= VMA_AREA_THP;
+				continue;
 			} else if (!strncmp(str, "VmFlags: ", 9)) {
 				BUG_ON(!vma_area);
 				if (parse_vmflags(&str[9], vma_area))
@@ -623,6 +635,200 @@ err_n:
 
 }
 
+#ifndef MPOL_F_NUMA_BALANCING
+#define MPOL_F_NUMA_BALANCING	(1 << 13)
+#endif
+
+/* Modes as numa_maps names them, values from linux/mempolicy.h */
+static const struct {
+	const char	*name;
+	int		mode;
+} mpol_modes[] = {
+	/* Goes before "prefer" it starts with */
+	{ "prefer (many)",		5 },	/* MPOL_PREFERRED_MANY */
+	{ "weighted interleave",	6 },	/* MPOL_WEIGHTED_INTERLEAVE */
+	{ "default",			MPOL_DEFAULT },
+	{ "prefer",			MPOL_PREFERRED },
+	{ "bind",			MPOL_BIND },
+	{ "interleave",			MPOL_INTERLEAVE },
+	{ "local",			MPOL_LOCAL },
+};
+
+static int parse_mpol(char **str, VmaEntry *e)
+{
+	u64 nodes[NUMA_MAX_NODES / 64] = {};
+	unsigned int i, n;
+	char *s = *str;
+	int mode;
+
+	for (i = 0; i < ARRAY_SIZE(mpol_modes); i++) {
+		size_t len = strlen(mpol_modes[i].name);
+
+		if (!strncmp(s, mpol_modes[i].name, len) && strchr(" =:", s[len])) {
+			s += len;
+			break;
+		}
+	}
+
+	if (i == ARRAY_SIZE(mpol_modes))
+		return -1;
+
+	mode = mpol_modes[i].mode;
+
+	if (*s == '=') {
+		do {
+			s++;
+			if (!strncmp(s, "static", 6)) {
+				mode |= MPOL_F_STATIC_NODES;
+				s += 6;
+			} else if (!strncmp(s, "relative", 8)) {
+				mode |= MPOL_F_RELATIVE_NODES;
+				s += 8;
+			} else if (!strncmp(s, "balancing", 9)) {
+				mode |= MPOL_F_NUMA_BALANCING;
+				s += 9;
+			} else
+				return -1;
+		} while (*s == '|');
+	}
+
+	if (*s == ':') {
+		do {
+			unsigned long a, b;
+
+			a = b = strtoul(s + 1, &s, 10);
+			if (*s == '-')
+				b = strtoul(s + 1, &s, 10);
+			if (a > b || b >= NUMA_MAX_NODES)
+				return -1;
+
+			for (; a <= b; a++)
+				nodes[a / 64] |= 1ULL << (a % 64);
+		} while (*s == ',');
+	}
+
+	*str = s;
+
+	if (mode == MPOL_DEFAULT)
+		return 0;
+
+	e->has_mpol_mode = true;
+	e->mpol_mode = mode;
+
+	for (n = ARRAY_SIZE(nodes); n && !nodes[n - 1]; n--)
+		;
+	if (!n)
+		return 0;
+
+	e->mpol_nodes = xmalloc(n * sizeof(u64));
+	if (!e->mpol_nodes)
+		return -1;
+
+	memcpy(e->mpol_nodes, nodes, n * sizeof(u64));
+	e->n_mpol_nodes = n;
+	return 0;
+}
+
+static int parse_numa_pages(char *s, VmaEntry *e)
+{
+	u64 pages[NUMA_MAX_NODES] = {};
+	unsigned long node, n = 0;
+
+	while (*s) {
+		if (*s == ' ') {
+			s++;
+			continue;
+		}
+
+		if (s[0] == 'N' && isdigit(s[1])) {
+			node = strtoul(s + 1, &s, 10);
+			if (*s != '=' || node >= NUMA_MAX_NODES)
+				return -1;
+
+			pages[node] = strtoull(s + 1, &s, 10);
+			if (node >= n)
+				n = node + 1;
+		} else {
+			/* anon=, dirty=, file= and the like */
+			while (*s && *s != ' ')
+				s++;
+		}
+	}
+
+	if (!n)
+		return 0;
+
+	e->numa_pages = xmalloc(n * sizeof(u64));
+	if (!e->numa_pages)
+		return -1;
+
+	memcpy(e->numa_pages, pages, n * sizeof(u64));
+	e->n_numa_pages = n;
+	return 0;
+}
+
+/*
+ * Memory policies and the nodes pages are on, for private areas.
+ * Lines go in the same order as in smaps and look like
+ *
+ *   7f2d1c000000 bind=static:0-1 anon=512 dirty=512 N0=256 N1=256
+ *
+ * Areas without a policy of their own show the task's one here.
+ */
+int parse_numa_maps(pid_t pid, struct vm_area_list *vma_area_list)
+{
+	struct vma_area *vma;
+	struct bfd f;
+	int ret = -1;
+
+	/* Nothing to tell on a single node */
+	if (access("/sys/devices/system/node/node1", F_OK))
+		return 0;
+
+	f.fd = open_proc(pid, "numa_maps");
+	if (f.fd < 0)
+		return -1;
+
+	if (bfdopenr(&f))
+		return -1;
+
+	vma = list_first_entry(&vma_area_list->h, struct vma_area, list);
+
+	while (1) {
+		unsigned long start;
+		char *str, *s;
+
+		str = breadline(&f);
+		if (IS_ERR(str))
+			goto err;
+		if (!str)
+			break;
+
+		start = strtoul(str, &s, 16);
+		while (&vma->list != &vma_area_list->h && vma->e->start < start)
+			vma = list_entry(vma->list.next, struct vma_area, list);
+		if (&vma->list == &vma_area_list->h)
+			break;
+
+		if (vma->e->start != start ||
+		    !vma_area_is_private(vma, kdat.task_size))
+			continue;
+
+		if (*s == ' ')
+			s++;
+
+		if (parse_mpol(&s, vma->e) || parse_numa_pages(s, vma->e)) {
+			pr_err("Can't parse numa_maps of %d at %lx\n", pid, start);
+			goto err;
+		}
+	}
+
+	ret = 0;
+err:
+	bclose(&f);
+	return ret;
+}
+
 int parse_pid_stat(pid_t pid, struct proc_pid_stat *s)
 {
 	char *tok, *p;
@@ -935,6 +1141,48 @@ err_parse:
 	return ret;
 }
 
+/*
+ * The pid in the innermost pid namespace is the last one in NSpid.
+ * Returns 1 if the kernel doesn't report NSpid (older than 4.1).
+ */
+int parse_pid_nspid(pid_t pid, pid_t *vpid)
+{
+	struct bfd f;
+	char *str;
+	int ret = 1;
+
+	f.fd = open_proc(pid, "status");
+	if (f.fd < 0)
+		return -1;
+
+	if (bfdopenr(&f))
+		return -1;
+
+	while (1) {
+		str = breadline(&f);
+		if (str == NULL)
+			break;
+		if (IS_ERR(str)) {
+			ret = -1;
+			break;
+		}
+
+		if (!strncmp(str, "NSpid:", 6)) {
+			char *last = strrchr(str, '\t');
+
+			if (!last || sscanf(last, "%d", vpid) != 1) {
+				pr_err("Unable to parse: %s\n", str);
+				ret = -1;
+			} else
+				ret = 0;
+			break;
+		}
+	}
+
+	bclose(&f);
+	return ret;
+}
+
 struct opt2flag {
 	char *opt;
 	unsigned flag;
@@ -637,55 +637,158 @@ err:
 	return ret;
 }
 
-int collect_image(struct collect_image_info *cinfo)
+/*
+ * Objects that live till the end of restore, e.g. the collected
+ * ones, are unpacked into an arena. There are millions of them on
+ * big trees, and the memory is never given back anyway.
+ */
+#define PB_ARENA_CHUNK		(256 << 10)
+
+static struct {
+	char		*cur;
+	size_t		left;
+} pb_arena;
+
+static void *pb_arena_alloc(void *data, size_t size)
 {
-	int ret;
-	struct cr_img *img;
-	void *(*o_alloc)(size_t size) = malloc;
-	void (*o_free)(void *ptr) = free;
+	void *ptr;
 
-	pr_info("Collecting %d/%d (flags %x)\n",
-			cinfo->fd_type, cinfo->pb_type, cinfo->flags);
+	size = round_up(size, sizeof(u64));
+	if (size > pb_arena.left) {
+		if (size > PB_ARENA_CHUNK / 4)
+			return xmalloc(size);
 
-	img = open_image(cinfo->fd_type, O_RSTR);
-	if (!img)
-		return -1;
+		pb_arena.cur = xmalloc(PB_ARENA_CHUNK);
+		if (!pb_arena.cur) {
+			pb_arena.left = 0;
+			return NULL;
+		}
 
-	cinfo->flags |= COLLECT_HAPPENED;
-	if (cinfo->flags & COLLECT_SHARED) {
-		o_alloc = shmalloc;
-		o_free = shfree_last;
+		pb_arena.left = PB_ARENA_CHUNK;
 	}
 
-	while (1) {
+	ptr = pb_arena.cur;
+	pb_arena.cur += size;
+	pb_arena.left -= size;
+	return ptr;
+}
+
+static void pb_arena_free(void *data, void *ptr)
+{
+}
+
+static ProtobufCAllocator pb_arena_allocator = {
+	.alloc		= pb_arena_alloc,
+	.free		= pb_arena_free,
+};
+
+int pb_read_all(struct cr_img *img, int type, bool keep,
+		int (*fn)(void *obj, void *arg), void *arg)
+{
+	void *alloc = keep ? &pb_arena_allocator : NULL;
+	size_t pos = 0;
+	ssize_t len;
+	void *buf;
+	int ret = 0;
+
+	if (!cr_pb_descs[type].pb_desc) {
+		pr_err("Wrong object requested %d on %s\n",
+			type, image_name(img));
+		return -1;
+	}
+
+	if (empty_image(img))
+		return 0;
+
+	len = bread_all(&img->_x, &buf);
+	if (len < 0)
+		return -1;
+
+	while (pos < len) {
 		void *obj;
-		ProtobufCMessage *msg;
+		u32 size;
 
-		if (cinfo->priv_size) {
+		if (len - pos < sizeof(size)) {
+			pr_err("Unexpected EOF on %s\n", image_name(img));
 			ret = -1;
-			obj = o_alloc(cinfo->priv_size);
-			if (!obj)
-				break;
-		} else
-			obj = NULL;
-
-		ret = pb_read_one_eof(img, &msg, cinfo->pb_type);
-		if (ret <= 0) {
-			o_free(obj);
 			break;
 		}
 
-		ret = cinfo->collect(obj, msg);
-		if (ret < 0) {
-			o_free(obj);
-			cr_pb_descs[cinfo->pb_type].free(msg, NULL);
+		memcpy(&size, buf + pos, sizeof(size));
+		pos += sizeof(size);
+
+		if (size > len - pos) {
+			pr_err("Read %zu bytes while %u expected from %s\n",
+				len - pos, size, image_name(img));
+			ret = -1;
 			break;
 		}
 
-		if (!cinfo->priv_size)
-			cr_pb_descs[cinfo->pb_type].free(msg, NULL);
+		obj = cr_pb_descs[type].unpack(alloc, size, buf + pos);
+		if (!obj) {
+			pr_err("Failed unpacking object at %zu from %s\n",
+				pos, image_name(img));
+			ret = -1;
+			break;
+		}
+
+		pos += size;
+
+		ret = fn(obj, arg);
+		if (!keep)
+			cr_pb_descs[type].free(obj, NULL);
+		if (ret < 0)
+			break;
+	}
+
+	xfree(buf);
+	return ret < 0 ? -1 : 0;
+}
+
+static int collect_one(void *msg, void *arg)
+{
+	struct collect_image_info *cinfo = arg;
+	void *(*o_alloc)(size_t size) = malloc;
+	void (*o_free)(void *ptr) = free;
+	void *obj = NULL;
+	int ret;
+
+	if (cinfo->flags & COLLECT_SHARED) {
+		o_alloc = shmalloc;
+		o_free = shfree_last;
+	}
+
+	if (cinfo->priv_size) {
+		obj = o_alloc(cinfo->priv_size);
+		if (!obj)
+			return -1;
 	}
 
+	ret = cinfo->collect(obj, msg);
+	if (ret < 0)
+		o_free(obj);
+
+	return ret;
+}
+
+int collect_image(struct collect_image_info *cinfo)
+{
+	int ret;
+	struct cr_img *img;
+
+	pr_info("Collecting %d/%d (flags %x)\n",
+			cinfo->fd_type, cinfo->pb_type, cinfo->flags);
+
+	img = open_image(cinfo->fd_type, O_RSTR);
+	if (!img)
+		return -1;
+
+	cinfo->flags |= COLLECT_HAPPENED;
+
+	/* Objects without priv are not kept by collect callbacks */
+	ret = pb_read_all(img, cinfo->pb_type, cinfo->priv_size != 0,
+			collect_one, cinfo);
+
 	close_image(img);
 	pr_debug(" `- ... done\n");
 	return ret;
@@ -21,6 +21,8 @@ void core_entry_free(CoreEntry *core)
 {
 	if (core->tc && core->tc->timers)
 		xfree(core->tc->timers->posix);
+	if (core->thread_core)
+		xfree(core->thread_core->mempolicy_nodes);
 	arch_free_thread_info(core);
 	xfree(core);
 }
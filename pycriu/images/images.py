@@ -161,12 +161,42 @@ class entry_handler:
 		return entries
 
 # Special handler for pagemap.img
+#
+# With pagemap_head.rec_size set the head is followed by fixed-size
+# records of this layout (struct pagemap_rec in criu), they are shown
+# as pagemap_entry-s anyway.
+pagemap_rec_fmt = '=QQII'	# vaddr, off, nr_pages, flags
+pagemap_rec_size = struct.calcsize(pagemap_rec_fmt)
+PE_IN_PARENT = 0x1
+PE_ZERO = 0x2
+
 class pagemap_handler:
 	"""
 	Special entry handler for pagemap.img, which is unique in a way
 	that it has a header of pagemap_head type followed by entries
 	of pagemap_entry type.
 	"""
+	def load_recs(self, f, rec_size, pretty):
+		entries = []
+
+		while True:
+			buf = f.read(rec_size)
+			if buf == '':
+				break
+			vaddr, off, nr_pages, flags = struct.unpack(pagemap_rec_fmt,
+					buf[:pagemap_rec_size])
+			pb = pagemap_entry()
+			pb.vaddr = vaddr
+			pb.nr_pages = nr_pages
+			pb.off = off
+			if flags & PE_IN_PARENT:
+				pb.in_parent = True
+			if flags & PE_ZERO:
+				pb.zero = True
+			entries.append(pb2dict.pb2dict(pb, pretty))
+
+		return entries
+
 	def load(self, f, pretty = False):
 		entries = []
 
@@ -179,6 +209,9 @@ class pagemap_handler:
 			pb.ParseFromString(f.read(size))
 			entries.append(pb2dict.pb2dict(pb, pretty))
 
+			if len(entries) == 1 and pb.rec_size:
+				return entries + self.load_recs(f, pb.rec_size, pretty)
+
 			pb = pagemap_entry()
 
 		return entries
@@ -187,6 +220,30 @@ class pagemap_handler:
 		f = io.BytesIO(s)
 		return self.load(f, pretty)
 
+	def dump_recs(self, entries, f, rec_size):
+		# Entries w/o offsets have pages one after another
+		pages_off = 0
+
+		for item in entries:
+			pb = pagemap_entry()
+			pb2dict.dict2pb(item, pb)
+			flags = 0
+			if pb.in_parent:
+				flags |= PE_IN_PARENT
+			if pb.zero:
+				flags |= PE_ZERO
+
+			if pb.HasField('off'):
+				off = pb.off
+			else:
+				off = pages_off
+				if not flags:
+					pages_off += pb.nr_pages * 4096
+
+			buf = struct.pack(pagemap_rec_fmt, pb.vaddr, off,
+					pb.nr_pages, flags)
+			f.write(buf + '\0' * (rec_size - len(buf)))
+
 	def dump(self, entries, f):
 		pb = pagemap_head()
 		for item in entries:
@@ -196,6 +253,10 @@ class pagemap_handler:
 			f.write(struct.pack('i', size))
 			f.write(pb_str)
 
+			if item is entries[0] and pb.rec_size:
+				self.dump_recs(entries[1:], f, pb.rec_size)
+				break
+
 			pb = pagemap_entry()
 
 	def dumps(self, entries):
@@ -204,7 +265,16 @@ class pagemap_handler:
 		return f.read()
 
 	def count(self, f):
-		return entry_handler(None).count(f) - 1
+		buf = f.read(4)
+		if buf == '':
+			return 0
+		size, = struct.unpack('i', buf)
+		pb = pagemap_head()
+		pb.ParseFromString(f.read(size))
+		if pb.rec_size:
+			return len(f.read()) / pb.rec_size
+
+		return entry_handler(None).count(f)
 
 
 # In following extra handlers we use base64 encoding
@@ -349,6 +419,8 @@ handlers = {
 	'TCP_STREAM'		: entry_handler(tcp_stream_entry, tcp_stream_extra_handler()),
 	'STATS'			: entry_handler(stats_entry),
 	'PAGEMAP'		: pagemap_handler(), # Special one
+	'PAGES_INDEX'		: entry_handler(pages_block_entry),
+	'HOTMAP'		: entry_handler(hot_range_entry),
 	'PSTREE'		: entry_handler(pstree_entry),
 	'REG_FILES'		: entry_handler(reg_file_entry),
 	'NS_FILES'		: entry_handler(ns_file_entry),
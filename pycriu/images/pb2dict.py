@@ -87,6 +87,7 @@ mmap_status_map = [
 	('VMA_AREA_SOCKET',	1 << 11),
 	('VMA_AREA_VVAR',	1 << 12),
 	('VMA_AREA_AIORING',	1 << 13),
+	('VMA_AREA_THP',	1 << 14),
 
 	('VMA_UNSUPP',		1 << 31),
 ];
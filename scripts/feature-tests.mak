@@ -39,6 +39,15 @@ int main(void)
 }
 endef
 
+define LZ4_TEST
+#include <lz4.h>
+
+int main(void)
+{
+	return LZ4_compressBound(0);
+}
+endef
+
 define STRLCPY_TEST
 
 #include <string.h>
@@ -80,6 +89,19 @@ int main(void)
 
 endef
 
+define UFFD_TEST
+
+#include <linux/userfaultfd.h>
+
+int main(void)
+{
+	struct uffdio_copy uc = {};
+
+	return UFFDIO_COPY + uc.mode;
+}
+
+endef
+
 define SETPROCTITLE_INIT_TEST
 
 #include <bsd/unistd.h>
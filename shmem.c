@@ -147,15 +147,13 @@ static int shmem_wait_and_open(int pid, struct shmem_info *si)
 
 static int restore_shmem_content(void *addr, struct shmem_info *si)
 {
-	int ret = 0, fd_pg;
+	int ret = 0;
 	struct page_read pr;
-	unsigned long off_real;
 
-	ret = open_page_read(si->shmid, &pr, PR_SHMEM);
+	ret = open_page_read(si->shmid, &pr, PR_SHMEM | PR_MMAP);
 	if (ret <= 0)
 		return -1;
 
-	fd_pg = img_raw_fd(pr.pi);
 	while (1) {
 		unsigned long vaddr;
 		unsigned nr_pages;
@@ -171,25 +169,17 @@ static int restore_shmem_content(void *addr, struct shmem_info *si)
 		if (vaddr + nr_pages * PAGE_SIZE > si->size)
 			break;
 
-		off_real = lseek(fd_pg, 0, SEEK_CUR);
-
-		ret = read(fd_pg, addr + vaddr, nr_pages * PAGE_SIZE);
-		if (ret != nr_pages * PAGE_SIZE) {
-			ret = -1;
+		/* This reads from compressed images too and punches on auto-dedup */
+		ret = pr.read_pages(&pr, vaddr, nr_pages, addr + vaddr, PR_ASYNC);
+		if (ret < 0)
 			break;
-		}
-
-		if (opts.auto_dedup) {
-			ret = punch_hole(&pr, off_real, nr_pages * PAGE_SIZE, false);
-			if (ret == -1) {
-				break;
-			}
-		}
 
 		if (pr.put_pagemap)
 			pr.put_pagemap(&pr);
 	}
 
+	if (ret >= 0 && pr.sync(&pr))
+		ret = -1;
 	pr.close(&pr);
 	return ret;
 }
@@ -1,6 +1,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/time.h>
+#include <string.h>
 #include "asm/atomic.h"
 #include "protobuf.h"
 #include "stats.h"
@@ -91,6 +92,48 @@ void timing_stop(int t)
 	timeval_accumulate(&tm->start, &now, &tm->total);
 }
 
+static void timeval_add(const struct timeval *from, struct timeval *res)
+{
+	res->tv_sec += from->tv_sec;
+	res->tv_usec += from->tv_usec;
+	if (res->tv_usec >= USEC_PER_SEC) {
+		res->tv_usec -= USEC_PER_SEC;
+		res->tv_sec += 1;
+	}
+}
+
+/*
+ * Dump workers (see dump-jobs.c) run in forked copies of criu, so
+ * their counters and memory timings are collected from scratch in
+ * the child and then handed back to the parent to be merged into
+ * the global stats.
+ */
+void dump_stats_part_reset(void)
+{
+	BUG_ON(dstats == NULL);
+	memset(dstats, 0, sizeof(*dstats));
+}
+
+void dump_stats_part_get(struct dump_stats_part *part)
+{
+	BUG_ON(dstats == NULL);
+	memcpy(part->counts, dstats->counts, sizeof(part->counts));
+	part->frozen = dstats->timings[TIME_FROZEN].total;
+	part->memdump = dstats->timings[TIME_MEMDUMP].total;
+	part->memwrite = dstats->timings[TIME_MEMWRITE].total;
+}
+
+void dump_stats_part_add(const struct dump_stats_part *part)
+{
+	int i;
+
+	BUG_ON(dstats == NULL);
+	for (i = 0; i < DUMP_CNT_NR_STATS; i++)
+		dstats->counts[i] += part->counts[i];
+	timeval_add(&part->memdump, &dstats->timings[TIME_MEMDUMP].total);
+	timeval_add(&part->memwrite, &dstats->timings[TIME_MEMWRITE].total);
+}
+
 static void encode_time(int t, u_int32_t *to)
 {
 	struct timing *tm;
@@ -121,6 +164,8 @@ void write_stats(int what)
 		ds_entry.pages_scanned = dstats->counts[CNT_PAGES_SCANNED];
 		ds_entry.pages_skipped_parent = dstats->counts[CNT_PAGES_SKIPPED_PARENT];
 		ds_entry.pages_written = dstats->counts[CNT_PAGES_WRITTEN];
+		ds_entry.has_pages_zero = true;
+		ds_entry.pages_zero = dstats->counts[CNT_PAGES_ZERO];
 
 		name = "dump";
 	} else if (what == RESTORE_STATS) {
@@ -130,9 +175,13 @@ void write_stats(int what)
 		rs_entry.pages_skipped_cow = atomic_read(&rstats->counts[CNT_PAGES_SKIPPED_COW]);
 		rs_entry.has_pages_restored = true;
 		rs_entry.pages_restored = atomic_read(&rstats->counts[CNT_PAGES_RESTORED]);
+		rs_entry.has_page_reads_saved = true;
+		rs_entry.page_reads_saved = atomic_read(&rstats->counts[CNT_PAGE_READS_SAVED]);
 
 		encode_time(TIME_FORK, &rs_entry.forking_time);
 		encode_time(TIME_RESTORE, &rs_entry.restore_time);
+		rs_entry.has_prepare_time = true;
+		encode_time(TIME_PREPARE, &rs_entry.prepare_time);
 
 		name = "restore";
 	} else
@@ -0,0 +1,6 @@
+# Check iterative dump bounded by the downtime
+set -e
+source `dirname $0`/criu-lib.sh
+prep
+./test/zdtm.py run --all --report report --parallel 4 --downtime 100 -x maps04 || fail
+./test/zdtm.py run -t zdtm/live/static/mem-touch --report report -f h --downtime 100 || fail
@@ -0,0 +1,18 @@
+# Check the pages images formats
+set -e
+source `dirname $0`/criu-lib.sh
+prep
+mount_tmpfs_to_dump
+./test/zdtm.py run --all --report report --parallel 4 --compress -x maps04 || fail
+./test/zdtm.py run --all --report report --parallel 4 --pre 2 --compress -x maps04 || fail
+./test/zdtm.py run --all --report report --parallel 4 --page-dedup -x maps04 || fail
+./test/zdtm.py run --all --report report --parallel 4 --pre 2 --page-dedup -x maps04 || fail
+./test/zdtm.py run --all --report report --parallel 4 --skip-zero-pages -x maps04 || fail
+./test/zdtm.py run --all --report report --parallel 4 --pre 2 --skip-zero-pages -x maps04 || fail
+./test/zdtm.py run --all --report report --parallel 4 --pagemap-fixed -x maps04 || fail
+./test/zdtm.py run --all --report report --parallel 4 --pre 2 --pagemap-fixed -x maps04 || fail
+./test/zdtm.py run --all --report report --parallel 4 --dump-jobs 4 -x maps04 || fail
+./test/zdtm.py run --all --report report --parallel 4 --archive -x maps04 || fail
+
+# The archive and the page store are written at the same time
+./test/zdtm.py run --all --report report --parallel 4 -f ns --archive --page-dedup -x maps04 || fail
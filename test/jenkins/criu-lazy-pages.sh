@@ -0,0 +1,6 @@
+# Check restore with memory served by the lazy-pages daemon
+set -e
+source `dirname $0`/criu-lib.sh
+prep
+./test/zdtm.py run --all --report report --parallel 4 --lazy-pages -x maps04 || fail
+./test/zdtm.py run --all --report report --parallel 4 --pre 2 --hot-pages --lazy-pages -x maps04 || fail
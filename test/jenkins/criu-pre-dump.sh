@@ -5,3 +5,4 @@ prep
 mount_tmpfs_to_dump
 ./test/zdtm.py run --all --report report --parallel 4 --pre 3 -x 'maps04' || fail
 ./test/zdtm.py run --all --report report --parallel 4 --pre 3 --page-server -x 'maps04' || fail
+./test/zdtm.py run --all --report report --parallel 4 --pre 3 --pre-dump-mode read -x 'maps04' || fail
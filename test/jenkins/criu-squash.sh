@@ -0,0 +1,7 @@
+# Check restore from squashed pre-dump images
+set -e
+source `dirname $0`/criu-lib.sh
+prep
+mount_tmpfs_to_dump
+./test/zdtm.py run --all --report report --parallel 4 --pre 2 --squash -x maps04 || fail
+./test/zdtm.py run --all --report report --parallel 4 --pre 2 --squash --page-dedup -x maps04 || fail
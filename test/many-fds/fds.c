@@ -0,0 +1,55 @@
+/*
+ * Opens lots of files and sleeps to be dumped, so that restore
+ * has to collect millions of fdinfo and reg-files entries.
+ *
+ * Usage: fds <nr-fds> <pidfile>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+
+int main(int argc, char **argv)
+{
+	struct rlimit rl;
+	unsigned long nr, i;
+	FILE *f;
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s <nr-fds> <pidfile>\n", argv[0]);
+		return 1;
+	}
+
+	nr = strtoul(argv[1], NULL, 0);
+
+	rl.rlim_cur = rl.rlim_max = nr + 64;
+	if (setrlimit(RLIMIT_NOFILE, &rl)) {
+		perror("Can't raise fds limit");
+		return 1;
+	}
+
+	/* Each open makes a separate file, i.e. one reg-files entry */
+	for (i = 0; i < nr; i++) {
+		if (open("/dev/null", O_RDONLY) < 0) {
+			perror("Can't open file");
+			return 1;
+		}
+	}
+
+	if (daemon(1, 0)) {
+		perror("Can't daemonize");
+		return 1;
+	}
+
+	f = fopen(argv[2], "w");
+	if (!f)
+		return 1;
+	fprintf(f, "%d\n", getpid());
+	fclose(f);
+
+	while (1)
+		pause();
+
+	return 0;
+}
@@ -0,0 +1,40 @@
+#!/bin/bash
+#
+# Dumps a task with lots of files open and shows how long restore
+# prepares the shared resources, which is mostly reading the images.
+#
+# Usage: run.sh [nr-fds]
+
+source ../env.sh || exit 1
+
+NRFDS=${1:-1000000}
+IMGDIR="dump/"
+
+function fail {
+	echo "$@"
+	kill -9 $PID 2>/dev/null
+	exit 1
+}
+
+rm -rf "$IMGDIR" fds.pid
+mkdir "$IMGDIR"
+
+echo "Starting task with $NRFDS files"
+./fds $NRFDS fds.pid || fail "Can't start test"
+sleep 1
+PID=$(cat fds.pid)
+kill -0 $PID || fail "Test didn't start"
+
+echo "Dumping"
+${CRIU} dump -D "$IMGDIR" -o dump.log -t $PID || fail "Fail to dump"
+ls "$IMGDIR"/fdinfo-* "$IMGDIR"/reg-files.img | xargs du -sh
+
+echo "Restoring"
+/usr/bin/time -f "restore took %es, %MKb max rss" \
+	${CRIU} restore -D "$IMGDIR" -o restore.log -d || fail "Fail to restore"
+
+../../crit decode --pretty -i "$IMGDIR/stats-restore" | \
+	grep -E "prepare_time|forking_time|restore_time"
+
+kill -9 $PID
+echo PASS
@@ -0,0 +1,125 @@
+/*
+ * Micro-benchmark for the pagemap scanner used by generate_iovs().
+ *
+ * Synthetic pagemaps of different density are fed through the
+ * naive per-entry loop and through pme_find_mapped(), the results
+ * are compared and the timings are printed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "asm/int.h"
+#include "mem.h"
+#include "pme-scan.h"
+
+#define NR_PMES		(1UL << 24)	/* 64G of address space */
+#define NR_ROUNDS	8
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Puts runs of @run mapped pages every @stride entries */
+static void fill_map(u64 *map, unsigned long stride, unsigned long run)
+{
+	unsigned long i;
+
+	memset(map, 0, NR_PMES * sizeof(*map));
+	for (i = 0; i < NR_PMES; i++)
+		if (i % stride < run)
+			map[i] = PME_PRESENT | PME_SOFT_DIRTY | (i & PME_PFRAME_MASK);
+}
+
+static unsigned long find_mapped_naive(const u64 *map, unsigned long nr)
+{
+	unsigned long i;
+
+	for (i = 0; i < nr; i++)
+		if (map[i] & (PME_PRESENT | PME_SWAP))
+			break;
+
+	return i;
+}
+
+/* Walks the map the way generate_iovs does and counts mapped runs */
+static unsigned long walk(const u64 *map,
+		unsigned long (*find)(const u64 *map, unsigned long nr))
+{
+	unsigned long pfn = 0, runs = 0;
+
+	while (pfn < NR_PMES) {
+		pfn += find(map + pfn, NR_PMES - pfn);
+		if (pfn == NR_PMES)
+			break;
+
+		runs++;
+		while (pfn < NR_PMES && (map[pfn] & PME_PRESENT))
+			pfn++;
+	}
+
+	return runs;
+}
+
+static double bench(const u64 *map, unsigned long *runs,
+		unsigned long (*find)(const u64 *map, unsigned long nr))
+{
+	double start = now();
+	int i;
+
+	for (i = 0; i < NR_ROUNDS; i++)
+		*runs = walk(map, find);
+
+	return (now() - start) / NR_ROUNDS;
+}
+
+int main(int argc, char **argv)
+{
+	static const struct {
+		unsigned long stride, run;
+	} layouts[] = {
+		{ 1, 1 },		/* fully populated */
+		{ 64, 16 },		/* dense */
+		{ 4096, 8 },		/* sparse */
+		{ 1UL << 20, 1 },	/* almost empty */
+	};
+	unsigned int i;
+	u64 *map;
+	int ret = 0;
+
+	map = malloc(NR_PMES * sizeof(*map));
+	if (!map) {
+		perror("malloc");
+		return 1;
+	}
+
+	printf("%10s %6s %10s %10s %10s\n",
+			"stride", "run", "runs", "naive,ms", "scan,ms");
+
+	for (i = 0; i < sizeof(layouts) / sizeof(layouts[0]); i++) {
+		unsigned long runs_naive, runs_scan;
+		double t_naive, t_scan;
+
+		fill_map(map, layouts[i].stride, layouts[i].run);
+		t_naive = bench(map, &runs_naive, find_mapped_naive);
+		t_scan = bench(map, &runs_scan, pme_find_mapped);
+
+		printf("%10lu %6lu %10lu %10.2f %10.2f\n",
+				layouts[i].stride, layouts[i].run, runs_scan,
+				t_naive * 1000, t_scan * 1000);
+
+		if (runs_naive != runs_scan) {
+			printf("FAIL: %lu runs found, %lu expected\n",
+					runs_scan, runs_naive);
+			ret = 1;
+		}
+	}
+
+	free(map);
+	return ret;
+}
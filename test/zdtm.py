@@ -574,6 +574,23 @@ class criu_cli:
 		self.__fault = (opts['fault'])
 		self.__sat = (opts['sat'] and True or False)
 		self.__dedup = (opts['dedup'] and True or False)
+		self.__lazy_pages = (opts['lazy_pages'] and True or False)
+		self.__squash = (opts['squash'] and True or False)
+
+		self.__mem_opts = []
+		for o in ('compress', 'page_dedup', 'skip_zero_pages', 'archive', 'pagemap_fixed', 'hot_pages'):
+			if opts[o]:
+				self.__mem_opts += [ "--" + o.replace('_', '-') ]
+		if opts['dump_jobs']:
+			self.__mem_opts += [ "--dump-jobs", opts['dump_jobs'] ]
+
+		self.__pre_dump_opts = []
+		if opts['pre_dump_mode']:
+			self.__pre_dump_opts += [ "--pre-dump-mode", opts['pre_dump_mode'] ]
+
+		self.__dump_opts = []
+		if opts['downtime']:
+			self.__dump_opts += [ "--downtime", opts['downtime'] ]
 
 	def logs(self):
 		return self.__dump_path
@@ -660,6 +677,12 @@ class criu_cli:
 		if self.__dedup:
 			a_opts += [ "--auto-dedup" ]
 
+		a_opts += self.__mem_opts
+		if action == "pre-dump":
+			a_opts += self.__pre_dump_opts
+		else:
+			a_opts += self.__dump_opts
+
 		self.__criu_act(action, opts = a_opts + opts)
 
 		if self.__page_server:
@@ -672,9 +695,20 @@ class criu_cli:
 			self.__test.auto_reap = False
 		r_opts += self.__test.getropts()
 
+		if self.__squash and self.__prev_dump_iter > 1:
+			self.__criu_act("squash", opts = [])
+
+		if self.__lazy_pages:
+			print "Adding lazy-pages daemon"
+			self.__criu_act("lazy-pages", opts = [ "--daemon", "--pidfile", "lp.pid" ])
+			r_opts += [ "--lazy-pages" ]
+
 		self.__prev_dump_iter = None
 		self.__criu_act("restore", opts = r_opts + ["--restore-detached"])
 
+		if self.__lazy_pages:
+			wait_pid_die(int(rpidfile(self.__ddir() + "/lp.pid")), "lazy-pages daemon")
+
 	@staticmethod
 	def check(feature):
 		return criu_cli.__criu("check", ["-v0", "--feature", feature]) == 0
@@ -878,7 +912,10 @@ class launcher:
 		self.__show_progress()
 
 		nd = ('nocr', 'norst', 'pre', 'iters', 'page_server', 'sibling', \
-				'fault', 'keep_img', 'report', 'snaps', 'sat', 'dedup', 'sbs')
+				'fault', 'keep_img', 'report', 'snaps', 'sat', 'dedup', 'sbs', \
+				'dump_jobs', 'compress', 'page_dedup', 'skip_zero_pages', 'archive', \
+				'pagemap_fixed', 'pre_dump_mode', 'hot_pages', 'downtime', \
+				'lazy_pages', 'squash')
 		arg = repr((name, desc, flavor, { d: self.__opts[d] for d in nd }))
 
 		if self.__max > 1 and self.__total > 1:
@@ -1233,6 +1270,17 @@ rp.add_argument("--sat", help = "Generate criu strace-s for sat tool (restore is
 rp.add_argument("--sbs", help = "Do step-by-step execution, asking user for keypress to continue", action = 'store_true')
 
 rp.add_argument("--page-server", help = "Use page server dump", action = 'store_true')
+rp.add_argument("--dump-jobs", help = "Dump memory with that many workers")
+rp.add_argument("--compress", help = "Compress pages images", action = 'store_true')
+rp.add_argument("--page-dedup", help = "Store each page content once", action = 'store_true')
+rp.add_argument("--skip-zero-pages", help = "Don't put zero pages into images", action = 'store_true')
+rp.add_argument("--archive", help = "Put images into one archive", action = 'store_true')
+rp.add_argument("--pagemap-fixed", help = "Write pagemaps as fixed-size records", action = 'store_true')
+rp.add_argument("--pre-dump-mode", help = "How pre-dumps get memory", choices = [ 'splice', 'read' ])
+rp.add_argument("--hot-pages", help = "Record pages touched after the last pre-dump", action = 'store_true')
+rp.add_argument("--downtime", help = "Dump iteratively within this many ms of downtime")
+rp.add_argument("--lazy-pages", help = "Restore memory with lazy-pages daemon", action = 'store_true')
+rp.add_argument("--squash", help = "Squash snapshots before restore (with --pre or --snaps)", action = 'store_true')
 rp.add_argument("-p", "--parallel", help = "Run test in parallel")
 
 rp.add_argument("-k", "--keep-img", help = "Whether or not to keep images after test",
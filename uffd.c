@@ -0,0 +1,782 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "config.h"
+
+#ifdef CONFIG_HAS_UFFD
+#include <linux/userfaultfd.h>
+#endif
+
+#include "cr_options.h"
+#include "servicefd.h"
+#include "image.h"
+#include "page-read.h"
+#include "restorer.h"
+#include "syscall.h"
+#include "uffd.h"
+#include "util.h"
+#include "vma.h"
+#include "xmalloc.h"
+#include "list.h"
+#include "log.h"
+#include "hotmap.h"
+
+#include "protobuf.h"
+#include "protobuf/mm.pb-c.h"
+
+#undef	LOG_PREFIX
+#define LOG_PREFIX "lazy-pages: "
+
+#ifdef CONFIG_HAS_UFFD
+
+/* Lives in the work dir of both restore and lazy-pages */
+#define LAZY_PAGES_SOCK_NAME	"lazy-pages.socket"
+
+/* How many pages to copy at once when tasks don't fault */
+#define LAZY_PREFETCH_PAGES	64
+
+static int lazy_pages_sock_addr(struct sockaddr_un *saddr)
+{
+	memset(saddr, 0, sizeof(*saddr));
+	saddr->sun_family = AF_UNIX;
+	strcpy(saddr->sun_path, LAZY_PAGES_SOCK_NAME);
+
+	return sizeof(saddr->sun_family) + sizeof(LAZY_PAGES_SOCK_NAME);
+}
+
+/*
+ * The socket is shared by all the tasks being restored, so the
+ * pid and the uffd go in one message not to get mixed up.
+ */
+static int send_uffd(int sk, int pid, int uffd)
+{
+	struct msghdr h = { };
+	struct iovec iov = { .iov_base = &pid, .iov_len = sizeof(pid), };
+	char c[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr *ch;
+
+	h.msg_iov = &iov;
+	h.msg_iovlen = 1;
+	h.msg_control = c;
+	h.msg_controllen = sizeof(c);
+
+	ch = CMSG_FIRSTHDR(&h);
+	ch->cmsg_len = CMSG_LEN(sizeof(int));
+	ch->cmsg_level = SOL_SOCKET;
+	ch->cmsg_type = SCM_RIGHTS;
+	*((int *)CMSG_DATA(ch)) = uffd;
+
+	if (sendmsg(sk, &h, 0) != sizeof(pid)) {
+		pr_perror("Can't send uffd of %d to lazy-pages", pid);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int recv_uffd(int sk, int *pid, int *uffd)
+{
+	struct msghdr h = { };
+	struct iovec iov = { .iov_base = pid, .iov_len = sizeof(*pid), };
+	char c[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr *ch;
+	int ret;
+
+	h.msg_iov = &iov;
+	h.msg_iovlen = 1;
+	h.msg_control = c;
+	h.msg_controllen = sizeof(c);
+
+	ret = recvmsg(sk, &h, 0);
+	if (ret == 0)
+		return 0;
+	if (ret != sizeof(*pid)) {
+		pr_perror("Can't receive uffd (%d)", ret);
+		return -1;
+	}
+
+	ch = CMSG_FIRSTHDR(&h);
+	if (!ch || ch->cmsg_len != CMSG_LEN(sizeof(int)) ||
+			ch->cmsg_type != SCM_RIGHTS) {
+		pr_err("No uffd in message from %d\n", *pid);
+		return -1;
+	}
+
+	*uffd = *((int *)CMSG_DATA(ch));
+	return 1;
+}
+
+int prepare_lazy_pages_socket(void)
+{
+	struct sockaddr_un saddr;
+	int sk, len;
+
+	if (!opts.lazy_pages)
+		return 0;
+
+	sk = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (sk < 0) {
+		pr_perror("Can't create lazy-pages socket");
+		return -1;
+	}
+
+	len = lazy_pages_sock_addr(&saddr);
+	if (connect(sk, (struct sockaddr *)&saddr, len)) {
+		pr_perror("Can't connect to lazy-pages daemon");
+		close(sk);
+		return -1;
+	}
+
+	if (install_service_fd(LAZY_PAGES_SK_OFF, sk) < 0) {
+		close(sk);
+		return -1;
+	}
+
+	close(sk);
+	return 0;
+}
+
+/*
+ * Called by the task being restored, since the uffd is bound to
+ * the mm of the caller. The restorer registers the VMAs with it.
+ */
+int setup_uffd(int pid, struct task_restore_args *ta)
+{
+	struct uffdio_api api = { .api = UFFD_API, };
+	int uffd;
+
+	ta->uffd = -1;
+	if (!opts.lazy_pages)
+		return 0;
+
+	uffd = sys_userfaultfd(O_CLOEXEC | O_NONBLOCK);
+	if (uffd < 0) {
+		pr_err("Can't create userfaultfd: %d\n", uffd);
+		return -1;
+	}
+
+	if (ioctl(uffd, UFFDIO_API, &api)) {
+		pr_perror("Can't negotiate uffd API");
+		goto err;
+	}
+
+	if (!(api.ioctls & (1ULL << _UFFDIO_REGISTER))) {
+		pr_err("No UFFDIO_REGISTER in uffd (%#llx)\n",
+				(unsigned long long)api.ioctls);
+		goto err;
+	}
+
+	if (send_uffd(get_service_fd(LAZY_PAGES_SK_OFF), pid, uffd))
+		goto err;
+
+	pr_info("Sent uffd %d to lazy-pages\n", uffd);
+	ta->uffd = uffd;
+	return 0;
+
+err:
+	close(uffd);
+	return -1;
+}
+
+/* A part of the pagemap still not copied into the task */
+struct lazy_iov {
+	unsigned long		start;
+	unsigned long		end;
+	struct list_head	l;
+};
+
+struct lazy_pages_info {
+	int			pid;
+	int			uffd;
+
+	struct page_read	pr;
+	struct list_head	iovs;
+	void			*buf;
+
+	unsigned long		nr_fault;	/* copied on demand */
+	unsigned long		nr_prefetch;	/* copied in background */
+	unsigned long		nr_zero;
+
+	struct list_head	l;
+};
+
+static LIST_HEAD(lpis);
+static unsigned int nr_lpis;
+
+static int lpi_add_iov(struct lazy_pages_info *lpi,
+		unsigned long start, unsigned long end)
+{
+	struct lazy_iov *iov;
+
+	iov = xmalloc(sizeof(*iov));
+	if (!iov)
+		return -1;
+
+	iov->start = start;
+	iov->end = end;
+	list_add_tail(&iov->l, &lpi->iovs);
+	return 0;
+}
+
+/* Hot pages are restored before the task resumes, only the rest is lazy */
+static int lpi_add_cold_iovs(struct lazy_pages_info *lpi, struct hot_ranges *hr,
+			     unsigned long start, unsigned long end)
+{
+	while (start < end) {
+		unsigned long to;
+
+		if (hot_ranges_find(hr, start, &to)) {
+			start = to;
+			continue;
+		}
+
+		to = min(to, end);
+		if (lpi_add_iov(lpi, start, to))
+			return -1;
+		start = to;
+	}
+
+	return 0;
+}
+
+/*
+ * Collect the pages the daemon is to copy. These are the pagemap
+ * entries intersected with the VMAs registered by the restorer,
+ * the rest was restored the usual way. Each iov is kept within
+ * one pagemap entry to read it with one read_pages call.
+ */
+static int lpi_collect_iovs(struct lazy_pages_info *lpi)
+{
+	struct hot_ranges hr;
+	struct cr_img *img;
+	MmEntry *mm;
+	unsigned int i = 0;
+	int ret;
+
+	img = open_image(CR_FD_MM, O_RSTR, lpi->pid);
+	if (!img)
+		return -1;
+
+	ret = pb_read_one(img, &mm, PB_MM);
+	close_image(img);
+	if (ret < 0)
+		return -1;
+
+	if (hot_ranges_load(lpi->pid, &hr)) {
+		mm_entry__free_unpacked(mm, NULL);
+		return -1;
+	}
+
+	while (1) {
+		unsigned long start, end;
+		struct iovec iov;
+
+		ret = lpi->pr.get_pagemap(&lpi->pr, &iov);
+		if (ret <= 0)
+			break;
+
+		start = (unsigned long)iov.iov_base;
+		end = start + iov.iov_len;
+
+		/* Faults on zero pages are served with UFFDIO_ZEROPAGE */
+		if (lpi->pr.pe && lpi->pr.pe->zero)
+			goto next;
+
+		for (; i < mm->n_vmas; i++) {
+			VmaEntry *vma = mm->vmas[i];
+			unsigned long s, e;
+
+			if (vma->end <= start)
+				continue;
+			if (vma->start >= end)
+				break;
+			if (!vma_entry_can_be_lazy(vma))
+				continue;
+
+			s = max_t(unsigned long, vma->start, start);
+			e = min_t(unsigned long, vma->end, end);
+			if (lpi_add_cold_iovs(lpi, &hr, s, e)) {
+				ret = -1;
+				break;
+			}
+
+			if (vma->end > end)
+				break;
+		}
+next:
+		if (lpi->pr.put_pagemap)
+			lpi->pr.put_pagemap(&lpi->pr);
+		if (ret < 0)
+			break;
+	}
+
+	hot_ranges_free(&hr);
+	mm_entry__free_unpacked(mm, NULL);
+	return ret;
+}
+
+static void lpi_fini(struct lazy_pages_info *lpi)
+{
+	struct lazy_iov *iov, *n;
+
+	pr_info("%d: %lu pages on fault, %lu in background, %lu zero\n",
+			lpi->pid, lpi->nr_fault, lpi->nr_prefetch, lpi->nr_zero);
+
+	list_for_each_entry_safe(iov, n, &lpi->iovs, l)
+		xfree(iov);
+
+	if (lpi->pr.close)
+		lpi->pr.close(&lpi->pr);
+	close_safe(&lpi->uffd);
+	xfree(lpi->buf);
+	list_del(&lpi->l);
+	nr_lpis--;
+	xfree(lpi);
+}
+
+static int lpi_open_pr(struct lazy_pages_info *lpi)
+{
+	int ret;
+
+	ret = open_page_read(lpi->pid, &lpi->pr, PR_TASK | PR_MMAP);
+	if (ret <= 0) {
+		pr_err("No pagemap for %d\n", lpi->pid);
+		lpi->pr.close = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int lpi_init(int pid, int uffd)
+{
+	struct lazy_pages_info *lpi;
+	int ret;
+
+	lpi = xzalloc(sizeof(*lpi));
+	if (!lpi) {
+		close(uffd);
+		return -1;
+	}
+
+	lpi->pid = pid;
+	lpi->uffd = uffd;
+	INIT_LIST_HEAD(&lpi->iovs);
+	list_add_tail(&lpi->l, &lpis);
+	nr_lpis++;
+
+	lpi->buf = xmalloc(LAZY_PREFETCH_PAGES * PAGE_SIZE);
+	if (!lpi->buf)
+		goto err;
+
+	if (lpi_open_pr(lpi))
+		goto err;
+
+	ret = lpi_collect_iovs(lpi);
+
+	/* The page_read only goes forward, rewind it */
+	lpi->pr.close(&lpi->pr);
+	lpi->pr.close = NULL;
+	if (ret < 0)
+		goto err;
+
+	/*
+	 * Nothing is lazy, the task won't fault and there is nothing
+	 * to prefetch. Closing the uffd leaves any zero pages to the
+	 * kernel.
+	 */
+	if (list_empty(&lpi->iovs)) {
+		pr_info("%d: no lazy pages\n", pid);
+		lpi_fini(lpi);
+		return 0;
+	}
+
+	if (lpi_open_pr(lpi))
+		goto err;
+
+	pr_info("%d: got uffd %d\n", pid, uffd);
+	return 0;
+
+err:
+	lpi_fini(lpi);
+	return -1;
+}
+
+static int lpi_read_pages(struct lazy_pages_info *lpi,
+		unsigned long addr, int nr)
+{
+	/* Pagemap of records is sought back without reopening */
+	if (addr < lpi->pr.cvaddr && !lpi->pr.pm_recs) {
+		pr_debug("%d: rewind page read to %lx\n", lpi->pid, addr);
+		lpi->pr.close(&lpi->pr);
+		lpi->pr.close = NULL;
+		if (lpi_open_pr(lpi))
+			return -1;
+	}
+
+	if (seek_pagemap_page(&lpi->pr, addr, true) <= 0)
+		return -1;
+
+	return lpi->pr.read_pages(&lpi->pr, addr, nr, lpi->buf, 0) < 0 ? -1 : 0;
+}
+
+/*
+ * Returns 1 if the task is gone and the uffd is of no use anymore.
+ */
+static int uffd_copy(struct lazy_pages_info *lpi, unsigned long addr, int nr)
+{
+	struct uffdio_copy uc;
+	int i;
+
+	if (lpi_read_pages(lpi, addr, nr))
+		return -1;
+
+	uc.dst = addr;
+	uc.src = (unsigned long)lpi->buf;
+	uc.len = nr * PAGE_SIZE;
+	uc.mode = 0;
+	uc.copy = 0;
+
+	if (!ioctl(lpi->uffd, UFFDIO_COPY, &uc))
+		return 0;
+
+	if (errno == ESRCH || errno == ENOENT)
+		return 1;
+	if (errno != EEXIST) {
+		pr_perror("%d: Can't copy %d pages to %lx", lpi->pid, nr, addr);
+		return -1;
+	}
+
+	/*
+	 * Some page is already there, copy the rest page by page
+	 * not to leave holes behind it.
+	 */
+	for (i = 0; i < nr; i++) {
+		uc.dst = addr + i * PAGE_SIZE;
+		uc.src = (unsigned long)lpi->buf + i * PAGE_SIZE;
+		uc.len = PAGE_SIZE;
+		uc.copy = 0;
+
+		if (ioctl(lpi->uffd, UFFDIO_COPY, &uc) && errno != EEXIST) {
+			pr_perror("%d: Can't copy page to %llx", lpi->pid,
+					(unsigned long long)uc.dst);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int uffd_zero(struct lazy_pages_info *lpi, unsigned long addr)
+{
+	struct uffdio_zeropage uz;
+
+	uz.range.start = addr;
+	uz.range.len = PAGE_SIZE;
+	uz.mode = 0;
+
+	if (!ioctl(lpi->uffd, UFFDIO_ZEROPAGE, &uz))
+		return 0;
+
+	if (errno == ESRCH || errno == ENOENT)
+		return 1;
+	if (errno == EEXIST)
+		return 0;
+
+	pr_perror("%d: Can't zero page at %lx", lpi->pid, addr);
+	return -1;
+}
+
+/*
+ * Pages not in the iovs are either copied already or are not in
+ * the images, i.e. were never touched or were madvise-d away. Both
+ * read as zeroes.
+ */
+static int handle_page_fault(struct lazy_pages_info *lpi, unsigned long addr)
+{
+	struct lazy_iov *iov;
+	int ret;
+
+	addr &= PAGE_MASK;
+
+	list_for_each_entry(iov, &lpi->iovs, l) {
+		if (addr < iov->start || addr >= iov->end)
+			continue;
+
+		ret = uffd_copy(lpi, addr, 1);
+		if (ret)
+			return ret;
+
+		lpi->nr_fault++;
+
+		if (addr == iov->start)
+			iov->start += PAGE_SIZE;
+		else if (addr + PAGE_SIZE == iov->end)
+			iov->end -= PAGE_SIZE;
+		else {
+			struct lazy_iov *tail;
+
+			tail = xmalloc(sizeof(*tail));
+			if (!tail)
+				return -1;
+
+			tail->start = addr + PAGE_SIZE;
+			tail->end = iov->end;
+			iov->end = addr;
+			list_add(&tail->l, &iov->l);
+		}
+
+		if (iov->start == iov->end) {
+			list_del(&iov->l);
+			xfree(iov);
+		}
+
+		return 0;
+	}
+
+	ret = uffd_zero(lpi, addr);
+	if (!ret)
+		lpi->nr_zero++;
+	return ret;
+}
+
+static int handle_uffd_events(struct lazy_pages_info *lpi)
+{
+	struct uffd_msg msg;
+	int ret;
+
+	while (1) {
+		ret = read(lpi->uffd, &msg, sizeof(msg));
+		if (ret < 0) {
+			if (errno == EAGAIN)
+				return 0;
+			pr_perror("%d: Can't read uffd message", lpi->pid);
+			return -1;
+		}
+
+		if (ret != sizeof(msg)) {
+			pr_err("%d: Short uffd message %d\n", lpi->pid, ret);
+			return -1;
+		}
+
+		if (msg.event != UFFD_EVENT_PAGEFAULT) {
+			pr_err("%d: Unexpected uffd event %u\n", lpi->pid, msg.event);
+			return -1;
+		}
+
+		pr_debug("%d: fault at %llx\n", lpi->pid,
+				(unsigned long long)msg.arg.pagefault.address);
+
+		ret = handle_page_fault(lpi, msg.arg.pagefault.address);
+		if (ret)
+			return ret;
+	}
+}
+
+/*
+ * Copies the next chunk of the task's pages. The page_read goes
+ * forward most of the time this way.
+ */
+static int prefetch_pages(struct lazy_pages_info *lpi)
+{
+	struct lazy_iov *iov;
+	int nr, ret;
+
+	iov = list_first_entry(&lpi->iovs, struct lazy_iov, l);
+	nr = min_t(unsigned long, (iov->end - iov->start) / PAGE_SIZE,
+			LAZY_PREFETCH_PAGES);
+
+	ret = uffd_copy(lpi, iov->start, nr);
+	if (ret)
+		return ret;
+
+	lpi->nr_prefetch += nr;
+	iov->start += nr * PAGE_SIZE;
+	if (iov->start == iov->end) {
+		list_del(&iov->l);
+		xfree(iov);
+	}
+
+	return 0;
+}
+
+static int lazy_pages_serve(int sk)
+{
+	struct lazy_pages_info *lpi, *n;
+	int ret = 0;
+
+	while (sk >= 0 || nr_lpis) {
+		struct pollfd pfds[nr_lpis + 1];
+		struct lazy_pages_info *lpiv[nr_lpis + 1];
+		int i, nr = 0, timeout = -1;
+
+		if (sk >= 0) {
+			pfds[nr].fd = sk;
+			pfds[nr].events = POLLIN;
+			lpiv[nr++] = NULL;
+		}
+
+		list_for_each_entry(lpi, &lpis, l) {
+			pfds[nr].fd = lpi->uffd;
+			pfds[nr].events = POLLIN;
+			lpiv[nr++] = lpi;
+			if (!list_empty(&lpi->iovs))
+				timeout = 0;
+		}
+
+		ret = poll(pfds, nr, timeout);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			pr_perror("Can't poll uffds");
+			break;
+		}
+
+		if (ret == 0) {
+			/* Nobody faults, push the pages of the first task */
+			list_for_each_entry(lpi, &lpis, l)
+				if (!list_empty(&lpi->iovs))
+					break;
+
+			ret = prefetch_pages(lpi);
+			if (ret < 0)
+				break;
+
+			/* Round-robin between the tasks */
+			list_move_tail(&lpi->l, &lpis);
+			if (ret || list_empty(&lpi->iovs))
+				lpi_fini(lpi);
+			ret = 0;
+			continue;
+		}
+
+		for (i = 0; i < nr; i++) {
+			if (!pfds[i].revents)
+				continue;
+
+			if (!lpiv[i]) {
+				int pid, uffd;
+
+				ret = recv_uffd(sk, &pid, &uffd);
+				if (ret < 0)
+					goto out;
+				if (ret == 0) {
+					pr_info("Restore is over\n");
+					close_safe(&sk);
+				} else if (lpi_init(pid, uffd))
+					goto out;
+				continue;
+			}
+
+			ret = handle_uffd_events(lpiv[i]);
+			if (ret < 0)
+				goto out;
+			if (ret > 0 || list_empty(&lpiv[i]->iovs))
+				lpi_fini(lpiv[i]);
+		}
+
+		ret = 0;
+	}
+
+out:
+	list_for_each_entry_safe(lpi, n, &lpis, l)
+		lpi_fini(lpi);
+	close_safe(&sk);
+
+	return ret < 0 ? -1 : 0;
+}
+
+int cr_lazy_pages(bool daemon_mode)
+{
+	struct sockaddr_un saddr;
+	int sk, ask, len, ret;
+
+	sk = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (sk < 0) {
+		pr_perror("Can't create lazy-pages socket");
+		return -1;
+	}
+
+	len = lazy_pages_sock_addr(&saddr);
+	unlink(saddr.sun_path);
+	if (bind(sk, (struct sockaddr *)&saddr, len)) {
+		pr_perror("Can't bind lazy-pages socket");
+		goto err;
+	}
+
+	if (listen(sk, 1)) {
+		pr_perror("Can't listen on lazy-pages socket");
+		goto err;
+	}
+
+	if (daemon_mode) {
+		ret = cr_daemon(1, 0, &sk, -1);
+		if (ret == -1) {
+			pr_err("Can't run in the background\n");
+			goto err;
+		}
+		if (ret > 0) { /* parent task, daemon started */
+			close(sk);
+			if (opts.pidfile) {
+				if (write_pidfile(ret) == -1) {
+					pr_perror("Can't write pidfile");
+					kill(ret, SIGKILL);
+					waitpid(ret, NULL, 0);
+					return -1;
+				}
+			}
+
+			return 0;
+		}
+	}
+
+	pr_info("Waiting for restore on %s\n", saddr.sun_path);
+
+	ask = accept(sk, NULL, NULL);
+	close(sk);
+	unlink(saddr.sun_path);
+	if (ask < 0) {
+		pr_perror("Can't accept restore connection");
+		ret = -1;
+	} else
+		ret = lazy_pages_serve(ask);
+
+	if (daemon_mode)
+		exit(ret ? 1 : 0);
+
+	return ret;
+
+err:
+	close(sk);
+	return -1;
+}
+
+#else /* CONFIG_HAS_UFFD */
+
+int prepare_lazy_pages_socket(void)
+{
+	return 0;
+}
+
+int setup_uffd(int pid, struct task_restore_args *ta)
+{
+	ta->uffd = -1;
+	return 0;
+}
+
+int cr_lazy_pages(bool daemon_mode)
+{
+	pr_err("CRIU is built without userfaultfd support\n");
+	return -1;
+}
+
+#endif /* CONFIG_HAS_UFFD */
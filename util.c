@@ -528,6 +528,9 @@ int cr_system_userns(int in, int out, int err, char *cmd,
 		return -1;
 	}
 
+	/* The child's output may go to the log */
+	log_flush();
+
 	pid = fork();
 	if (pid == -1) {
 		pr_perror("fork() failed");